@@ -0,0 +1,214 @@
+#ifndef __DISPLAYFORMAT_HPP
+#define __DISPLAYFORMAT_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+// Binary asset format shared by xbm2bin, psf2bin and the loaders.
+//
+// A 64 byte header is followed by the pixel data, which starts on a 64 byte
+// boundary so a loader can map the file and use the data in place. All
+// header fields are 32 bit little endian whatever the host.
+//
+// offset  field
+//  0      magic "DSPF"
+//  4      version
+//  8      type, DISPLAYFORMAT_BITMAP or DISPLAYFORMAT_FONT
+// 12      width in pixels (of each character for fonts)
+// 16      height in pixels
+// 20      colour bit depth, laid out as DisplayImage::m_img
+// 24      number of characters, 1 for bitmaps
+// 28      stride, bytes per row
+// 32      offset of the pixel data from the start of the header
+// 36      size of the pixel data in bytes
+// 40      Adler-32 checksum of the pixel data
+// 44      compression, DISPLAYFORMAT_NONE or DISPLAYFORMAT_PACKBITS
+// 48      bytes of compressed data following the header when compressed
+// 52      reserved, written as zero
+//
+// Compressed pixel data is PackBits over the whole buffer. A control byte n
+// of 0 to 127 is followed by n+1 literal bytes, 129 to 255 by one byte to
+// repeat 257-n times and 128 is ignored. Compressed data is read and
+// expanded so it cannot be mapped, but mostly empty 1 bit images shrink to
+// a fraction of the flash reads.
+
+#define DISPLAYFORMAT_MAGIC "DSPF"
+#define DISPLAYFORMAT_VERSION 1
+#define DISPLAYFORMAT_HEADER_SIZE 64
+#define DISPLAYFORMAT_ALIGN 64
+
+#define DISPLAYFORMAT_BITMAP 1
+#define DISPLAYFORMAT_FONT 2
+
+#define DISPLAYFORMAT_NONE 0
+#define DISPLAYFORMAT_PACKBITS 1
+
+typedef struct{
+  uint32_t version ;
+  uint32_t type ;
+  uint32_t width ;
+  uint32_t height ;
+  uint32_t bitdepth ;
+  uint32_t chars ;
+  uint32_t stride ;
+  uint32_t offset ;
+  uint32_t size ;
+  uint32_t checksum ;
+  uint32_t compression ;
+  uint32_t packed ;
+} DisplayFormatHeader ;
+
+static inline void displayFormatPut32(unsigned char *p, uint32_t v)
+{
+  p[0] = v & 0xFF ;
+  p[1] = (v >> 8) & 0xFF ;
+  p[2] = (v >> 16) & 0xFF ;
+  p[3] = (v >> 24) & 0xFF ;
+}
+
+static inline uint32_t displayFormatGet32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24) ;
+}
+
+// Adler-32 of the pixel data
+static inline uint32_t displayFormatChecksum(const unsigned char *p, size_t len)
+{
+  uint32_t a = 1, b = 0 ;
+  size_t block = 0 ;
+
+  while (len > 0){
+    // Largest block which cannot overflow b before the modulo
+    block = len < 5552 ? len : 5552 ;
+    len -= block ;
+    while (block--){
+      a += *p++ ;
+      b += a ;
+    }
+    a %= 65521 ;
+    b %= 65521 ;
+  }
+  return (b << 16) | a ;
+}
+
+// Write hdr into the DISPLAYFORMAT_HEADER_SIZE bytes at buf
+static inline void displayFormatWriteHeader(unsigned char *buf, const DisplayFormatHeader &hdr)
+{
+  memset(buf, 0, DISPLAYFORMAT_HEADER_SIZE) ;
+  memcpy(buf, DISPLAYFORMAT_MAGIC, 4) ;
+  displayFormatPut32(buf + 4, hdr.version) ;
+  displayFormatPut32(buf + 8, hdr.type) ;
+  displayFormatPut32(buf + 12, hdr.width) ;
+  displayFormatPut32(buf + 16, hdr.height) ;
+  displayFormatPut32(buf + 20, hdr.bitdepth) ;
+  displayFormatPut32(buf + 24, hdr.chars) ;
+  displayFormatPut32(buf + 28, hdr.stride) ;
+  displayFormatPut32(buf + 32, hdr.offset) ;
+  displayFormatPut32(buf + 36, hdr.size) ;
+  displayFormatPut32(buf + 40, hdr.checksum) ;
+  displayFormatPut32(buf + 44, hdr.compression) ;
+  displayFormatPut32(buf + 48, hdr.packed) ;
+}
+
+// True if buf starts with the format magic
+static inline bool displayFormatIsHeader(const unsigned char *buf)
+{
+  return memcmp(buf, DISPLAYFORMAT_MAGIC, 4) == 0 ;
+}
+
+// Read the DISPLAYFORMAT_HEADER_SIZE bytes at buf into hdr. Returns false if
+// the magic or version is not recognised or the layout is inconsistent.
+static inline bool displayFormatReadHeader(const unsigned char *buf, DisplayFormatHeader *hdr)
+{
+  if (!displayFormatIsHeader(buf)) return false ;
+  hdr->version = displayFormatGet32(buf + 4) ;
+  hdr->type = displayFormatGet32(buf + 8) ;
+  hdr->width = displayFormatGet32(buf + 12) ;
+  hdr->height = displayFormatGet32(buf + 16) ;
+  hdr->bitdepth = displayFormatGet32(buf + 20) ;
+  hdr->chars = displayFormatGet32(buf + 24) ;
+  hdr->stride = displayFormatGet32(buf + 28) ;
+  hdr->offset = displayFormatGet32(buf + 32) ;
+  hdr->size = displayFormatGet32(buf + 36) ;
+  hdr->checksum = displayFormatGet32(buf + 40) ;
+  hdr->compression = displayFormatGet32(buf + 44) ;
+  hdr->packed = displayFormatGet32(buf + 48) ;
+
+  if (hdr->version != DISPLAYFORMAT_VERSION) return false ;
+  if (hdr->offset < DISPLAYFORMAT_HEADER_SIZE || hdr->offset % DISPLAYFORMAT_ALIGN) return false ;
+  if (hdr->width == 0 || hdr->height == 0 || hdr->chars == 0) return false ;
+  // Each product is below 2^64 so cannot wrap to match size
+  uint64_t rows = (uint64_t)hdr->stride * hdr->height ;
+  if (rows > 0xFFFFFFFF || rows * hdr->chars != hdr->size) return false ;
+  if (hdr->compression > DISPLAYFORMAT_PACKBITS) return false ;
+  if (hdr->compression == DISPLAYFORMAT_PACKBITS && hdr->packed == 0) return false ;
+  return true ;
+}
+
+// PackBits compress len bytes of src into dst, which must hold at least
+// len + len/128 + 1 bytes. Returns the compressed size.
+static inline size_t displayFormatPackBits(const unsigned char *src, size_t len, unsigned char *dst)
+{
+  size_t in = 0, out = 0, run = 0, start = 0 ;
+
+  while (in < len){
+    run = 1 ;
+    while (in + run < len && run < 128 && src[in+run] == src[in]) run++ ;
+
+    if (run >= 3){
+      // Repeated byte
+      dst[out++] = (unsigned char)(257 - run) ;
+      dst[out++] = src[in] ;
+      in += run ;
+    }else{
+      // Literal bytes up to the next run of 3
+      start = in ;
+      while (in < len && in - start < 128){
+	if (in + 2 < len && src[in] == src[in+1] && src[in] == src[in+2]) break ;
+	in++ ;
+      }
+      dst[out++] = (unsigned char)(in - start - 1) ;
+      memcpy(dst + out, src + start, in - start) ;
+      out += in - start ;
+    }
+  }
+  return out ;
+}
+
+// Write an asset to f. The caller fills in the version, type, dimensions,
+// bit depth, chars, stride and size fields and the rest are set here.
+// With bCompress the pixel data is PackBits compressed if that makes it smaller.
+static inline bool displayFormatWrite(FILE *f, DisplayFormatHeader &hdr, const unsigned char *data, bool bCompress)
+{
+  unsigned char header[DISPLAYFORMAT_HEADER_SIZE] ;
+  unsigned char *packed = NULL ;
+  bool bOk = true ;
+
+  hdr.offset = DISPLAYFORMAT_HEADER_SIZE ;
+  hdr.checksum = displayFormatChecksum(data, hdr.size) ;
+  hdr.compression = DISPLAYFORMAT_NONE ;
+  hdr.packed = 0 ;
+
+  if (bCompress){
+    packed = new unsigned char[hdr.size + hdr.size/128 + 1] ;
+    hdr.packed = displayFormatPackBits(data, hdr.size, packed) ;
+    if (hdr.packed < hdr.size){
+      hdr.compression = DISPLAYFORMAT_PACKBITS ;
+      data = packed ;
+    }else{
+      hdr.packed = 0 ; // no smaller so store as is
+    }
+  }
+
+  displayFormatWriteHeader(header, hdr) ;
+  if (fwrite(header, 1, DISPLAYFORMAT_HEADER_SIZE, f) != DISPLAYFORMAT_HEADER_SIZE) bOk = false ;
+  else if (hdr.compression == DISPLAYFORMAT_PACKBITS) bOk = fwrite(data, 1, hdr.packed, f) == hdr.packed ;
+  else bOk = fwrite(data, 1, hdr.size, f) == hdr.size ;
+
+  if (packed) delete[] packed ;
+  return bOk ;
+}
+
+#endif
@@ -1,14 +1,31 @@
 #include "displayimage.hpp"
+#include "pixelformat.hpp"
+#include "displaysimd.hpp"
+#include "displayformat.hpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "jpeglib.h"
 #include <math.h>
+#include <limits.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
 
 DisplayImage::DisplayImage()
+{
+  init() ;
+}
+
+void DisplayImage::init()
 {
   m_img = NULL ;
+  m_pMap = NULL ;
+  m_nMapSize = 0 ;
   m_width = 0 ;
   m_height = 0 ;
   m_bResourceImage = false ;
@@ -19,15 +36,33 @@ DisplayImage::DisplayImage()
   m_bg_r = m_bg_g = m_bg_b = m_bg_a = 255;
   m_bg_grey = 255;
   m_fg_grey = 0 ;
+  m_dither = DISPLAY_DITHER_NONE ;
+  m_nDirty = 0 ;
+  m_pStats = NULL ;
+  m_bClip = false ;
 }
 DisplayImage::~DisplayImage()
 {
-  if (!m_bResourceImage && m_img) delete[] m_img ; // remove allocated image
+  releaseImg() ;
+  if (m_pStats) delete m_pStats ;
 }
 
-DisplayImage& DisplayImage::operator=(const DisplayImage &img)
+void DisplayImage::releaseImg()
 {
+  if (m_pMap) munmap(m_pMap, m_nMapSize) ; // mapped from an asset file
+  else if (!m_bResourceImage && m_img) delete[] m_img ; // remove allocated image
   m_img = NULL ;
+  m_pMap = NULL ;
+  m_nMapSize = 0 ;
+  m_memsize = 0 ;
+  m_bResourceImage = false ;
+}
+
+DisplayImage& DisplayImage::operator=(const DisplayImage &img)
+{
+  if (this == &img) return *this ;
+  releaseImg() ;
+
   m_width = img.m_width ;
   m_height = img.m_height ;
   m_bResourceImage = img.m_bResourceImage ;
@@ -44,9 +79,13 @@ DisplayImage& DisplayImage::operator=(const DisplayImage &img)
   m_bg_a = img.m_bg_a;
   m_bg_grey = img.m_bg_grey;
   m_fg_grey = img.m_fg_grey;
+  m_dither = img.m_dither ;
+  m_nDirty = 0 ;
+  m_bClip = false ; // copy every pixel whatever the old clip
 
   if (m_bResourceImage){
     m_img = img.m_img ;
+    markDirty(0, 0, m_width-1, m_height-1) ;
   }else{
     if (createImage(m_width, m_height, m_colourbitdepth))
       copy(img) ;
@@ -54,6 +93,8 @@ DisplayImage& DisplayImage::operator=(const DisplayImage &img)
       throw "Cannot create new image" ;
   }
 
+  m_clip = img.m_clip ;
+  m_bClip = img.m_bClip ;
   return *this ;
 }
 
@@ -67,64 +108,227 @@ static void jpgfile_error_exit(j_common_ptr cinfo)
   throw -1 ;
 }
 
-#define to565(r,g,b)                                            \
-  ((((r) >> 3) << 11) | (((g) >> 2) << 5) | ((b) >> 3))
-
-#define from565_r(x) ((((x) >> 11) & 0x1f) * 255 / 31)
-#define from565_g(x) ((((x) >> 5) & 0x3f) * 255 / 63)
-#define from565_b(x) (((x) & 0x1f) * 255 / 31)
+// Pixels converted at a time when run length encoding 565 output
+#define OUT565_BLOCK 256
 
 uint16_t* DisplayImage::out565(uint16_t *outbuff, bool bRle)
 {
-  uint16_t *pOut = NULL, *p = NULL, last = 0, count = 0, colour = 0;
+  Display565Encoder encoder ;
+  uint16_t *pOut = NULL ;
+  size_t words = 0 ;
+
   if (!m_img) return NULL ; // no image
+  if (!encoder.begin(*this, bRle)) return NULL ; // not yet supported
+
+  // Worst case, RLE can be 2x as big as the original file if every pixel
+  // is different
+  words = (size_t)m_width * m_height * (bRle?2:1) ;
+
+  // convert to 16 bit colour depth
+  if (outbuff){
+    pOut = outbuff ;
+  }else{
+    pOut = new uint16_t[words] ;
+    if (!pOut) return NULL ;
+    memset(pOut, 0, words * sizeof(uint16_t)) ;
+  }
+
+  encoder.encode(pOut, words * sizeof(uint16_t)) ;
+
+  return pOut ;
+}
+
+unsigned char* DisplayImage::outPages(unsigned char *outbuff, const DisplayRect *window)
+{
+  DisplayRect r ;
+  unsigned char *pOut = NULL, *pPage = NULL ;
+  unsigned int cols = 0, pages = 0, first = 0, bytes = 0, rows = 0 ;
+
+  if (!m_img || m_colourbitdepth != 1) return NULL ;
+
+  r.x0 = r.y0 = 0 ;
+  r.x1 = m_width - 1 ;
+  r.y1 = m_height - 1 ;
+  if (window){
+    if (window->x0 > r.x0) r.x0 = window->x0 ;
+    if (window->y0 > r.y0) r.y0 = window->y0 ;
+    if (window->x1 < r.x1) r.x1 = window->x1 ;
+    if (window->y1 < r.y1) r.y1 = window->y1 ;
+    if (r.x0 > r.x1 || r.y0 > r.y1) return NULL ;
+  }
+
+  cols = r.x1 - r.x0 + 1 ;
+  pages = (r.y1/8) - (r.y0/8) + 1 ;
+  first = r.x0/8 ; // first source byte of a row
+  bytes = (r.x1/8) - first + 1 ;
+
+  if (outbuff){
+    pOut = outbuff ;
+  }else{
+    pOut = new unsigned char[cols * pages] ;
+    if (!pOut) return NULL ;
+  }
+
+  // Columns which do not start and end on a source byte are packed into a
+  // scratch page and the window copied out
+  if (r.x0 % 8 || cols != bytes*8){
+    pPage = new unsigned char[bytes*8] ;
+    if (!pPage){
+      if (!outbuff) delete[] pOut ;
+      return NULL ;
+    }
+  }
 
-  if (m_colourbitdepth == 32 || m_colourbitdepth == 24 || m_colourbitdepth == 8){
-    // convert to 16 bit colour depth
-    if (outbuff){
-      pOut = outbuff ;
+  for (unsigned int p=0; p < pages; p++){
+    unsigned int y = ((r.y0/8) + p) * 8 ;
+    rows = m_height - y < 8?m_height - y:8 ;
+    if (pPage){
+      simdPackPage(m_img + (y*m_stride) + first, m_stride, rows, pPage, bytes) ;
+      memcpy(pOut + (p*cols), pPage + (r.x0 % 8), cols) ;
     }else{
-      if (bRle){
-	// Worst case, RLE can be 2x as big as the original file if every pixel
-	// is different
-	pOut = new uint16_t[m_width * m_height *2] ;
-	memset(pOut, 0, m_width * m_height * 2) ;
-      }else{
-	pOut = new uint16_t[m_width * m_height] ;
-	memset(pOut, 0, m_width * m_height) ;
-      }
+      simdPackPage(m_img + (y*m_stride) + first, m_stride, rows, pOut + (p*cols), bytes) ;
     }
-    p = pOut ;
-    if (!pOut) return NULL ;
+  }
+
+  if (pPage) delete[] pPage ;
+  return pOut ;
+}
+
+Display565Encoder::Display565Encoder()
+{
+  m_pImg = NULL ;
+  m_pRow = NULL ;
+  m_nRow = 0 ;
+  m_bDither = false ;
+  m_nPixel = 0 ;
+  m_bRle = false ;
+  m_bComplete = true ;
+  m_last = 0 ;
+  m_count = 0 ;
+}
+
+Display565Encoder::~Display565Encoder()
+{
+  if (m_pRow) delete[] m_pRow ;
+}
+
+bool Display565Encoder::begin(const DisplayImage &img, bool bRle)
+{
+  m_pImg = NULL ;
+  m_bComplete = true ;
+  if (!img.m_img) return false ; // no image
+  if (img.m_colourbitdepth != 32 && img.m_colourbitdepth != 24 &&
+      img.m_colourbitdepth != 16 && img.m_colourbitdepth != 8){
+    return false ; // not yet supported
+  }
+
+  // Dithered rows are converted one at a time. 16 bit images are already 565.
+  m_bDither = img.m_dither != DISPLAY_DITHER_NONE && img.m_colourbitdepth != 16 ;
+  if (m_pRow) delete[] m_pRow ;
+  m_pRow = NULL ;
+  if (m_bDither){
+    unsigned char fg[4], bg[4] ;
+    img.getPixelPattern(true, fg, 16) ;
+    img.getPixelPattern(false, bg, 16) ;
+    m_converter.begin(img.m_colourbitdepth, 16, img.m_width, fg, bg, img.m_fg_grey, img.m_bg_grey, img.m_dither) ;
+    m_pRow = new unsigned char[img.m_width * 2] ;
+    m_nRow = ~0u ;
+  }
+
+  m_pImg = &img ;
+  m_nPixel = 0 ;
+  m_bRle = bRle ;
+  m_bComplete = false ;
+  m_last = 0 ;
+  m_count = 0 ;
+  return true ;
+}
+
+unsigned int Display565Encoder::fetch(uint16_t *dst, unsigned int n)
+{
+  unsigned int width = m_pImg->m_width ;
+  unsigned int row = m_nPixel / width, x = m_nPixel % width ;
+
+  if (!m_bDither){
+    simd565Convert(m_pImg->m_img + (m_nPixel*(m_pImg->m_colourbitdepth/8)), m_pImg->m_colourbitdepth, dst, n) ;
+    return n ;
+  }
+
+  // Rows are only ever needed again or in order, which the error diffusion relies on
+  if (row != m_nRow){
+    m_converter.convert(m_pImg->m_img + (row*m_pImg->m_stride), m_pRow) ;
+    m_nRow = row ;
+  }
+  if (n > width - x) n = width - x ;
+  for (unsigned int i=0; i < n; i++) dst[i] = (m_pRow[(x+i)*2] << 8) | m_pRow[((x+i)*2)+1] ;
+  return n ;
+}
+
+size_t Display565Encoder::encode(uint16_t *buff, size_t bytes)
+{
+  unsigned int pixels = 0, n = 0 ;
+  size_t room = bytes / sizeof(uint16_t) ;
+  uint16_t *p = buff ;
+
+  if (m_bComplete || !m_pImg || !buff) return 0 ;
+  if (room < (m_bRle?2u:1u)) return (size_t)-1 ; // 0 would read as done
+
+  pixels = m_pImg->m_width * m_pImg->m_height ;
+
+  if (!m_bRle){
+    while (room > 0 && m_nPixel < pixels){
+      n = pixels - m_nPixel ;
+      if (n > room) n = room ;
+      n = fetch(p, n) ;
+      p += n ;
+      room -= n ;
+      m_nPixel += n ;
+    }
+    if (m_nPixel >= pixels) m_bComplete = true ;
+    return (p - buff) * sizeof(uint16_t) ;
+  }
 
-    for (unsigned int i=0; i < m_width * m_height; i++){
-      if (m_colourbitdepth == 32 || m_colourbitdepth == 24){
-	colour = to565(m_img[(i*(m_colourbitdepth/8))], m_img[(i*(m_colourbitdepth/8))+1], m_img[(i*(m_colourbitdepth/8))+2]);
-      }else if (m_colourbitdepth == 8){
-	colour = to565(m_img[i], m_img[i], m_img[i]) ;
+  // Convert a block at a time then find runs with vector compares. Pixels
+  // join the pending run without needing output space so only stop when a
+  // finished run has nowhere to go.
+  uint16_t block[OUT565_BLOCK] ;
+  unsigned int i = 0, run = 0, max = 0 ;
+
+  while (room >= 2){
+    if (m_nPixel >= pixels){
+      if (m_count > 0){
+	*p++ = m_count ;
+	*p++ = m_last ;
+	m_count = 0 ;
       }
-      if (bRle){
-	if (count > 0 && colour == last && count < 65535){
-	  count++;
-	  continue;
-	}else if (count > 0){
-	  *p++ = count ;
-	  *p++ = last ;
-	}
-	last = colour ;
-	count = 1 ;
-      }else{
-	*p++ = colour ;
-      }	    
+      m_bComplete = true ;
+      break ;
     }
-    if (bRle && count > 0){
-      *p++ = count ;
-      *p++ = last;
+
+    n = pixels - m_nPixel ;
+    if (n > OUT565_BLOCK) n = OUT565_BLOCK ;
+    n = fetch(block, n) ;
+    i = 0 ;
+    while (i < n){
+      if (m_count > 0){
+	max = n - i ;
+	if (max > 65535u - m_count) max = 65535u - m_count ;
+	run = simd565Run(block + i, m_last, max) ;
+	m_count += run ;
+	i += run ;
+	if (i >= n) break ; // run may continue into the next block
+	if (room < 2) break ; // resume from this pixel next time
+	*p++ = m_count ;
+	*p++ = m_last ;
+	room -= 2 ;
+      }
+      m_last = block[i++] ;
+      m_count = 1 ;
     }
-  }else{
-    return NULL ; // not yet supported
+    m_nPixel += i ;
   }
-  return pOut ;
+
+  return (p - buff) * sizeof(uint16_t) ;
 }
 
 uint8_t DisplayImage::to4bit(uint8_t byte)
@@ -139,71 +343,404 @@ uint8_t DisplayImage::to4bit(uint8_t byte)
   return out ;
 }
 
-bool DisplayImage::createDistribution()
-{
-  unsigned int i =0 ;
-
-  if (!m_img) return false ; // no image
-  
-  // Clear distribution information
-  for (i=0;i<256;i++)m_red_distribution[i] = 0 ;
-  for (i=0;i<256;i++)m_green_distribution[i] = 0 ;
-  for (i=0;i<256;i++)m_blue_distribution[i] = 0 ;
-
-  if (m_colourbitdepth == 32){
-    for (i=0; i < m_width * m_height; i++){
-      m_red_distribution[m_img[(i*4)]]++ ;
-      m_green_distribution[m_img[(i*4)+1]]++ ;
-      m_blue_distribution[m_img[(i*4)+2]]++ ;
-    }
-  }else{
-    // Unsupported colour depth for distribution
-    return false ;
-  }
-  return true ;
-}
-
 bool DisplayImage::setColourPixel(unsigned int x, unsigned int y, unsigned char r, unsigned char g, unsigned char b)
 {
   if (m_colourbitdepth != 32){
     // unsupported at this time
     return false ;
   }
+  DisplayRect c ;
+  if (!getClip(&c) || (int)x < c.x0 || (int)y < c.y0 || (int)x > c.x1 || (int)y > c.y1) return false ;
   unsigned int pixel = (x + (y*m_width)) * 4 ;
 
   m_img[pixel] = r ;
   m_img[pixel+1] = g;
   m_img[pixel+2] = b ;
+  markDirty(x, y, x, y) ;
 
   return true ;
 }
 
-unsigned int DisplayImage::getRedDistribution(uint8_t intensity)
+// Bytes per row of an image buffer. Returns 0 if the bit depth is unsupported.
+static uint64_t imageStride64(uint64_t width, unsigned int bitdepth)
 {
-  return m_red_distribution[intensity] ;
+  switch(bitdepth){
+  case 1: return width/8 + (width%8?1:0) ; // packed bits, rounded up to a whole byte
+  case 8: return width ;
+  case 16: return width * 2 ;
+  case 24: return width * 3 ;
+  case 32: return width * 4 ;
+  }
+  return 0 ;
 }
 
-unsigned int DisplayImage::getGreenDistribution(uint8_t intensity)
+// Bytes in a row, or 0 if bitdepth is unsupported or the row is too long
+static unsigned int imageStride(unsigned int width, unsigned int bitdepth)
 {
-  return m_green_distribution[intensity] ;
+  uint64_t stride = imageStride64(width, bitdepth) ;
+  return stride > 0xFFFFFFFF?0:stride ;
 }
 
-unsigned int DisplayImage::getBlueDistribution(uint8_t intensity)
+// True if an asset header describes whole rows of a supported depth which
+// fill its data and are not so large they are likely to be corrupt. Worked
+// out in 64 bits so a huge width cannot wrap around to match.
+static bool assetLayoutValid(const DisplayFormatHeader &hdr)
+{
+  uint64_t stride = imageStride64(hdr.width, hdr.bitdepth), size = 0 ;
+
+  if (stride == 0 || stride != hdr.stride) return false ;
+  size = stride * hdr.height ; // both below 2^32 so cannot wrap
+  if (size > XMB_LOAD_MAX_SIZE) return false ;
+  size *= hdr.chars ;
+  return size == hdr.size && size <= XMB_LOAD_MAX_SIZE ;
+}
+
+// Expand a row of packed bits to the FG and BG patterns
+template <class PF>
+static void expandBitsKernel(const unsigned char *src, unsigned char *dst, unsigned int width,
+			     const unsigned char *fg, const unsigned char *bg)
+{
+  for (unsigned int x=0; x < width; x++){
+    PF::put(dst, x, ((src[x/8] >> (x%8)) & 0x01)?fg:bg) ;
+  }
+}
+
+// Convert a row of colour or grey pixels through red, green and blue
+template <class SPF, class DPF>
+static void convertRGBKernel(const unsigned char *src, unsigned char *dst, unsigned int width)
+{
+  unsigned char rgb[3] ;
+
+  for (unsigned int x=0; x < width; x++){
+    SPF::getRGB(src + (x*SPF::bytes), rgb) ;
+    DPF::putRGB(dst + (x*DPF::bytes), rgb) ;
+  }
+}
+
+template <class DPF>
+static void convertRGBRow(unsigned int srcbits, const unsigned char *src, unsigned char *dst, unsigned int width)
+{
+  switch(srcbits){
+  case 32:
+    convertRGBKernel<PixelFormat32, DPF>(src, dst, width) ;
+    break ;
+  case 24:
+    convertRGBKernel<PixelFormat24, DPF>(src, dst, width) ;
+    break ;
+  case 16:
+    convertRGBKernel<PixelFormat16, DPF>(src, dst, width) ;
+    break ;
+  case 8:
+    convertRGBKernel<PixelFormat8, DPF>(src, dst, width) ;
+    break ;
+  }
+}
+
+// Thresholds 0 to 63 of an 8x8 ordered dither
+static const unsigned char bayer8[8][8] = {
+  { 0, 32,  8, 40,  2, 34, 10, 42},
+  {48, 16, 56, 24, 50, 18, 58, 26},
+  {12, 44,  4, 36, 14, 46,  6, 38},
+  {60, 28, 52, 20, 62, 30, 54, 22},
+  { 3, 35, 11, 43,  1, 33,  9, 41},
+  {51, 19, 59, 27, 49, 17, 57, 25},
+  {15, 47,  7, 39, 13, 45,  5, 37},
+  {63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+// Floyd-Steinberg. Spread error e of the pixel at cur to the next pixel in
+// this row and the three below it. step is the distance between pixels.
+// Remainders go to the last share so no error is lost.
+static inline void diffuseError(int e, int16_t *cur, int16_t *next, int step)
+{
+  int e7 = (e * 7) / 16, e3 = (e * 3) / 16, e5 = (e * 5) / 16 ;
+
+  cur[step] += e7 ;
+  next[-step] += e3 ;
+  next[0] += e5 ;
+  next[step] += e - e7 - e3 - e5 ;
+}
+
+static inline int clampByte(int v)
+{
+  return v < 0?0:(v > 255?255:v) ;
+}
+
+// Dither a row to 565, written high byte first. Each channel is quantised
+// to the levels from565 expands to, either rounding at a Bayer threshold or
+// to the nearest level with the error diffused. cur and next hold 3
+// channels for width+2 pixels, with the row starting at the second.
+template <class SPF>
+static void dither565Kernel(const unsigned char *src, unsigned char *dst, unsigned int width,
+			    unsigned int row, unsigned int dither, int16_t *cur, int16_t *next)
+{
+  static const int levels[3] = {31, 63, 31} ; // highest red, green and blue value
+  static const int shift[3] = {11, 5, 0} ;
+  const unsigned char *bayer = bayer8[row % 8] ;
+  unsigned char rgb[3] ;
+  uint16_t n16bit = 0 ;
+  int v = 0, q = 0 ;
+
+  for (unsigned int x=0; x < width; x++){
+    SPF::getRGB(src + (x*SPF::bytes), rgb) ;
+    n16bit = 0 ;
+    for (unsigned int c=0; c < 3; c++){
+      if (dither == DISPLAY_DITHER_ORDERED){
+	q = ((rgb[c] * levels[c]) + ((((bayer[x%8] * 2) + 1) * 255) / 128)) / 255 ;
+      }else{
+	v = clampByte(rgb[c] + cur[((x+1)*3)+c]) ;
+	q = ((v * levels[c]) + 127) / 255 ;
+	diffuseError(v - ((q * 255) / levels[c]), cur + ((x+1)*3) + c, next + ((x+1)*3) + c, 3) ;
+      }
+      n16bit |= q << shift[c] ;
+    }
+    dst[x*2] = n16bit >> 8 ;
+    dst[(x*2)+1] = 0x00FF & n16bit ;
+  }
+}
+
+RowConverter::RowConverter()
+{
+  m_srcbits = m_dstbits = 0 ;
+  m_width = 0 ;
+  m_pGrey = NULL ;
+  m_p565 = NULL ;
+  m_dither = DISPLAY_DITHER_NONE ;
+  m_nRow = 0 ;
+  m_pErrCur = m_pErrNext = NULL ;
+  m_lo = m_hi = 0 ;
+  m_bHiIsFG = false ;
+}
+
+RowConverter::~RowConverter()
+{
+  release() ;
+}
+
+void RowConverter::release()
+{
+  if (m_pGrey) delete[] m_pGrey ;
+  if (m_p565) delete[] m_p565 ;
+  if (m_pErrCur) delete[] m_pErrCur ;
+  if (m_pErrNext) delete[] m_pErrNext ;
+  m_pGrey = NULL ;
+  m_p565 = NULL ;
+  m_pErrCur = m_pErrNext = NULL ;
+}
+
+bool RowConverter::begin(unsigned int srcbits, unsigned int dstbits, unsigned int width,
+			 const unsigned char *fg, const unsigned char *bg,
+			 unsigned char fg_grey, unsigned char bg_grey,
+			 unsigned int dither)
 {
-  return m_blue_distribution[intensity] ;
+  unsigned char bytes[8] ;
+  unsigned int errsize = 0 ;
+
+  if (imageStride(1, srcbits) == 0 || imageStride(1, dstbits) == 0) return false ; // unsupported
+  m_srcbits = srcbits ;
+  m_dstbits = dstbits ;
+  m_width = width ;
+  memcpy(m_fg, fg, sizeof(m_fg)) ;
+  memcpy(m_bg, bg, sizeof(m_bg)) ;
+  m_nRow = 0 ;
+  release() ;
+
+  // Only 1 and 16 bit targets from deeper sources are dithered
+  m_dither = dither ;
+  if (srcbits == 1 || srcbits == dstbits || (dstbits != 1 && dstbits != 16) ||
+      (dstbits == 1 && fg_grey == bg_grey)){
+    m_dither = DISPLAY_DITHER_NONE ;
+  }
+  m_lo = fg_grey < bg_grey?fg_grey:bg_grey ;
+  m_hi = fg_grey < bg_grey?bg_grey:fg_grey ;
+  m_bHiIsFG = fg_grey > bg_grey ;
+  if (m_dither == DISPLAY_DITHER_DIFFUSION){
+    errsize = (width + 2) * (dstbits == 1?1:3) ;
+    m_pErrCur = new int16_t[errsize] ;
+    m_pErrNext = new int16_t[errsize] ;
+    memset(m_pErrCur, 0, errsize * sizeof(int16_t)) ;
+    memset(m_pErrNext, 0, errsize * sizeof(int16_t)) ;
+  }
+
+  if (srcbits == dstbits) return true ; // rows are copied
+
+  if (srcbits == 1 && dstbits == 8){
+    // Eight grey pixels for every value of a byte of bits
+    for (unsigned int b=0; b < 256; b++){
+      for (unsigned int i=0; i < 8; i++) bytes[i] = ((b >> i) & 0x01)?fg[0]:bg[0] ;
+      memcpy(&m_expand[b], bytes, 8) ;
+    }
+  }
+  if (dstbits == 1 && srcbits != 1){
+    // Pixels are set where the grey is nearer the FG grey than the BG grey
+    for (int g=0; g < 256; g++){
+      m_threshold[g] = abs(g - fg_grey) < abs(g - bg_grey) ;
+    }
+    if (srcbits != 8) m_pGrey = new unsigned char[width] ;
+  }
+  if (dstbits == 16 && srcbits != 1) m_p565 = new uint16_t[width] ;
+
+  return true ;
+}
+
+void RowConverter::ditherBits(const unsigned char *grey, unsigned char *dst)
+{
+  const unsigned char *bayer = bayer8[m_nRow % 8] ;
+  int range = m_hi - m_lo, v = 0 ;
+  bool bHi = false ;
+
+  memset(dst, 0, imageStride(m_width, 1)) ;
+  for (unsigned int x=0; x < m_width; x++){
+    if (m_dither == DISPLAY_DITHER_ORDERED){
+      // Fraction of the way from the low to the high grey against the threshold
+      bHi = (grey[x] - m_lo) * 64 > (range * bayer[x%8]) + (range / 2) ;
+    }else{
+      v = clampByte(grey[x] + m_pErrCur[x+1]) ;
+      bHi = v * 2 > m_lo + m_hi ;
+      diffuseError(v - (bHi?m_hi:m_lo), m_pErrCur + x + 1, m_pErrNext + x + 1, 1) ;
+    }
+    if (bHi == m_bHiIsFG) dst[x/8] |= 1 << (x%8) ;
+  }
+}
+
+void RowConverter::convert(const unsigned char *src, unsigned char *dst)
+{
+  const unsigned char *grey = NULL ;
+  unsigned int x = 0, i = 0 ;
+  unsigned char b = 0 ;
+  int16_t *swap = NULL ;
+
+  if (m_dither != DISPLAY_DITHER_NONE){
+    if (m_dstbits == 1){
+      grey = src ;
+      if (m_srcbits != 8){
+	simdGreyConvert(src, m_srcbits, m_pGrey, m_width) ;
+	grey = m_pGrey ;
+      }
+      ditherBits(grey, dst) ;
+    }else{
+      switch(m_srcbits){
+      case 32:
+	dither565Kernel<PixelFormat32>(src, dst, m_width, m_nRow, m_dither, m_pErrCur, m_pErrNext) ;
+	break ;
+      case 24:
+	dither565Kernel<PixelFormat24>(src, dst, m_width, m_nRow, m_dither, m_pErrCur, m_pErrNext) ;
+	break ;
+      case 8:
+	dither565Kernel<PixelFormat8>(src, dst, m_width, m_nRow, m_dither, m_pErrCur, m_pErrNext) ;
+	break ;
+      }
+    }
+    if (m_pErrCur){
+      // The next row's error becomes current and a clear row collects the next
+      swap = m_pErrCur ;
+      m_pErrCur = m_pErrNext ;
+      m_pErrNext = swap ;
+      memset(m_pErrNext, 0, (m_width + 2) * (m_dstbits == 1?1:3) * sizeof(int16_t)) ;
+    }
+    m_nRow++ ;
+    return ;
+  }
+  m_nRow++ ;
+
+  if (m_srcbits == m_dstbits){
+    memcpy(dst, src, imageStride(m_width, m_dstbits)) ;
+    return ;
+  }
+
+  if (m_srcbits == 1){
+    if (m_dstbits == 8){
+      for (; x+8 <= m_width; x+=8) memcpy(dst + x, &m_expand[src[x/8]], 8) ;
+      for (; x < m_width; x++) dst[x] = ((src[x/8] >> (x%8)) & 0x01)?m_fg[0]:m_bg[0] ;
+    }else if (m_dstbits == 16){
+      expandBitsKernel<PixelFormat16>(src, dst, m_width, m_fg, m_bg) ;
+    }else if (m_dstbits == 24){
+      expandBitsKernel<PixelFormat24>(src, dst, m_width, m_fg, m_bg) ;
+    }else{
+      expandBitsKernel<PixelFormat32>(src, dst, m_width, m_fg, m_bg) ;
+    }
+    return ;
+  }
+
+  switch(m_dstbits){
+  case 1:
+    // Threshold the grey of each pixel. Padding bits are cleared.
+    grey = src ;
+    if (m_srcbits != 8){
+      simdGreyConvert(src, m_srcbits, m_pGrey, m_width) ;
+      grey = m_pGrey ;
+    }
+    for (x=0; x < m_width; x+=8){
+      b = 0 ;
+      for (i=0; i < 8 && x+i < m_width; i++) b |= m_threshold[grey[x+i]] << i ;
+      dst[x/8] = b ;
+    }
+    break ;
+  case 8:
+    simdGreyConvert(src, m_srcbits, dst, m_width) ;
+    break ;
+  case 16:
+    // Image rows hold the high byte first
+    simd565Convert(src, m_srcbits, m_p565, m_width) ;
+    for (x=0; x < m_width; x++){
+      dst[x*2] = m_p565[x] >> 8 ;
+      dst[(x*2)+1] = 0x00FF & m_p565[x] ;
+    }
+    break ;
+  case 24:
+    convertRGBRow<PixelFormat24>(m_srcbits, src, dst, m_width) ;
+    break ;
+  case 32:
+    convertRGBRow<PixelFormat32>(m_srcbits, src, dst, m_width) ;
+    break ;
+  }
+}
+
+// Pick the smallest IDCT scale (1/2, 1/4 or 1/8) which still produces at
+// least the target size so the decoder skips most of the work for large images.
+static unsigned int jpegScaleDenom(unsigned int imgwidth, unsigned int imgheight,
+				   unsigned int width, unsigned int height)
+{
+  unsigned int denom = 8 ;
+  while (denom > 1){
+    if ((imgwidth + denom - 1)/denom >= width &&
+	(imgheight + denom - 1)/denom >= height) break ;
+    denom /= 2 ;
+  }
+  return denom ;
 }
 
-bool DisplayImage::loadJPG(const char *szFilename, unsigned int bits)
+bool DisplayImage::loadJPG(const char *szFilename, unsigned int bits, unsigned int width, unsigned int height)
 {
   struct jpeg_decompress_struct cinfo ;
   struct jpeg_error_mgr jerr ;
+  struct stat st ;
   FILE *f = NULL ;
-  JSAMPARRAY pJpegBuffer ;
-  int dataread = 0 ;
-  unsigned int basepixel = 0 ; // image index
-  
-  if (!(f = fopen(szFilename, "rb"))){
+  void *pMap = NULL ;
+  bool bRet = false ;
+  int fd = -1 ;
+
+  if ((fd = open(szFilename, O_RDONLY)) < 0){
+    fprintf(stderr, "Cannot open JPEG image %s\n", szFilename) ;
+    return false ;
+  }
+
+  // Map regular files and decode straight from the page cache
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+    pMap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+    if (pMap != MAP_FAILED){
+      close(fd) ; // mapping remains valid
+      madvise(pMap, st.st_size, MADV_SEQUENTIAL) ;
+      bRet = loadJPG((const uint8_t *)pMap, st.st_size, bits, width, height) ;
+      munmap(pMap, st.st_size) ;
+      return bRet ;
+    }
+  }
+
+  // Pipes and devices cannot be mapped so read these through stdio
+  if (!(f = fdopen(fd, "rb"))){
     fprintf(stderr, "Cannot open JPEG image %s\n", szFilename) ;
+    close(fd) ;
     return false ;
   }
   
@@ -213,8 +750,55 @@ bool DisplayImage::loadJPG(const char *szFilename, unsigned int bits)
   try{
     jpeg_create_decompress(&cinfo) ;
     jpeg_stdio_src(&cinfo, f) ;
+  }catch(...){
+    fclose (f) ;
+    jpeg_destroy_decompress(&cinfo) ;
+    return false ;
+  }
+  bRet = decodeJPG(&cinfo, bits, width, height, szFilename) ;
+  fclose (f) ;
+
+  return bRet ;
+}
+
+bool DisplayImage::loadJPG(const uint8_t *data, size_t len, unsigned int bits, unsigned int width, unsigned int height)
+{
+  struct jpeg_decompress_struct cinfo ;
+  struct jpeg_error_mgr jerr ;
+
+  if (!data || len == 0) return false ;
+
+  cinfo.err = jpeg_std_error(&jerr) ;
+  jerr.error_exit = jpgfile_error_exit;
+
+  try{
+    jpeg_create_decompress(&cinfo) ;
+    jpeg_mem_src(&cinfo, (unsigned char *)data, len) ;
+  }catch(...){
+    jpeg_destroy_decompress(&cinfo) ;
+    return false ;
+  }
+  return decodeJPG(&cinfo, bits, width, height, "(memory)") ;
+}
+
+bool DisplayImage::decodeJPG(struct jpeg_decompress_struct *pinfo, unsigned int bits, unsigned int width, unsigned int height, const char *szName)
+{
+  struct jpeg_decompress_struct &cinfo = *pinfo ;
+  JSAMPARRAY pJpegBuffer = NULL ;
+  JSAMPARRAY pScaleBuffer = NULL ;
+  JSAMPROW *pRows = NULL ;
+  unsigned int batch = 0, lines = 0 ;
+  bool bDirect = false ;
+  unsigned int *xmap = NULL ;
+  int dataread = 0 ;
+  unsigned int sy = 0, ty = 0, tyend = 0 ;
+  unsigned char *row = NULL ;
+  RowConverter converter ;
+  unsigned char fg[4], bg[4] ;
+
+  try{
     if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK){
-      fprintf(stderr, "Failed to read JPEG file %s\n", szFilename) ;
+      fprintf(stderr, "Failed to read JPEG file %s\n", szName) ;
       jpeg_destroy_decompress(&cinfo) ;
       return false ;
     }
@@ -222,7 +806,7 @@ bool DisplayImage::loadJPG(const char *szFilename, unsigned int bits)
     if (bits == 32 || bits == 24 || bits == 16){
       // This is the supported colour space we need
       cinfo.out_color_space = JCS_RGB ;
-    }else if (bits == 8){
+    }else if (bits == 8 || bits == 1){
       cinfo.out_color_space = JCS_GRAYSCALE ;
     }else{
       fprintf(stderr, "Unsupported colour bit depth\n") ;
@@ -230,60 +814,122 @@ bool DisplayImage::loadJPG(const char *szFilename, unsigned int bits)
       return false ;
     }
 
-    jpeg_start_decompress(&cinfo) ;
+    // Work out the target size, keeping the aspect ratio if only one side is set
+    if (width == 0 && height == 0){
+      width = cinfo.image_width ;
+      height = cinfo.image_height ;
+    }else if (width == 0){
+      width = (cinfo.image_width * height) / cinfo.image_height ;
+      if (width == 0) width = 1 ;
+    }else if (height == 0){
+      height = (cinfo.image_height * width) / cinfo.image_width ;
+      if (height == 0) height = 1 ;
+    }
 
-    pJpegBuffer = (*cinfo.mem->alloc_sarray) (
-					      (j_common_ptr)&cinfo,
-					      JPOOL_IMAGE,
-					      cinfo.output_width * cinfo.output_components,
-					      1) ;
+    // Let the decoder scale down in the DCT domain
+    cinfo.scale_num = 1 ;
+    cinfo.scale_denom = jpegScaleDenom(cinfo.image_width, cinfo.image_height, width, height) ;
 
-    if (cinfo.output_components != 1 && bits == 8){
+    jpeg_start_decompress(&cinfo) ;
+
+    if (cinfo.output_components != 1 && (bits == 8 || bits == 1)){
       fprintf(stderr, "Mismatch of expected compoents. JPEG lib provides %d for greyscale\n", cinfo.output_components) ;
+      jpeg_destroy_decompress(&cinfo) ;
       return false ;
     }
 
     // Allocate for image
-    if (!allocateImg(cinfo.output_width, cinfo.output_height, bits)){
+    if (!allocateImg(width, height, bits)){
       fprintf(stderr, "Error allocating image memory\n") ;
+      jpeg_destroy_decompress(&cinfo) ;
       return false ;
     }
 
-    unsigned short n16bit = 0;
+    // Decoded samples are 24 bit RGB or 8 bit grey
+    getPixelPattern(true, fg, bits) ;
+    getPixelPattern(false, bg, bits) ;
+    converter.begin(cinfo.output_components == 1?8:24, bits, width, fg, bg, m_fg_grey, m_bg_grey, m_dither) ;
+
+    if (width != cinfo.output_width || height != cinfo.output_height){
+      // Decoder output needs a final nearest neighbour scale to the exact
+      // size. Map each target column to a decoded sample once.
+      pScaleBuffer = (*cinfo.mem->alloc_sarray) (
+						 (j_common_ptr)&cinfo,
+						 JPOOL_IMAGE,
+						 width * cinfo.output_components,
+						 1) ;
+      xmap = (unsigned int *)(*cinfo.mem->alloc_small) (
+							(j_common_ptr)&cinfo,
+							JPOOL_IMAGE,
+							width * sizeof(unsigned int)) ;
+      for (unsigned int tx=0; tx < width; tx++){
+	xmap[tx] = ((tx * cinfo.output_width) / width) * cinfo.output_components ;
+      }
+    }
+
+    // Read as many scanlines as the decoder produces at once. 24 and 8 bit
+    // images have the same layout as the decoder output so unless scaling is
+    // needed the scanlines are written straight into the image rows.
+    batch = cinfo.rec_outbuf_height ;
+    if (batch < 1) batch = 1 ;
+    bDirect = !xmap && (bits == 24 || bits == 8) ;
+    if (bDirect){
+      pRows = (JSAMPROW *)(*cinfo.mem->alloc_small) (
+						    (j_common_ptr)&cinfo,
+						    JPOOL_IMAGE,
+						    batch * sizeof(JSAMPROW)) ;
+    }else{
+      pJpegBuffer = (*cinfo.mem->alloc_sarray) (
+						(j_common_ptr)&cinfo,
+						JPOOL_IMAGE,
+						cinfo.output_width * cinfo.output_components,
+						batch) ;
+    }
+
     //printf ("Allocateed image %d x %d\n", cinfo.output_width, cinfo.output_height) ;
     while (cinfo.output_scanline < cinfo.output_height){
-      dataread = jpeg_read_scanlines(&cinfo, pJpegBuffer, 1) ;
+      sy = cinfo.output_scanline ;
+      lines = cinfo.output_height - sy ;
+      if (lines > batch) lines = batch ;
+
+      if (bDirect){
+	for (unsigned int i=0; i < lines; i++) pRows[i] = m_img + ((sy + i) * m_stride) ;
+	jpeg_read_scanlines(&cinfo, pRows, lines) ;
+	continue ;
+      }
+
+      dataread = jpeg_read_scanlines(&cinfo, pJpegBuffer, lines) ;
       if (dataread <= 0) continue ; // should implement a check to ensure if this is blocked we can break out.
 
       //printf("Processing scanline %d, data read %d, image width %d\n", cinfo.output_scanline,dataread,cinfo.output_width) ;
-      for (unsigned int i=0; i < m_width; i++){
-	basepixel = (i * bits/8) + ((cinfo.output_scanline-1) * m_stride) ;
-
-	if (bits == 32){
-	  m_img[basepixel] = pJpegBuffer[0][i*3] ;
-	  m_img[basepixel+1] = pJpegBuffer[0][(i*3)+1] ;
-	  m_img[basepixel+2] = pJpegBuffer[0][(i*3)+2] ;
-	  m_img[basepixel+3] = 0 ;
-	}else if(bits == 24){
-	  m_img[basepixel] = pJpegBuffer[0][i*3] ;
-	  m_img[basepixel+1] = pJpegBuffer[0][(i*3)+1] ;
-	  m_img[basepixel+2] = pJpegBuffer[0][(i*3)+2] ;	  
-	}else if(bits == 16){
-	  n16bit = to565(pJpegBuffer[0][i*3], pJpegBuffer[0][(i*3)+1], pJpegBuffer[0][(i*3)+2]);
-	  m_img[basepixel] = n16bit >> 8 ;
-	  m_img[basepixel+1] = 0x00FF & n16bit ;
-	}else if(bits == 8){
-	  m_img[basepixel] = pJpegBuffer[0][i] ;
+      for (int i=0; i < dataread; i++, sy++){
+	if (!xmap){
+	  converter.convert(pJpegBuffer[i], m_img + (sy * m_stride)) ;
+	  continue ;
+	}
+
+	// Target rows which take their pixels from this scanline
+	ty = (sy * height + cinfo.output_height - 1) / cinfo.output_height ;
+	tyend = ((sy + 1) * height + cinfo.output_height - 1) / cinfo.output_height ;
+	if (ty >= tyend) continue ; // scanline dropped
+
+	for (unsigned int tx=0; tx < width; tx++){
+	  for (int c=0; c < cinfo.output_components; c++){
+	    pScaleBuffer[0][(tx*cinfo.output_components)+c] = pJpegBuffer[i][xmap[tx]+c] ;
+	  }
+	}
+	row = m_img + (ty * m_stride) ;
+	converter.convert(pScaleBuffer[0], row) ;
+	for (ty++; ty < tyend; ty++){
+	  memcpy(m_img + (ty * m_stride), row, m_stride) ;
 	}
       }
     }
+    jpeg_finish_decompress(&cinfo) ;
   }catch(...){
-    fclose (f) ;
     jpeg_destroy_decompress(&cinfo) ;
     return false ;
   }
-  fclose (f) ;
-  jpeg_finish_decompress(&cinfo) ;
   jpeg_destroy_decompress(&cinfo) ;
 
   return true ;
@@ -292,6 +938,7 @@ bool DisplayImage::loadJPG(const char *szFilename, unsigned int bits)
 bool DisplayImage::loadXBM(unsigned int w, unsigned int h, unsigned char *bits)
 {
   if (bits == NULL || h == 0 || w == 0) return false ;
+  releaseImg() ;
   m_height = h ;
   m_width = w ;
 
@@ -301,363 +948,2111 @@ bool DisplayImage::loadXBM(unsigned int w, unsigned int h, unsigned char *bits)
   m_memsize = 0 ; // no memory allocated
 
   m_stride = w/8 + (w%8?1:0);
+
+  m_nDirty = 0 ;
+  markDirty(0, 0, m_width-1, m_height-1) ;
   
   return true ;
 }
 
-bool DisplayImage::drawLine(int x0, int y0, int x1, int y1)
+bool DisplayImage::getDirtyRect(unsigned int index, DisplayRect *rect)
 {
+  if (index >= m_nDirty || !rect) return false ;
+  *rect = m_dirty[index] ;
+  return true ;
+}
 
-  // work out simple drawing cases
-  if (x0 == x1) return drawV(x0, y0, y1) ;
-  if (y0 == y1) return drawH(x0, x1, y0) ;
+// Rectangles which overlap or share an edge
+static bool rectsTouch(const DisplayRect &a, const DisplayRect &b)
+{
+  return a.x0 <= b.x1+1 && b.x0 <= a.x1+1 && a.y0 <= b.y1+1 && b.y0 <= a.y1+1 ;
+}
 
-  int dx, dy, incrH, incrHV, d, x, y ;
+static void rectUnion(DisplayRect &a, const DisplayRect &b)
+{
+  if (b.x0 < a.x0) a.x0 = b.x0 ;
+  if (b.y0 < a.y0) a.y0 = b.y0 ;
+  if (b.x1 > a.x1) a.x1 = b.x1 ;
+  if (b.y1 > a.y1) a.y1 = b.y1 ;
+}
 
-  // Check if this is x incrementing line or y based on direction of gradient
-  bool bIncX = abs(x0-x1) >= abs(y0-y1) ;
-  int *adj0, *adj1, *opp0, *opp1 ;
-
-  if (bIncX){
-    adj0 = &x0 ;
-    adj1 = &x1 ;
-    opp0 = &y0 ;
-    opp1 = &y1 ;
-  }else{
-    adj0 = &y0 ;
-    adj1 = &y1 ;
-    opp0 = &x0 ;
-    opp1 = &x1 ;
-  }
-  
-  // From this point on when x and y are discussed they are part of 
-  // a transformed virtual x and y for the purpose of the mid-point
-  // algorithm
-  dx = *adj1-*adj0 ; 
-  dy = *opp1-*opp0 ; 
-  d = abs(dy) * 2 - abs(dx) ; 
-  incrH = abs(dy) * 2; // Horiz increment
-  incrHV = (abs(dy)-abs(dx)) * 2 ; // Vert & Horiz increment
-  x = *adj0 ;
-  y = *opp0 ;
-  
-  if (y >=0 && x >= 0){ 
-    if (bIncX)setPixel(x,y,true) ;
-    else setPixel(y,x,true) ;
+static unsigned int rectArea(const DisplayRect &a)
+{
+  return (a.x1 - a.x0 + 1) * (a.y1 - a.y0 + 1) ;
+}
+
+void DisplayImage::markDirty(int x0, int y0, int x1, int y1)
+{
+  DisplayRect r ;
+  unsigned int i = 0 ;
+
+  if (x0 > x1){int t = x0; x0 = x1; x1 = t;}
+  if (y0 > y1){int t = y0; y0 = y1; y1 = t;}
+
+  // Clip to the image and any clip set
+  if (!getClip(&r)) return ;
+  if (x1 < r.x0 || y1 < r.y0 || x0 > r.x1 || y0 > r.y1) return ;
+  if (x0 > r.x0) r.x0 = x0 ;
+  if (y0 > r.y0) r.y0 = y0 ;
+  if (x1 < r.x1) r.x1 = x1 ;
+  if (y1 < r.y1) r.y1 = y1 ;
+
+  // Already covered
+  for (i=0; i < m_nDirty; i++){
+    if (r.x0 >= m_dirty[i].x0 && r.x1 <= m_dirty[i].x1 &&
+	r.y0 >= m_dirty[i].y0 && r.y1 <= m_dirty[i].y1) return ;
   }
 
-  while (x != *adj1){
-    if (d <= 0){
-      d += incrH ;
-      x += dx>0?1:-1;
+  // Absorb every area which touches the new one. A merged area can grow to
+  // touch areas already checked so restart after each merge.
+  i = 0 ;
+  while (i < m_nDirty){
+    if (rectsTouch(r, m_dirty[i])){
+      rectUnion(r, m_dirty[i]) ;
+      m_dirty[i] = m_dirty[--m_nDirty] ;
+      i = 0 ;
     }else{
-      d += incrHV ;
-      x += dx>0?1:-1;
-      y += dy>0?1:-1;
-    }
-    if (y >=0 && x >= 0){
-      if (bIncX)setPixel(x,y,true) ;
-      else setPixel(y,x,true) ;
+      i++ ;
     }
   }
 
-  return true ;
-}
+  if (m_nDirty < DISPLAY_MAX_DIRTY_RECTS){
+    m_dirty[m_nDirty++] = r ;
+    return ;
+  }
 
-bool DisplayImage::drawRect(int x0, int y0, int width, int height, bool bFill)
+  // List is full. Merge with the area which grows the least
+  unsigned int best = 0, bestgrowth = 0xFFFFFFFF ;
+  for (i=0; i < m_nDirty; i++){
+    DisplayRect u = m_dirty[i] ;
+    rectUnion(u, r) ;
+    unsigned int growth = rectArea(u) - rectArea(m_dirty[i]) ;
+    if (growth < bestgrowth){
+      bestgrowth = growth ;
+      best = i ;
+    }
+  }
+  rectUnion(r, m_dirty[best]) ;
+  m_dirty[best] = m_dirty[--m_nDirty] ;
+  markDirty(r.x0, r.y0, r.x1, r.y1) ;
+}
+
+void DisplayImage::setClip(const DisplayRect *clip)
+{
+  m_bClip = clip != NULL ;
+  if (clip) m_clip = *clip ;
+}
+
+bool DisplayImage::getClip(DisplayRect *clip) const
+{
+  clip->x0 = 0 ;
+  clip->y0 = 0 ;
+  clip->x1 = (int)m_width - 1 ;
+  clip->y1 = (int)m_height - 1 ;
+  if (m_bClip){
+    if (m_clip.x0 > clip->x0) clip->x0 = m_clip.x0 ;
+    if (m_clip.y0 > clip->y0) clip->y0 = m_clip.y0 ;
+    if (m_clip.x1 < clip->x1) clip->x1 = m_clip.x1 ;
+    if (m_clip.y1 < clip->y1) clip->y1 = m_clip.y1 ;
+  }
+  return clip->x0 <= clip->x1 && clip->y0 <= clip->y1 ;
+}
+
+// Smallest integer >= n/d for d > 0. Terms of lines and edges across the
+// whole int range pass 64 bits.
+static __int128 ceilDiv(__int128 n, __int128 d)
+{
+  return n >= 0?(n + d - 1) / d:-((-n) / d) ;
+}
+
+// Clip a line for drawing by stepping along its major axis. The line starts
+// at major, minor and moves sMajor and sMinor for each step, taking A steps
+// along the major axis and B along the minor. The minor offset after step i
+// is (2Bi + A - 1) / (2A), as given by the mid-point algorithm. first and
+// last are set to the range of steps with both coordinates inside
+// majorSize and minorSize. Coordinates are relative to the corner of the
+// clip. Returns false if no step is inside.
+static bool clipSteps(int64_t major, int64_t minor, int sMajor, int sMinor, int64_t A, int64_t B,
+		      int majorSize, int minorSize, int64_t *first, int64_t *last)
+{
+  int64_t lo = 0, hi = A, klo = 0, khi = 0 ;
+
+  // Major axis, Liang-Barsky on the step count
+  if (sMajor > 0){
+    if (-major > lo) lo = -major ;
+    if (majorSize - 1 - major < hi) hi = majorSize - 1 - major ;
+  }else{
+    if (major - majorSize + 1 > lo) lo = major - majorSize + 1 ;
+    if (major < hi) hi = major ;
+  }
+
+  // Minor axis. The offset only grows with i so each bound is one step.
+  if (B > 0){
+    if (sMinor > 0){
+      klo = -minor ;
+      khi = minorSize - 1 - minor ;
+    }else{
+      klo = minor - minorSize + 1 ;
+      khi = minor ;
+    }
+    if (khi < 0) return false ;
+    if (klo > 0){
+      __int128 i = ceilDiv((__int128)2*A*klo - A + 1, 2*B) ;
+      if (i > lo) lo = (int64_t)i ;
+    }
+    __int128 i = ceilDiv((__int128)2*A*(khi+1) - A + 1, 2*B) - 1 ;
+    if (i < hi) hi = (int64_t)i ;
+  }else if (minor < 0 || minor >= minorSize){
+    return false ;
+  }
+
+  if (lo > hi) return false ;
+  *first = lo ;
+  *last = hi ;
+  return true ;
+}
+
+bool DisplayImage::drawLine(int x0, int y0, int x1, int y1)
+{
+  markDirty(x0, y0, x1, y1) ;
+
+  // work out simple drawing cases
+  if (x0 == x1) return drawV(x0, y0, y1) ;
+  if (y0 == y1) return drawH(x0, x1, y0) ;
+
+  // Check if this is x incrementing line or y based on direction of gradient
+  int64_t xd = (int64_t)x1 - x0, yd = (int64_t)y1 - y0 ;
+  bool bIncX = (xd<0?-xd:xd) >= (yd<0?-yd:yd) ;
+  int major = bIncX?x0:y0, minor = bIncX?y0:x0 ;
+  int64_t dx = bIncX?xd:yd ;
+  int64_t dy = bIncX?yd:xd ;
+  int sMajor = dx > 0?1:-1, sMinor = dy > 0?1:-1 ;
+  int64_t A = dx>0?dx:-dx, B = dy>0?dy:-dy ;
+  int64_t first = 0, last = 0, i = 0, run = 0, m = 0, d = 0 ;
+  DisplayRect c ;
+
+  // Only the steps inside the clip are walked
+  if (!getClip(&c)) return false ;
+  if (!clipSteps((int64_t)major - (bIncX?c.x0:c.y0), (int64_t)minor - (bIncX?c.y0:c.x0), sMajor, sMinor, A, B,
+		 bIncX?c.x1-c.x0+1:c.y1-c.y0+1, bIncX?c.y1-c.y0+1:c.x1-c.x0+1, &first, &last)) return false ;
+
+  // Mid-point state at the first step
+  m = (int64_t)(((__int128)2*B*first + A - 1) / (2*A)) ;
+  d = (int64_t)((__int128)2*B*(first+1) - A - (__int128)2*A*m) ;
+
+  // Pixels which share a minor coordinate are written as one span
+  for (i=run=first; i <= last; i++){
+    if (d > 0 || i == last){
+      int a = major + sMajor*run, b = major + sMajor*i, c = minor + sMinor*m ;
+      if (bIncX) fillSpan(a, b, c, true) ;
+      else fillRect(c, a, c, b, true) ;
+      run = i + 1 ;
+    }
+    if (d > 0){
+      d += 2*(B-A) ;
+      m++ ;
+    }else{
+      d += 2*B ;
+    }
+  }
+
+  return true ;
+}
+
+bool DisplayImage::drawRect(int x0, int y0, int width, int height, bool bFill)
 {
   bool bRet = true ;
+
+  markDirty(x0, y0, x0+width, y0+height) ;
   
   if (!drawV(x0,y0,y0+height))bRet = false ;
   if (!drawV(x0+width,y0,y0+height))bRet =  false ;
 
-  if (bFill){
-    for (int i=0; i<height;i++){
-      if (!drawH(x0,x0+width,y0+i)) bRet = false; 
+  if (bFill){
+    if (height > 0){
+      // Any rows outside of the image cannot be drawn
+      if (y0 < 0 || y0+height > (int)m_height) bRet = false ;
+      if (!fillRect(x0, y0, x0+width, y0+height-1, true)) bRet = false ;
+    }
+  }else{
+    if (!drawH(x0,x0+width,y0))bRet = false ;
+    if (!drawH(x0,x0+width,y0+height))bRet = false ;
+  }    
+  
+  return bRet ;
+}
+
+bool DisplayImage::drawV(int x, int y0, int y1)
+{
+  // Handle exception cases
+  if (x < 0 || x >= (int)m_width) return false ; // Out of image area for entire line
+  if (y0 < 0 && y1 < 0) return false ; // out of image area for entire line
+  if (y0 >= (int)m_height && y1 >= (int)m_height) return false ; // out of image area for entire line
+
+  fillRect(x, y0, x, y1, true) ;
+
+  return true ;
+}
+
+bool DisplayImage::drawH(int x0, int x1, int y)
+{
+  // Handle exception cases
+  if (y < 0 || y >= (int)m_height) return false ; // Out of image area for entire line
+  if (x0 < 0 && x1 < 0) return false ; // out of image area for entire line
+  if (x0 >= (int)m_width && x1 >= (int)m_width) return false ; // out of image area for entire line
+
+  fillSpan(x0, x1, y, true) ;
+
+  return true ;  
+}
+
+// Nearest int to v, for coordinates worked out in 64 bits which may lie far
+// outside of the image
+static inline int clampInt(int64_t v)
+{
+  return v < INT_MIN?INT_MIN:v > INT_MAX?INT_MAX:(int)v ;
+}
+
+// Product of a and b, each under 2^96, as the 128 bit halves hi and lo
+static void mulWide(unsigned __int128 a, unsigned __int128 b, unsigned __int128 *hi, unsigned __int128 *lo)
+{
+  uint64_t a0 = (uint64_t)a, a1 = (uint64_t)(a >> 64), b0 = (uint64_t)b, b1 = (uint64_t)(b >> 64) ;
+  unsigned __int128 low = (unsigned __int128)a0*b0 ;
+  unsigned __int128 mid = (unsigned __int128)a1*b0 + (unsigned __int128)a0*b1 ;
+
+  *lo = low + (mid << 64) ;
+  *hi = (mid >> 64) + (unsigned __int128)a1*b1 + (*lo < low?1:0) ;
+}
+
+// True if a*b <= c*d, for values under 2^96
+static bool mulLessEqual(unsigned __int128 a, unsigned __int128 b, unsigned __int128 c, unsigned __int128 d)
+{
+  unsigned __int128 abhi = 0, ablo = 0, cdhi = 0, cdlo = 0 ;
+
+  mulWide(a, b, &abhi, &ablo) ;
+  mulWide(c, d, &cdhi, &cdlo) ;
+  return abhi < cdhi || (abhi == cdhi && ablo <= cdlo) ;
+}
+
+// Half width of the row y from the centre of an ellipse with radii rx and
+// ry, or -1 past ry. Pixel centres within radii grown by half a pixel are
+// inside, so circles match the mid-point algorithm. With a and b the grown
+// diameters x is inside while (2xb)^2 <= (ab - 2ya)(ab + 2ya), which reaches
+// 2^134 for the largest radii so is compared exactly in two halves.
+static int64_t ellipseWidth(unsigned int rx, unsigned int ry, int64_t y)
+{
+  if (y < 0 || y > (int64_t)ry) return -1 ;
+
+  uint64_t a = 2*(uint64_t)rx + 1, b = 2*(uint64_t)ry + 1 ;
+  unsigned __int128 ab = (unsigned __int128)a*b, ya = (unsigned __int128)(2*y)*a ;
+  unsigned __int128 lo = ab - ya, hi = ab + ya ;
+  double t = (double)(b - 2*y) * (double)(b + 2*y) ;
+  int64_t x = (int64_t)(a * sqrt(t) / (2.0*b)) ;
+
+  // The estimate is within a step or two of the edge
+  if (x > (int64_t)rx) x = rx ;
+  if (x < 0) x = 0 ;
+  while (x > 0 && !mulLessEqual((unsigned __int128)(2*x)*b, (unsigned __int128)(2*x)*b, lo, hi)) x-- ;
+  while (x < (int64_t)rx && mulLessEqual((unsigned __int128)(2*x+2)*b, (unsigned __int128)(2*x+2)*b, lo, hi)) x++ ;
+  return x ;
+}
+
+bool DisplayImage::drawRoundBox(int cx0, int cy0, int cx1, int cy1, unsigned int rx, unsigned int ry, bool bFill)
+{
+  int64_t w = 0, next = 0, inner = 0, first = 0, last = 0, centre = 0 ;
+  int row = 0, sign = 0 ;
+  bool bDrawn = false ;
+  DisplayRect c ;
+
+  if (!m_img) return false ;
+  markDirty(clampInt((int64_t)cx0 - rx), clampInt((int64_t)cy0 - ry), clampInt((int64_t)cx1 + rx), clampInt((int64_t)cy1 + ry)) ;
+  if (!getClip(&c)) return false ;
+
+  // Straight sides between the corners
+  if (bFill){
+    if (cy1 > cy0 + 1) bDrawn |= fillRect(clampInt((int64_t)cx0 - rx), cy0 + 1, clampInt((int64_t)cx1 + rx), cy1 - 1, true) ;
+  }else if (cy1 > cy0 + 1){
+    bDrawn |= fillRect(clampInt((int64_t)cx0 - rx), cy0 + 1, clampInt((int64_t)cx0 - rx), cy1 - 1, true) ;
+    bDrawn |= fillRect(clampInt((int64_t)cx1 + rx), cy0 + 1, clampInt((int64_t)cx1 + rx), cy1 - 1, true) ;
+  }
+
+  // Corners, the top half above cy0 and the bottom half below cy1. Only rows
+  // inside the clip are worked out, from the outside in so outline rows can
+  // cover the pixels down to the width of the next row and steep parts join
+  // up.
+  for (int half=0; half < 2; half++){
+    centre = half?cy1:cy0 ;
+    sign = half?1:-1 ;
+    first = half?c.y0 - centre:centre - c.y1 ;
+    last = half?c.y1 - centre:centre - c.y0 ;
+    if (first < 0) first = 0 ;
+    if (last > (int64_t)ry) last = ry ;
+    if (half && cy1 == cy0 && first == 0) first = 1 ; // centre row drawn once
+    next = ellipseWidth(rx, ry, last + 1) ;
+    for (int64_t y=last; y >= first; y--){
+      w = ellipseWidth(rx, ry, y) ;
+      row = (int)(centre + sign*y) ;
+      if (bFill || y == ry){
+	bDrawn |= fillSpan(clampInt(cx0 - w), clampInt(cx1 + w), row, true) ;
+      }else{
+	inner = next + 1 ;
+	if (inner > w) inner = w ;
+	bDrawn |= fillSpan(clampInt(cx0 - w), clampInt(cx0 - inner), row, true) ;
+	bDrawn |= fillSpan(clampInt(cx1 + inner), clampInt(cx1 + w), row, true) ;
+      }
+      next = w ;
+    }
+  }
+  return bDrawn ;
+}
+
+bool DisplayImage::drawEllipse(int xc, int yc, unsigned int rx, unsigned int ry, bool bFill)
+{
+  return drawRoundBox(xc, yc, xc, yc, rx, ry, bFill) ;
+}
+
+bool DisplayImage::drawCircle(int xc, int yc, unsigned int r, bool bFill)
+{
+  return drawRoundBox(xc, yc, xc, yc, r, r, bFill) ;
+}
+
+bool DisplayImage::drawRoundRect(int x0, int y0, int width, int height, unsigned int radius, bool bFill)
+{
+  if (width < 0){x0 += width; width = -width;}
+  if (height < 0){y0 += height; height = -height;}
+  if (radius > (unsigned int)width/2) radius = width/2 ;
+  if (radius > (unsigned int)height/2) radius = height/2 ;
+
+  return drawRoundBox(x0 + radius, y0 + radius, x0 + width - radius, y0 + height - radius, radius, radius, bFill) ;
+}
+
+// Runs of outline pixels which pass the arc test are collected into spans
+struct ArcSpans{
+  DisplayImage *img ;
+  double sx, sy, ex, ey ; // start and end directions
+  bool bWide ; // sweep over 180 degrees
+};
+
+// True if the direction x,y is within the sweep. Angles grow clockwise on
+// the screen so the cross product is positive moving towards the end.
+static bool inArc(const ArcSpans &arc, double x, double y)
+{
+  double fromStart = arc.sx*y - arc.sy*x, toEnd = x*arc.ey - y*arc.ex ;
+  if (arc.bWide) return !(fromStart < 0 && toEnd < 0) ;
+  return fromStart >= 0 && toEnd >= 0 ;
+}
+
+bool DisplayImage::drawArc(int xc, int yc, unsigned int rx, unsigned int ry, int start, int end)
+{
+  ArcSpans arc ;
+  double a = 0 ;
+  int sweep = 0 ;
+  int64_t w = 0, next = 0, inner = 0, first = 0, last = 0, from = 0, to = 0, run = 0 ;
+  bool bDrawn = false ;
+  DisplayRect c ;
+
+  if (!m_img) return false ;
+
+  sweep = (end - start) % 360 ;
+  if (sweep < 0) sweep += 360 ;
+  if (sweep == 0 && end != start) return drawEllipse(xc, yc, rx, ry) ;
+
+  a = start * M_PI / 180.0 ;
+  arc.sx = cos(a) ;
+  arc.sy = sin(a) ;
+  a = (start + sweep) * M_PI / 180.0 ;
+  arc.ex = cos(a) ;
+  arc.ey = sin(a) ;
+  arc.bWide = sweep > 180 ;
+
+  // Keep the axes exact so ends on them include the pixels along them
+  if (fabs(arc.sx) < 1e-9) arc.sx = 0 ;
+  if (fabs(arc.sy) < 1e-9) arc.sy = 0 ;
+  if (fabs(arc.ex) < 1e-9) arc.ex = 0 ;
+  if (fabs(arc.ey) < 1e-9) arc.ey = 0 ;
+
+  markDirty(clampInt((int64_t)xc - rx), clampInt((int64_t)yc - ry), clampInt((int64_t)xc + rx), clampInt((int64_t)yc + ry)) ;
+  if (!getClip(&c)) return false ;
+
+  // Walk the outline spans of each quadrant as drawEllipse, keeping the
+  // pixels in the sweep. Rows and columns are clipped first. Directions are
+  // scaled so the angle is the parametric angle of the ellipse, unless it is
+  // flat.
+  for (int sy=-1; sy <= 1; sy+=2){
+    first = sy > 0?(int64_t)c.y0 - yc:(int64_t)yc - c.y1 ;
+    last = sy > 0?(int64_t)c.y1 - yc:(int64_t)yc - c.y0 ;
+    if (first < 0) first = 0 ;
+    if (last > (int64_t)ry) last = ry ;
+    next = ellipseWidth(rx, ry, last + 1) ;
+    for (int64_t y=last; y >= first; y--){
+      w = ellipseWidth(rx, ry, y) ;
+      inner = next + 1 ;
+      if (inner > w) inner = w ;
+      next = w ;
+      for (int sx=-1; sx <= 1; sx+=2){
+	from = sx > 0?(int64_t)c.x0 - xc:(int64_t)xc - c.x1 ;
+	to = sx > 0?(int64_t)c.x1 - xc:(int64_t)xc - c.x0 ;
+	if (from < inner) from = inner ;
+	if (to > w) to = w ;
+	run = -1 ;
+	for (int64_t x=from; x <= to + 1; x++){
+	  bool bIn = x <= to && inArc(arc, (double)sx*x*(ry?ry:1), (double)sy*y*(rx?rx:1)) ;
+	  if (bIn && run < 0) run = x ;
+	  if (!bIn && run >= 0){
+	    bDrawn |= fillSpan((int)(xc + sx*run), (int)(xc + sx*(x-1)), (int)(yc + sy*y), true) ;
+	    run = -1 ;
+	  }
+	}
+      }
+    }
+  }
+  return bDrawn ;
+}
+
+bool DisplayImage::drawPolygon(const DisplayPoint *points, unsigned int n, bool bFill)
+{
+  bool bDrawn = false ;
+
+  if (!m_img || !points || n == 0) return false ;
+
+  if (!bFill){
+    for (unsigned int i=0; i < n; i++){
+      const DisplayPoint &a = points[i], &b = points[(i+1)%n] ;
+      bDrawn |= drawLine(a.x, a.y, b.x, b.y) ;
+    }
+    return bDrawn ;
+  }
+
+  // Edge table of the non horizontal edges sorted by top row. The edge
+  // crosses the centre of the current row at n / den, kept exact so shared
+  // edges of neighbouring polygons meet without gaps or overlaps. x is the
+  // first pixel whose centre is at or right of the crossing.
+  struct Edge{
+    int y0, y1, x ;
+    __int128 n ;
+    int64_t step, den ;
+    bool operator<(const Edge &e) const {return y0 < e.y0;}
+  };
+  std::vector<Edge> edges, active ;
+  int ymin = points[0].y, ymax = points[0].y, y = 0, xmin = points[0].x, xmax = points[0].x ;
+
+  for (unsigned int i=0; i < n; i++){
+    DisplayPoint a = points[i], b = points[(i+1)%n] ;
+    if (a.x < xmin) xmin = a.x ;
+    if (a.x > xmax) xmax = a.x ;
+    if (a.y < ymin) ymin = a.y ;
+    if (a.y > ymax) ymax = a.y ;
+    if (a.y == b.y) continue ;
+    if (a.y > b.y){DisplayPoint t = a; a = b; b = t;}
+    Edge e ;
+    e.y0 = a.y ;
+    e.y1 = b.y ;
+    e.den = 2*((int64_t)b.y - a.y) ;
+    e.step = 2*((int64_t)b.x - a.x) ;
+    e.n = (__int128)e.den*a.x + e.step/2 ;
+    edges.push_back(e) ;
+  }
+  markDirty(xmin, ymin, xmax, ymax) ;
+  std::sort(edges.begin(), edges.end()) ;
+
+  // Edges cover the rows whose centres they cross, from y0 to y1-1
+  size_t next = 0 ;
+  y = ymin < 0?0:ymin ;
+  if (ymax > (int)m_height) ymax = m_height ;
+  for (; y < ymax; y++){
+    // Add edges starting by this row, moved on to it if clipped
+    while (next < edges.size() && edges[next].y0 <= y){
+      Edge e = edges[next++] ;
+      e.n += (__int128)e.step * ((int64_t)y - e.y0) ;
+      active.push_back(e) ;
+    }
+    for (size_t i=0; i < active.size(); ){
+      if (active[i].y1 <= y){
+	active[i] = active.back() ;
+	active.pop_back() ;
+      }else{
+	i++ ;
+      }
+    }
+    if (active.empty()){
+      if (next >= edges.size()) break ;
+      continue ;
+    }
+
+    for (size_t i=0; i < active.size(); i++) active[i].x = (int)ceilDiv(2*active[i].n - active[i].den, 2*active[i].den) ;
+
+    // Insertion sort by x, the order barely changes between rows
+    for (size_t i=1; i < active.size(); i++){
+      Edge e = active[i] ;
+      size_t j = i ;
+      for (; j > 0 && active[j-1].x > e.x; j--) active[j] = active[j-1] ;
+      active[j] = e ;
+    }
+
+    // Even-odd fill of the pixel centres between pairs of edges
+    for (size_t i=0; i + 1 < active.size(); i+=2){
+      if (active[i].x < active[i+1].x) bDrawn |= fillSpan(active[i].x, active[i+1].x - 1, y, true) ;
+    }
+    for (size_t i=0; i < active.size(); i++) active[i].n += active[i].step ;
+  }
+  return bDrawn ;
+}
+
+// Blend the FG colour into one pixel by alpha 0 to 255. pattern is the FG
+// pixel as stored, rgb the FG colour for 16 bit pixels.
+template <class PF>
+static inline void blendPixelKernel(unsigned char *p, const unsigned char *pattern, const unsigned char *rgb, unsigned int alpha)
+{
+  if (PF::bits == 16){
+    unsigned char c[3] ;
+    PF::getRGB(p, c) ;
+    for (int i=0; i < 3; i++) c[i] = (c[i]*(255 - alpha) + rgb[i]*alpha + 127) / 255 ;
+    PF::putRGB(p, c) ;
+  }else{
+    for (int i=0; i < PF::bytes; i++) p[i] = (p[i]*(255 - alpha) + pattern[i]*alpha + 127) / 255 ;
+  }
+}
+
+bool DisplayImage::blendPixel(int x, int y, unsigned int alpha, const unsigned char *pattern)
+{
+  unsigned char rgb[3] = {m_fg_r, m_fg_g, m_fg_b} ;
+  unsigned char *p = NULL ;
+  DisplayRect c ;
+
+  if (!getClip(&c) || x < c.x0 || y < c.y0 || x > c.x1 || y > c.y1 || alpha == 0) return false ;
+  p = m_img + (y*m_stride) + (x*(m_colourbitdepth/8)) ;
+
+  switch(m_colourbitdepth){
+  case 32: blendPixelKernel<PixelFormat32>(p, pattern, rgb, alpha) ; break ;
+  case 24: blendPixelKernel<PixelFormat24>(p, pattern, rgb, alpha) ; break ;
+  case 16: blendPixelKernel<PixelFormat16>(p, pattern, rgb, alpha) ; break ;
+  case 8: blendPixelKernel<PixelFormat8>(p, pattern, rgb, alpha) ; break ;
+  default: return false ;
+  }
+  return true ;
+}
+
+bool DisplayImage::drawLineAA(int x0, int y0, int x1, int y1)
+{
+  unsigned char pattern[4] ;
+  bool bDrawn = false ;
+
+  if (!m_img) return false ;
+  if (m_colourbitdepth == 1 || x0 == x1 || y0 == y1) return drawLine(x0, y0, x1, y1) ;
+
+  int64_t xd = (int64_t)x1 - x0, yd = (int64_t)y1 - y0 ;
+  bool bIncX = (xd<0?-xd:xd) >= (yd<0?-yd:yd) ;
+  int major = bIncX?x0:y0, minor = bIncX?y0:x0 ;
+  int64_t dx = bIncX?xd:yd ;
+  int64_t dy = bIncX?yd:xd ;
+  int sMajor = dx > 0?1:-1 ;
+  int64_t A = dx>0?dx:-dx ;
+  int64_t gradient = dy * 65536 / A ; // minor movement per step, 16.16
+  int64_t first = 0, last = A, pos = 0 ;
+  double lo = 0, hi = 0 ;
+  DisplayRect c ;
+
+  if (!getClip(&c)) return false ;
+  markDirty(x0, y0, x1, y1) ;
+  getPixelPattern(true, pattern) ;
+
+  // Work relative to the clip
+  int majorSize = bIncX?c.x1-c.x0+1:c.y1-c.y0+1, minorSize = bIncX?c.y1-c.y0+1:c.x1-c.x0+1 ;
+  int64_t cmajor = (int64_t)major - (bIncX?c.x0:c.y0), cminor = (int64_t)minor - (bIncX?c.y0:c.x0) ;
+
+  // Clip the steps to the major axis and, leaving a pixel either side for
+  // the blended neighbours, the minor axis
+  if (sMajor > 0){
+    if (-cmajor > first) first = -cmajor ;
+    if (majorSize - 1 - cmajor < last) last = majorSize - 1 - cmajor ;
+  }else{
+    if (cmajor - majorSize + 1 > first) first = cmajor - majorSize + 1 ;
+    if (cmajor < last) last = cmajor ;
+  }
+  if (gradient != 0){
+    lo = (-1.0 - cminor) * 65536.0 / gradient ;
+    hi = ((double)minorSize - cminor) * 65536.0 / gradient ;
+    if (lo > hi){double t = lo; lo = hi; hi = t;}
+    if (lo - 1 > first) first = (int64_t)(lo - 1) ;
+    if (hi + 1 < last) last = (int64_t)(hi + 1) ;
+  }
+
+  // Each step covers the two pixels either side of the exact minor
+  // coordinate in proportion to the distance
+  for (int64_t i=first; i <= last; i++){
+    pos = (int64_t)minor * 65536 + gradient*i ;
+    int m = (int)(pos >> 16), a = (int)(major + sMajor*i) ;
+    unsigned int f = (pos >> 8) & 0xFF ;
+    if (bIncX){
+      bDrawn |= blendPixel(a, m, 255 - f, pattern) ;
+      bDrawn |= blendPixel(a, m+1, f, pattern) ;
+    }else{
+      bDrawn |= blendPixel(m, a, 255 - f, pattern) ;
+      bDrawn |= blendPixel(m+1, a, f, pattern) ;
+    }
+  }
+  return bDrawn ;
+}
+
+bool DisplayImage::drawEllipseAA(int xc, int yc, unsigned int rx, unsigned int ry)
+{
+  unsigned char pattern[4] ;
+  double rx2 = (double)rx*rx, ry2 = (double)ry*ry, split = 0, exact = 0 ;
+  bool bDrawn = false ;
+  int i = 0, n = 0 ;
+  unsigned int f = 0 ;
+
+  if (!m_img) return false ;
+  if (m_colourbitdepth == 1) return drawEllipse(xc, yc, rx, ry) ;
+  if (rx == 0 || ry == 0) return drawLine(xc - rx, yc - ry, xc + rx, yc + ry) ;
+
+  markDirty(xc - rx - 1, yc - ry - 1, xc + rx + 1, yc + ry + 1) ;
+  getPixelPattern(true, pattern) ;
+
+  // Step along x until the slope reaches 45 degrees, then along y. Each
+  // step blends the two pixels either side of the exact edge into all
+  // four quadrants.
+  for (int pass=0; pass < 2; pass++){
+    split = pass == 0?rx2 / sqrt(rx2 + ry2):ry2 / sqrt(rx2 + ry2) ;
+    n = (int)split ;
+    for (i=0; i <= n; i++){
+      if (pass == 0) exact = ry * sqrt(1.0 - (double)i*i/rx2) ;
+      else exact = rx * sqrt(1.0 - (double)i*i/ry2) ;
+      int e = (int)exact ;
+      f = (unsigned int)((exact - e) * 255 + 0.5) ;
+      for (int q=0; q < 4; q++){
+	int sa = (q & 1)?-1:1, sb = (q & 2)?-1:1 ;
+	if (i == 0 && sa < 0) continue ; // on the axis, already drawn
+	if (pass == 0){
+	  bDrawn |= blendPixel(xc + sa*i, yc + sb*e, 255 - f, pattern) ;
+	  bDrawn |= blendPixel(xc + sa*i, yc + sb*(e+1), f, pattern) ;
+	}else{
+	  bDrawn |= blendPixel(xc + sb*e, yc + sa*i, 255 - f, pattern) ;
+	  bDrawn |= blendPixel(xc + sb*(e+1), yc + sa*i, f, pattern) ;
+	}
+      }
+    }
+  }
+  return bDrawn ;
+}
+
+bool DisplayImage::drawCircleAA(int xc, int yc, unsigned int r)
+{
+  return drawEllipseAA(xc, yc, r, r) ;
+}
+
+void DisplayImage::getPixelPattern(bool bSet, unsigned char *pattern)
+{
+  getPixelPattern(bSet, pattern, m_colourbitdepth) ;
+}
+
+void DisplayImage::getPixelPattern(bool bSet, unsigned char *pattern, unsigned int bitdepth) const
+{
+  unsigned short n16bit = 0 ;
+
+  if (bitdepth == 32){
+    pattern[0] = bSet?m_fg_r:m_bg_r ;
+    pattern[1] = bSet?m_fg_g:m_bg_g ;
+    pattern[2] = bSet?m_fg_b:m_bg_b ;
+    pattern[3] = bSet?m_fg_a:m_bg_a ;
+  }else if (bitdepth == 24){
+    pattern[0] = bSet?m_fg_r:m_bg_r ;
+    pattern[1] = bSet?m_fg_g:m_bg_g ;
+    pattern[2] = bSet?m_fg_b:m_bg_b ;
+  }else if (bitdepth == 16){
+    if (bSet)
+      n16bit = to565(m_fg_r, m_fg_g, m_fg_b) ;
+    else
+      n16bit = to565(m_bg_r, m_bg_g, m_bg_b) ;
+    pattern[0] = n16bit >> 8 ;
+    pattern[1] = 0x00FF & n16bit ;
+  }else if (bitdepth == 8){
+    pattern[0] = bSet?m_fg_grey:m_bg_grey ;
+  }else if (bitdepth == 1){
+    pattern[0] = bSet?0xFF:0x00 ;
+  }
+}
+
+// Replicate the first pixel of a run across the rest of the run. Each memcpy
+// doubles the filled area so a run of n pixels takes log2(n) block copies.
+static void replicatePattern(unsigned char *p, unsigned int pixelbytes, unsigned int runbytes)
+{
+  unsigned int filled = pixelbytes ;
+
+  while (filled < runbytes){
+    unsigned int n = (filled <= runbytes - filled)?filled:runbytes - filled ;
+    memcpy(p + filled, p, n) ;
+    filled += n ;
+  }
+}
+
+// Fill pixels x0 to x1 (inclusive and already clipped) of a row
+template <class PF>
+static void fillSpanKernel(unsigned char *row, unsigned int x0, unsigned int x1, const unsigned char *pattern)
+{
+  unsigned char *p = row + (x0*PF::bytes) ;
+
+  if (PF::bytes == 1){
+    memset(p, pattern[0], x1 - x0 + 1) ;
+  }else{
+    memcpy(p, pattern, PF::bytes) ;
+    replicatePattern(p, PF::bytes, (x1 - x0 + 1) * PF::bytes) ;
+  }
+}
+
+// Mask the partial bytes at each end and set whole bytes in between
+template <>
+void fillSpanKernel<PixelFormat1>(unsigned char *row, unsigned int x0, unsigned int x1, const unsigned char *pattern)
+{
+  unsigned int firstbyte = x0/8, lastbyte = x1/8 ;
+  unsigned char firstmask = 0xFF << (x0%8) ;
+  unsigned char lastmask = 0xFF >> (7 - (x1%8)) ;
+  bool bSet = pattern[0] != 0 ;
+
+  if (firstbyte == lastbyte){
+    firstmask &= lastmask ;
+    if (bSet) row[firstbyte] |= firstmask ;
+    else row[firstbyte] &= ~firstmask ;
+  }else{
+    if (bSet){
+      row[firstbyte] |= firstmask ;
+      row[lastbyte] |= lastmask ;
+    }else{
+      row[firstbyte] &= ~firstmask ;
+      row[lastbyte] &= ~lastmask ;
+    }
+    memset(row + firstbyte + 1, pattern[0], lastbyte - firstbyte - 1) ;
+  }
+}
+
+bool DisplayImage::fillSpan(int x0, int x1, int y, bool bSet)
+{
+  unsigned char pattern[4] ;
+  unsigned char *row = NULL ;
+  DisplayRect c ;
+
+  if (!m_img || !getClip(&c)) return false ;
+  if (x0 > x1){int t = x0; x0 = x1; x1 = t;}
+
+  // Clip the run once
+  if (y < c.y0 || y > c.y1) return false ;
+  if (x1 < c.x0 || x0 > c.x1) return false ;
+  if (x0 < c.x0) x0 = c.x0 ;
+  if (x1 > c.x1) x1 = c.x1 ;
+
+  getPixelPattern(bSet, pattern) ;
+  row = m_img + (y*m_stride) ;
+
+  switch(m_colourbitdepth){
+  case 32:
+    fillSpanKernel<PixelFormat32>(row, x0, x1, pattern) ;
+    break ;
+  case 24:
+    fillSpanKernel<PixelFormat24>(row, x0, x1, pattern) ;
+    break ;
+  case 16:
+    fillSpanKernel<PixelFormat16>(row, x0, x1, pattern) ;
+    break ;
+  case 8:
+    fillSpanKernel<PixelFormat8>(row, x0, x1, pattern) ;
+    break ;
+  case 1:
+    fillSpanKernel<PixelFormat1>(row, x0, x1, pattern) ;
+    break ;
+  default:
+    return false ; // Not supported
+  }
+
+  return true ;
+}
+
+bool DisplayImage::fillRect(int x0, int y0, int x1, int y1, bool bSet)
+{
+  DisplayRect c ;
+
+  if (!m_img || !getClip(&c)) return false ;
+  if (x0 > x1){int t = x0; x0 = x1; x1 = t;}
+  if (y0 > y1){int t = y0; y0 = y1; y1 = t;}
+
+  // Clip the rows
+  if (y1 < c.y0 || y0 > c.y1) return false ;
+  if (y0 < c.y0) y0 = c.y0 ;
+  if (y1 > c.y1) y1 = c.y1 ;
+
+  if (!fillSpan(x0, x1, y0, bSet)) return false ;
+
+  if (m_colourbitdepth == 1){
+    // Edge bytes are merged with existing pixels so each row is masked separately
+    for (int cy = y0+1; cy <= y1; cy++) fillSpan(x0, x1, cy, bSet) ;
+  }else{
+    // Every other row is a copy of the first
+    if (x0 < c.x0) x0 = c.x0 ;
+    if (x1 > c.x1) x1 = c.x1 ;
+    unsigned int pixelbytes = m_colourbitdepth/8 ;
+    unsigned char *p = m_img + (x0*pixelbytes) + (y0*m_stride) ;
+    unsigned int runbytes = (x1 - x0 + 1) * pixelbytes ;
+    for (int cy = y0+1; cy <= y1; cy++) memcpy(p + ((cy-y0)*m_stride), p, runbytes) ;
+  }
+
+  return true ;
+}
+
+// Read exactly len bytes, allowing for short reads from pipes
+static bool readAll(int f, void *buf, size_t len)
+{
+  unsigned char *p = (unsigned char*)buf ;
+  ssize_t n = 0 ;
+
+  while (len > 0){
+    n = read(f, p, len) ;
+    if (n <= 0) return false ;
+    p += n ;
+    len -= n ;
+  }
+  return true ;
+}
+
+// Buffered reader for compressed asset data. No more than len bytes are
+// read from the file so it is left just after the asset.
+class AssetStream{
+public:
+  AssetStream(int f, uint32_t len){m_f = f; m_nRemain = len; m_nPos = m_nLen = 0;};
+
+  bool get(unsigned char *c){
+    if (m_nPos == m_nLen && !fill()) return false ;
+    *c = m_buf[m_nPos++] ;
+    return true ;
+  };
+
+  bool read(unsigned char *dst, uint32_t len){
+    uint32_t chunk = 0 ;
+    while (len > 0){
+      if (m_nPos == m_nLen && !fill()) return false ;
+      chunk = m_nLen - m_nPos ;
+      if (chunk > len) chunk = len ;
+      memcpy(dst, m_buf + m_nPos, chunk) ;
+      m_nPos += chunk ;
+      dst += chunk ;
+      len -= chunk ;
+    }
+    return true ;
+  };
+
+protected:
+  bool fill(){
+    uint32_t len = m_nRemain < sizeof(m_buf) ? m_nRemain : sizeof(m_buf) ;
+    if (len == 0 || !readAll(m_f, m_buf, len)) return false ;
+    m_nRemain -= len ;
+    m_nPos = 0 ;
+    m_nLen = len ;
+    return true ;
+  };
+
+  int m_f ;
+  uint32_t m_nRemain ; // bytes still in the file
+  uint32_t m_nPos, m_nLen ;
+  unsigned char m_buf[512] ;
+};
+
+// Expand PackBits data from in straight into dst, which holds len bytes
+static bool unpackBits(AssetStream &in, unsigned char *dst, uint32_t len)
+{
+  unsigned char n = 0, c = 0 ;
+  uint32_t run = 0, out = 0 ;
+
+  while (out < len){
+    if (!in.get(&n)) return false ;
+    if (n < 128){
+      // Literal bytes
+      run = n + 1 ;
+      if (run > len - out || !in.read(dst + out, run)) return false ;
+    }else if (n > 128){
+      // Repeated byte
+      run = 257 - n ;
+      if (run > len - out || !in.get(&c)) return false ;
+      memset(dst + out, c, run) ;
+    }else{
+      run = 0 ; // no operation
+    }
+    out += run ;
+  }
+  return true ;
+}
+
+// Pixel data of an asset in the display format. The header has already been
+// read from f. Regular files are mapped copy on write so the data is used in
+// place without copying, otherwise it is read into a new buffer. Compressed
+// data is expanded into the new buffer as it is read.
+// *ppMap and *pMapSize describe the mapping to release, or are NULL and 0
+// when the data was allocated with new[]. Returns NULL if the data is
+// missing or fails the checksum.
+static unsigned char *loadAssetData(int f, const DisplayFormatHeader &hdr, void **ppMap, size_t *pMapSize)
+{
+  unsigned char *data = NULL ;
+  unsigned char skip[DISPLAYFORMAT_ALIGN] ;
+  struct stat st ;
+  off_t start = lseek(f, 0, SEEK_CUR) ;
+  off_t payload = 0, base = 0 ;
+  void *map = NULL ;
+  bool bOk = false ;
+
+  *ppMap = NULL ;
+  *pMapSize = 0 ;
+
+  if (hdr.size > XMB_LOAD_MAX_SIZE){
+    // File is very large, likely to be corrupt
+    return NULL ;
+  }
+
+  if (hdr.compression == DISPLAYFORMAT_NONE &&
+      start >= DISPLAYFORMAT_HEADER_SIZE && fstat(f, &st) == 0 && S_ISREG(st.st_mode)){
+    payload = start - DISPLAYFORMAT_HEADER_SIZE + hdr.offset ;
+    if (payload + (off_t)hdr.size > st.st_size){
+      fprintf(stderr, "Asset file is truncated\n") ;
+      return NULL ;
+    }
+    // Mappings start on a page boundary
+    base = payload - (payload % sysconf(_SC_PAGESIZE)) ;
+    map = mmap(NULL, (payload - base) + hdr.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, base) ;
+    if (map != MAP_FAILED){
+      data = (unsigned char*)map + (payload - base) ;
+      if (displayFormatChecksum(data, hdr.size) != hdr.checksum){
+	fprintf(stderr, "Asset file checksum does not match\n") ;
+	munmap(map, (payload - base) + hdr.size) ;
+	return NULL ;
+      }
+      lseek(f, payload + hdr.size, SEEK_SET) ; // leave the file after the asset as a read would
+      *ppMap = map ;
+      *pMapSize = (payload - base) + hdr.size ;
+      return data ;
+    }
+  }
+
+  // Compressed data, pipes or files which cannot be mapped are read
+  for (uint32_t pad = hdr.offset - DISPLAYFORMAT_HEADER_SIZE; pad > 0; pad -= DISPLAYFORMAT_ALIGN){
+    if (!readAll(f, skip, DISPLAYFORMAT_ALIGN)) return NULL ;
+  }
+  data = new unsigned char[hdr.size] ;
+  if (!data) return NULL ;
+  if (hdr.compression == DISPLAYFORMAT_PACKBITS){
+    AssetStream in(f, hdr.packed) ;
+    bOk = unpackBits(in, data, hdr.size) ;
+  }else{
+    bOk = readAll(f, data, hdr.size) ;
+  }
+  if (!bOk || displayFormatChecksum(data, hdr.size) != hdr.checksum){
+    fprintf(stderr, "Cannot read asset data\n") ;
+    delete[] data ;
+    return NULL ;
+  }
+  return data ;
+}
+
+bool DisplayImage::loadFile(int f)
+{
+  if (!f) return false ; // need an open file
+
+  uint32_t width = 0 ;
+  uint32_t height = 0 ;
+  unsigned char head[DISPLAYFORMAT_HEADER_SIZE] ;
+  DisplayFormatHeader hdr ;
+  unsigned char *data = NULL ;
+  void *map = NULL ;
+  size_t mapsize = 0 ;
+
+  if (!readAll(f, head, 4)) return false ;
+
+  if (displayFormatIsHeader(head)){
+    if (!readAll(f, head + 4, DISPLAYFORMAT_HEADER_SIZE - 4)) return false ;
+    if (!displayFormatReadHeader(head, &hdr) || hdr.type != DISPLAYFORMAT_BITMAP || hdr.chars != 1 ||
+	!assetLayoutValid(hdr)){
+      fprintf(stderr, "Cannot open the bitmap file, unsupported format\n") ;
+      return false ;
+    }
+    if (!(data = loadAssetData(f, hdr, &map, &mapsize))) return false ;
+
+    // Use the asset data as the image
+    releaseImg() ;
+    m_img = data ;
+    m_pMap = map ;
+    m_nMapSize = mapsize ;
+    m_memsize = hdr.size ;
+    m_width = hdr.width ;
+    m_height = hdr.height ;
+    m_stride = hdr.stride ;
+    m_colourbitdepth = hdr.bitdepth ;
+    m_nDirty = 0 ;
+    markDirty(0, 0, m_width-1, m_height-1) ;
+    return true ;
+  }
+
+  // Files from older versions of xbm2bin hold host endian width and height
+  memcpy(&width, head, sizeof(uint32_t)) ;
+  if (!readAll(f, &height, sizeof(uint32_t))) return false ;
+  if (!allocateImg(width,height,1)) return false ;
+  
+  if (!readAll(f, m_img, m_memsize)){
+    return false ; // couldn't read all of the image
+  }
+
+  return true ;
+}
+ 
+bool DisplayImage::createImage(unsigned int width, unsigned int height, unsigned int bitdepth)
+{
+  if (!allocateImg(width, height, bitdepth)) return false ;
+
+  return zeroImg() ;
+}
+
+bool DisplayImage::allocateImg(unsigned int width, unsigned int height, unsigned int bitdepth)
+{
+  uint64_t size = 0 ;
+  unsigned int stride =0;
+
+  if (width == 0 || height == 0){
+    // This is an error but can be treated as
+    // an empty image
+    releaseImg() ;
+    m_width = 0 ;
+    m_height = 0 ;
+    m_stride = 0 ;
+    m_nDirty = 0 ;
+    return true ;
+  }
+    
+  stride = imageStride(width, bitdepth) ;
+  if (stride == 0) return false ; // Unsupported
+  size = (uint64_t)stride * height ;
+  if (size > 0xFFFFFFFF) return false ; // too large to address
+  if (bitdepth == 1 && size > XMB_LOAD_MAX_SIZE){
+    // File is very large, likely to be corrupt or not an image file
+    return false ;
+  }
+
+  m_colourbitdepth = bitdepth ;
+
+  releaseImg() ; // remove old image and replace with this one.
+  
+  // Allocate memory
+  m_img = new unsigned char[size] ;
+  if (!m_img) return false ; // cannot allocate memory for image
+
+  m_memsize = size ;
+  m_width = width ;
+  m_height = height ;
+  m_stride = stride ;
+
+  // New image contents
+  m_nDirty = 0 ;
+  markDirty(0, 0, m_width-1, m_height-1) ;
+ 
+  return true ;
+}
+
+bool DisplayImage::zeroImg()
+{
+  if (m_bResourceImage) return false ;
+  memset(m_img, 0, m_memsize) ;
+  markDirty(0, 0, m_width-1, m_height-1) ;
+  return true ;
+}
+
+bool DisplayImage::eraseBackground()
+{
+  if (m_colourbitdepth == 1 && !m_bClip){
+    return zeroImg() ;
+  }
+
+  if (m_colourbitdepth != 32 &&
+      m_colourbitdepth != 24 &&
+      m_colourbitdepth != 16 &&
+      m_colourbitdepth != 8 &&
+      m_colourbitdepth != 1){
+    return false ; // Not supported
+  }
+  if (!m_img) return true ; // nothing to erase
+
+  markDirty(0, 0, m_width-1, m_height-1) ;
+  return fillRect(0, 0, m_width-1, m_height-1, false) ;
+}
+// Pixels along each side of the tiles rotations are done in, so the rows
+// read and written by a tile stay in cache
+#define TRANSFORM_TILE 32
+
+// Write pixels of a width x height destination where the source pixel for
+// destination x,y is src + x*colstep + y*rowstep. Rows of the destination
+// are written a tile at a time so rotations, which read down source
+// columns, reuse each source cache line for a whole tile.
+template <unsigned int BYTES>
+static void transformKernel(unsigned char *dst, unsigned int dststride, unsigned int width, unsigned int height,
+			    const unsigned char *src, long colstep, long rowstep)
+{
+  unsigned int tx = 0, ty = 0, x = 0, y = 0, xend = 0, yend = 0 ;
+  unsigned char *d = NULL ;
+  const unsigned char *s = NULL ;
+
+  if (colstep == BYTES){
+    // Rows are the same way round so copy whole rows
+    for (y=0; y < height; y++) memcpy(dst + (y*dststride), src + (y*rowstep), width*BYTES) ;
+    return ;
+  }
+
+  for (ty=0; ty < height; ty+=TRANSFORM_TILE){
+    yend = ty + TRANSFORM_TILE < height?ty + TRANSFORM_TILE:height ;
+    for (tx=0; tx < width; tx+=TRANSFORM_TILE){
+      xend = tx + TRANSFORM_TILE < width?tx + TRANSFORM_TILE:width ;
+      for (y=ty; y < yend; y++){
+	d = dst + (y*dststride) + (tx*BYTES) ;
+	s = src + (tx*colstep) + (y*rowstep) ;
+	for (x=tx; x < xend; x++){
+	  memcpy(d, s, BYTES) ;
+	  d += BYTES ;
+	  s += colstep ;
+	}
+      }
+    }
+  }
+}
+
+static inline unsigned char reverseBits(unsigned char b)
+{
+  b = ((b & 0xF0) >> 4) | ((b & 0x0F) << 4) ;
+  b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2) ;
+  b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1) ;
+  return b ;
+}
+
+// Rotate a width x height 1 bit image by 90 degrees clockwise or 270. Each
+// block of 8 source rows by one source byte is transposed as a 64 bit word
+// and becomes one byte in 8 destination rows. Padding bits are cleared.
+static void rotateBitsKernel(unsigned char *dst, unsigned int dststride,
+			     const unsigned char *src, unsigned int srcstride,
+			     unsigned int width, unsigned int height, bool bClockwise)
+{
+  unsigned int jt = 0, jend = 0, j = 0, k = 0, i = 0, b = 0, sy = 0, dy = 0 ;
+  unsigned int srcbytes = width/8 + (width%8?1:0) ;
+  uint64_t block = 0 ;
+
+  // Tiles of source bytes keep the destination rows being written in cache
+  for (jt=0; jt < srcbytes; jt+=TRANSFORM_TILE/8){
+    jend = jt + (TRANSFORM_TILE/8) < srcbytes?jt + (TRANSFORM_TILE/8):srcbytes ;
+    for (k=0; k < dststride; k++){
+      // Destination byte k holds source rows 8k to 8k+7 counted from the
+      // bottom for a clockwise turn
+      for (j=jt; j < jend; j++){
+	block = 0 ;
+	for (i=0; i < 8 && (k*8)+i < height; i++){
+	  sy = bClockwise?height-1-((k*8)+i):(k*8)+i ;
+	  block |= (uint64_t)src[(sy*srcstride)+j] << (i*8) ;
+	}
+	block = transposeBits(block) ;
+	for (b=0; b < 8 && (j*8)+b < width; b++){
+	  dy = bClockwise?(j*8)+b:width-1-((j*8)+b) ;
+	  dst[(dy*dststride)+k] = (block >> (b*8)) & 0xFF ;
+	}
+      }
+    }
+  }
+}
+
+// Mirror a row of width bits. Each destination byte reads the 8 source bits
+// which end up in it and reverses them. Padding bits are cleared.
+static void flipBitsRow(unsigned char *dst, const unsigned char *src, unsigned int width)
+{
+  unsigned int bytes = width/8 + (width%8?1:0) ;
+  unsigned int v = 0 ;
+  int start = 0 ;
+
+  for (unsigned int k=0; k < bytes; k++){
+    // Source bits start to start+7 land in destination byte k reversed
+    start = (int)width - (int)((k+1)*8) ;
+    if (start >= 0){
+      v = src[start/8] >> (start%8) ;
+      if (start%8) v |= src[(start/8)+1] << (8 - (start%8)) ;
+    }else{
+      v = src[0] << (-start) ;
+    }
+    dst[k] = reverseBits(v & 0xFF) ;
+  }
+}
+
+bool DisplayImage::transform(const DisplayImage &img, unsigned int orientation)
+{
+  unsigned int width = 0, height = 0, stride = 0, bytes = 0 ;
+  unsigned char *buffer = NULL ;
+  const unsigned char *src = NULL ;
+  long colstep = 0, rowstep = 0 ;
+  bool bNewBuffer = false ;
+
+  if (!img.m_img || orientation > DISPLAY_FLIP_V) return false ;
+  if (imageStride(1, img.m_colourbitdepth) == 0) return false ; // Unsupported
+
+  // Size after turning
+  width = img.m_width ;
+  height = img.m_height ;
+  if (orientation == DISPLAY_ROTATE_90 || orientation == DISPLAY_ROTATE_270){
+    width = img.m_height ;
+    height = img.m_width ;
+  }
+  stride = imageStride(width, img.m_colourbitdepth) ;
+
+  // Write over this image if it already has the right layout
+  bNewBuffer = (this == &img || !m_img || m_bResourceImage ||
+		m_width != width || m_height != height ||
+		m_colourbitdepth != img.m_colourbitdepth) ;
+  if (bNewBuffer){
+    buffer = new unsigned char[stride * height] ;
+    if (!buffer) return false ;
+  }else{
+    buffer = m_img ;
+  }
+
+  if (img.m_colourbitdepth == 1){
+    switch(orientation){
+    case DISPLAY_ROTATE_90:
+    case DISPLAY_ROTATE_270:
+      rotateBitsKernel(buffer, stride, img.m_img, img.m_stride, img.m_width, img.m_height,
+		       orientation == DISPLAY_ROTATE_90) ;
+      break ;
+    case DISPLAY_ROTATE_180:
+      for (unsigned int y=0; y < height; y++){
+	flipBitsRow(buffer + (y*stride), img.m_img + ((height-1-y)*img.m_stride), width) ;
+      }
+      break ;
+    case DISPLAY_FLIP_H:
+      for (unsigned int y=0; y < height; y++){
+	flipBitsRow(buffer + (y*stride), img.m_img + (y*img.m_stride), width) ;
+      }
+      break ;
+    case DISPLAY_FLIP_V:
+      for (unsigned int y=0; y < height; y++){
+	memcpy(buffer + (y*stride), img.m_img + ((height-1-y)*img.m_stride), stride) ;
+      }
+      break ;
+    default:
+      for (unsigned int y=0; y < height; y++){
+	memcpy(buffer + (y*stride), img.m_img + (y*img.m_stride), stride) ;
+      }
+      break ;
+    }
+  }else{
+    // Find the source pixel of the top left destination pixel and the steps
+    // to the source pixels right of and below it
+    bytes = img.m_colourbitdepth/8 ;
+    switch(orientation){
+    case DISPLAY_ROTATE_90:
+      src = img.m_img + ((img.m_height-1)*img.m_stride) ;
+      colstep = -(long)img.m_stride ;
+      rowstep = bytes ;
+      break ;
+    case DISPLAY_ROTATE_180:
+      src = img.m_img + ((img.m_height-1)*img.m_stride) + ((img.m_width-1)*bytes) ;
+      colstep = -(long)bytes ;
+      rowstep = -(long)img.m_stride ;
+      break ;
+    case DISPLAY_ROTATE_270:
+      src = img.m_img + ((img.m_width-1)*bytes) ;
+      colstep = img.m_stride ;
+      rowstep = -(long)bytes ;
+      break ;
+    case DISPLAY_FLIP_H:
+      src = img.m_img + ((img.m_width-1)*bytes) ;
+      colstep = -(long)bytes ;
+      rowstep = img.m_stride ;
+      break ;
+    case DISPLAY_FLIP_V:
+      src = img.m_img + ((img.m_height-1)*img.m_stride) ;
+      colstep = bytes ;
+      rowstep = -(long)img.m_stride ;
+      break ;
+    default:
+      src = img.m_img ;
+      colstep = bytes ;
+      rowstep = img.m_stride ;
+      break ;
+    }
+
+    switch(bytes){
+    case 4:
+      transformKernel<4>(buffer, stride, width, height, src, colstep, rowstep) ;
+      break ;
+    case 3:
+      transformKernel<3>(buffer, stride, width, height, src, colstep, rowstep) ;
+      break ;
+    case 2:
+      transformKernel<2>(buffer, stride, width, height, src, colstep, rowstep) ;
+      break ;
+    default:
+      transformKernel<1>(buffer, stride, width, height, src, colstep, rowstep) ;
+      break ;
+    }
+  }
+
+  if (bNewBuffer){
+    // img is finished with so it can be this image
+    m_colourbitdepth = img.m_colourbitdepth ;
+    releaseImg() ;
+    m_img = buffer ;
+    m_memsize = stride * height ;
+    m_width = width ;
+    m_height = height ;
+    m_stride = stride ;
+  }
+
+  m_nDirty = 0 ;
+  markDirty(0, 0, m_width-1, m_height-1) ;
+  return true ;
+}
+
+// Fewest destination rows given to each thread when scaling
+#define SCALE_MIN_BAND 32
+
+#define SCALE_ONE (1 << SIMD_WEIGHT_BITS)
+
+// Source pixels and weights for every destination pixel along one axis.
+// Each destination pixel has the same number of taps, padded with zero
+// weights, so the passes have no special cases.
+struct ScaleTaps{
+  unsigned int taps ;
+  std::vector<unsigned int> index ; // source pixel of each tap
+  std::vector<int16_t> weights ; // weights of each destination pixel sum to SCALE_ONE
+};
+
+static void scaleTaps(unsigned int filter, unsigned int srclen, unsigned int dstlen, ScaleTaps *t)
+{
+  unsigned int *index = NULL ;
+  int16_t *weights = NULL ;
+  int64_t centre = 0 ;
+  uint64_t start = 0, end = 0, covered = 0 ;
+  unsigned int first = 0, last = 0, frac = 0, n = 0, sum = 0, total = 0 ;
+
+  if (filter == DISPLAY_SCALE_BOX) t->taps = ((srclen + dstlen - 1) / dstlen) + 1 ;
+  else if (filter == DISPLAY_SCALE_BILINEAR) t->taps = 2 ;
+  else t->taps = 1 ;
+  t->index.assign(dstlen * t->taps, 0) ;
+  t->weights.assign(dstlen * t->taps, 0) ;
+
+  for (unsigned int d=0; d < dstlen; d++){
+    index = &t->index[d * t->taps] ;
+    weights = &t->weights[d * t->taps] ;
+
+    switch(filter){
+    case DISPLAY_SCALE_BILINEAR:
+      // Centre of the destination pixel in 16.16 source pixels
+      centre = ((((int64_t)(2*d) + 1) * srclen) << 16) / (2 * (int64_t)dstlen) - 32768 ;
+      if (centre < 0) centre = 0 ;
+      first = centre >> 16 ;
+      frac = centre & 0xFFFF ;
+      if (first >= srclen - 1){
+	first = srclen - 1 ;
+	frac = 0 ;
+      }
+      index[0] = first ;
+      index[1] = first + 1 < srclen?first + 1:first ;
+      weights[1] = ((frac * SCALE_ONE) + 32768) >> 16 ;
+      weights[0] = SCALE_ONE - weights[1] ;
+      break ;
+    case DISPLAY_SCALE_BOX:
+      // The destination pixel covers srclen units of source pixels which
+      // are dstlen units wide. Weights are rounded from the running total
+      // so they always sum to SCALE_ONE.
+      start = (uint64_t)d * srclen ;
+      end = start + srclen ;
+      first = start / dstlen ;
+      last = (end - 1) / dstlen ;
+      sum = 0 ;
+      for (n=0; first + n <= last; n++){
+	covered = ((uint64_t)(first + n + 1) * dstlen < end?(uint64_t)(first + n + 1) * dstlen:end) - start ;
+	total = ((covered * SCALE_ONE) + (srclen / 2)) / srclen ;
+	index[n] = first + n ;
+	weights[n] = total - sum ;
+	sum = total ;
+      }
+      for (; n < t->taps; n++) index[n] = last ;
+      break ;
+    default:
+      index[0] = (((uint64_t)(2*d) + 1) * srclen) / (2 * (uint64_t)dstlen) ;
+      weights[0] = SCALE_ONE ;
+      break ;
     }
-  }else{
-    if (!drawH(x0,x0+width,y0))bRet = false ;
-    if (!drawH(x0,x0+width,y0+height))bRet = false ;
-  }    
-  
-  return bRet ;
+  }
 }
 
-bool DisplayImage::drawV(int x, int y0, int y1)
+template <unsigned int BYTES>
+static void nearestRowKernel(const unsigned char *src, unsigned char *dst, unsigned int width, const unsigned int *index)
 {
-  int inc = 1, cy = 0 ;
-  if (y0 > y1) inc = -1 ; // need to reverse writing direction
+  for (unsigned int x=0; x < width; x++) memcpy(dst + (x*BYTES), src + (index[x]*BYTES), BYTES) ;
+}
 
-  // Handle exception cases
-  if (x < 0 || x >= (int)m_width) return false ; // Out of image area for entire line
-  if (y0 < 0 && y1 < 0) return false ; // out of image area for entire line
-  if (y0 >= (int)m_height && y1 >= (int)m_height) return false ; // out of image area for entire line
+// Everything a thread needs to scale a band of rows
+struct ScaleJob{
+  const unsigned char *src ;
+  unsigned int srcstride, srcwidth ;
+  unsigned char *dst ;
+  unsigned int dststride, dstwidth ;
+  unsigned int bitdepth, filter ;
+  const ScaleTaps *xtaps, *ytaps ;
+};
+
+// Scale destination rows y0 to y1 (exclusive). Source rows are scaled across
+// as they are first needed and kept in a ring of one row per tap, which is
+// enough as the taps of each destination row span no more rows than that.
+// 16 and 24 bit pixels are filtered as 4 byte pixels to use the same kernels.
+static void scaleBand(const ScaleJob &job, unsigned int y0, unsigned int y1)
+{
+  const ScaleTaps &yt = *job.ytaps ;
+  unsigned int bytes = job.bitdepth/8, channels = 0, rowbytes = 0 ;
+  unsigned int sy = 0, slot = 0, k = 0 ;
+  const unsigned char *s = NULL ;
+  unsigned char *d = NULL ;
+
+  if (job.filter == DISPLAY_SCALE_NEAREST){
+    for (unsigned int y=y0; y < y1; y++){
+      s = job.src + (yt.index[y]*job.srcstride) ;
+      d = job.dst + (y*job.dststride) ;
+      switch(bytes){
+      case 4: nearestRowKernel<4>(s, d, job.dstwidth, &job.xtaps->index[0]) ; break ;
+      case 3: nearestRowKernel<3>(s, d, job.dstwidth, &job.xtaps->index[0]) ; break ;
+      case 2: nearestRowKernel<2>(s, d, job.dstwidth, &job.xtaps->index[0]) ; break ;
+      default: nearestRowKernel<1>(s, d, job.dstwidth, &job.xtaps->index[0]) ; break ;
+      }
+    }
+    return ;
+  }
+
+  channels = job.bitdepth == 8?1:4 ;
+  rowbytes = job.dstwidth * channels ;
+
+  std::vector<unsigned char> rows(yt.taps * rowbytes) ;
+  std::vector<unsigned int> held(yt.taps, ~0u) ; // source row in each slot
+  std::vector<unsigned char> rgb(bytes != channels?job.srcwidth*4:0) ;
+  std::vector<unsigned char> out(bytes != channels?rowbytes:0) ;
+  std::vector<const unsigned char *> taprows(yt.taps) ;
+
+  for (unsigned int y=y0; y < y1; y++){
+    for (k=0; k < yt.taps; k++){
+      sy = yt.index[(y*yt.taps)+k] ;
+      slot = sy % yt.taps ;
+      taprows[k] = &rows[slot * rowbytes] ;
+      if (held[slot] == sy) continue ;
+
+      held[slot] = sy ;
+      s = job.src + (sy*job.srcstride) ;
+      if (job.bitdepth == 16){
+	for (unsigned int x=0; x < job.srcwidth; x++) PixelFormat16::getRGB(s + (x*2), &rgb[x*4]) ;
+	s = &rgb[0] ;
+      }else if (job.bitdepth == 24){
+	for (unsigned int x=0; x < job.srcwidth; x++) memcpy(&rgb[x*4], s + (x*3), 3) ;
+	s = &rgb[0] ;
+      }
+      simdScaleRow(s, channels, &rows[slot * rowbytes], job.dstwidth,
+		   &job.xtaps->index[0], &job.xtaps->weights[0], job.xtaps->taps) ;
+    }
+    d = job.dst + (y*job.dststride) ;
+    if (job.bitdepth == 16){
+      simdBlendRows(&taprows[0], &yt.weights[y*yt.taps], yt.taps, &out[0], rowbytes) ;
+      for (unsigned int x=0; x < job.dstwidth; x++) PixelFormat16::putRGB(d + (x*2), &out[x*4]) ;
+    }else if (job.bitdepth == 24){
+      simdBlendRows(&taprows[0], &yt.weights[y*yt.taps], yt.taps, &out[0], rowbytes) ;
+      for (unsigned int x=0; x < job.dstwidth; x++) memcpy(d + (x*3), &out[x*4], 3) ;
+    }else{
+      simdBlendRows(&taprows[0], &yt.weights[y*yt.taps], yt.taps, d, rowbytes) ;
+    }
+  }
+}
+
+bool DisplayImage::scale(const DisplayImage &img, unsigned int filter, unsigned int threads)
+{
+  ScaleTaps xtaps, ytaps ;
+  ScaleJob job ;
+  std::vector<std::thread> workers ;
+  unsigned int bands = 0, band = 0 ;
+
+  if (!m_img || !img.m_img || this == &img || m_bResourceImage) return false ;
+  if (m_colourbitdepth != img.m_colourbitdepth || filter > DISPLAY_SCALE_BOX) return false ;
+  if (m_colourbitdepth != 32 &&
+      m_colourbitdepth != 24 &&
+      m_colourbitdepth != 16 &&
+      m_colourbitdepth != 8){
+    return false ; // Unsupported
+  }
 
-  for (cy=y0; cy != y1; cy+=inc){
-    if (cy >= 0 && cy < (int)m_height) setPixel(x, cy, true) ;
+  scaleTaps(filter, img.m_width, m_width, &xtaps) ;
+  scaleTaps(filter, img.m_height, m_height, &ytaps) ;
+
+  job.src = img.m_img ;
+  job.srcstride = img.m_stride ;
+  job.srcwidth = img.m_width ;
+  job.dst = m_img ;
+  job.dststride = m_stride ;
+  job.dstwidth = m_width ;
+  job.bitdepth = m_colourbitdepth ;
+  job.filter = filter ;
+  job.xtaps = &xtaps ;
+  job.ytaps = &ytaps ;
+
+  // Split the rows into bands, keeping the first for this thread
+  bands = threads ;
+  if (bands > m_height / SCALE_MIN_BAND) bands = m_height / SCALE_MIN_BAND ;
+  if (bands < 1) bands = 1 ;
+  band = (m_height + bands - 1) / bands ;
+  for (unsigned int y=band; y < m_height; y+=band){
+    workers.push_back(std::thread(scaleBand, std::cref(job), y, y + band < m_height?y + band:m_height)) ;
   }
-  if (cy >=0) setPixel(x, cy, true); // set final x,y1 pixel
+  scaleBand(job, 0, band < m_height?band:m_height) ;
+  for (size_t i=0; i < workers.size(); i++) workers[i].join() ;
 
+  markDirty(0, 0, m_width-1, m_height-1) ;
   return true ;
 }
 
-bool DisplayImage::drawH(int x0, int x1, int y)
+bool DisplayImage::copy_rotate90_right(const DisplayImage &img)
 {
-  int inc = 1, cx = 0 ;
-  if (x0 > x1) inc = -1 ; // need to reverse writing direction
+  return transform(img, DISPLAY_ROTATE_90) ;
+}
 
-  // Handle exception cases
-  if (y < 0 || y >= (int)m_height) return false ; // Out of image area for entire line
-  if (x0 < 0 && x1 < 0) return false ; // out of image area for entire line
-  if (x0 >= (int)m_width && x1 >= (int)m_width) return false ; // out of image area for entire line
+// Counters are spread over banks by pixel so runs of one value do not wait
+// on the previous increment of the same counter
+#define STATS_BANKS 4
+
+// Fewest rows given to each thread when counting
+#define STATS_MIN_BAND 32
+
+struct StatsCounts{
+  unsigned int bank[STATS_BANKS][4][256] ;
+};
+
+struct StatsJob{
+  const unsigned char *src ; // first pixel of the region
+  unsigned int stride ;
+  unsigned int width ;
+  unsigned int bitdepth ;
+};
 
-  for (cx=x0; cx != x1; cx+=inc){
-    if (cx >= 0 && cx < (int)m_width) setPixel(cx, y, true) ;
+// Count one row of width pixels. grey holds the luma of each pixel. Grey
+// images only count luma and are copied to the other channels at the end.
+template <class PF>
+static void statsRowKernel(const unsigned char *row, const unsigned char *grey, unsigned int width, StatsCounts *c)
+{
+  unsigned char rgb[3] ;
+  unsigned int x = 0 ;
+
+  if (PF::bits == 8){
+    for (; x + STATS_BANKS <= width; x+=STATS_BANKS){
+      c->bank[0][DISPLAY_STATS_LUMA][row[x]]++ ;
+      c->bank[1][DISPLAY_STATS_LUMA][row[x+1]]++ ;
+      c->bank[2][DISPLAY_STATS_LUMA][row[x+2]]++ ;
+      c->bank[3][DISPLAY_STATS_LUMA][row[x+3]]++ ;
+    }
+    for (; x < width; x++) c->bank[x % STATS_BANKS][DISPLAY_STATS_LUMA][row[x]]++ ;
+    return ;
   }
-  if (cx >=0) setPixel(cx, y, true); // set final x1,y pixel
 
-  return true ;  
+  for (; x < width; x++){
+    unsigned int (*b)[256] = c->bank[x % STATS_BANKS] ;
+    PF::getRGB(row + (x*PF::bytes), rgb) ;
+    b[DISPLAY_STATS_RED][rgb[0]]++ ;
+    b[DISPLAY_STATS_GREEN][rgb[1]]++ ;
+    b[DISPLAY_STATS_BLUE][rgb[2]]++ ;
+    b[DISPLAY_STATS_LUMA][grey[x]]++ ;
+  }
 }
 
-bool DisplayImage::loadFile(int f)
+// Count rows y0 to y1-1 of the job into counts
+static void statsBand(const StatsJob &job, unsigned int y0, unsigned int y1, StatsCounts *counts)
 {
-  if (!f) return false ; // need an open file
+  std::vector<unsigned char> grey(job.width) ;
+  const unsigned char *row = NULL ;
+
+  for (unsigned int y=y0; y < y1; y++){
+    row = job.src + (y*job.stride) ;
+    if (job.bitdepth != 8) simdGreyConvert(row, job.bitdepth, &grey[0], job.width) ;
+    switch(job.bitdepth){
+    case 8: statsRowKernel<PixelFormat8>(row, row, job.width, counts) ; break ;
+    case 16: statsRowKernel<PixelFormat16>(row, &grey[0], job.width, counts) ; break ;
+    case 24: statsRowKernel<PixelFormat24>(row, &grey[0], job.width, counts) ; break ;
+    case 32: statsRowKernel<PixelFormat32>(row, &grey[0], job.width, counts) ; break ;
+    }
+  }
+}
 
-  uint32_t width = 0 ;
-  uint32_t height = 0 ;
+bool DisplayImage::getStatistics(DisplayStats *stats, const DisplayRect *roi, unsigned int threads) const
+{
+  DisplayRect r ;
+  StatsJob job ;
+  std::vector<StatsCounts> counts ;
+  std::vector<std::thread> workers ;
+  unsigned int bands = 0, band = 0, height = 0, c = 0, v = 0, i = 0 ;
+  uint64_t sum = 0 ;
+
+  if (!m_img || !stats) return false ;
+  if (m_colourbitdepth != 32 &&
+      m_colourbitdepth != 24 &&
+      m_colourbitdepth != 16 &&
+      m_colourbitdepth != 8){
+    return false ; // Unsupported
+  }
 
-  // Not great as it assumes little endian packing (or depends on hardware big/little endian configuration)
-  
-  // Read the width and height
-  if (read(f, &width, sizeof(uint32_t)) != sizeof(uint32_t)){
-    return false ;
+  r.x0 = 0 ;
+  r.y0 = 0 ;
+  r.x1 = m_width - 1 ;
+  r.y1 = m_height - 1 ;
+  if (roi){
+    // Clip to the image
+    if (roi->x0 > r.x0) r.x0 = roi->x0 ;
+    if (roi->y0 > r.y0) r.y0 = roi->y0 ;
+    if (roi->x1 < r.x1) r.x1 = roi->x1 ;
+    if (roi->y1 < r.y1) r.y1 = roi->y1 ;
+    if (r.x0 > r.x1 || r.y0 > r.y1) return false ;
   }
-  if (read(f, &height, sizeof(uint32_t)) != sizeof(uint32_t)){
-    return false ;
+
+  job.bitdepth = m_colourbitdepth ;
+  job.stride = m_stride ;
+  job.width = r.x1 - r.x0 + 1 ;
+  job.src = m_img + (r.y0*m_stride) + (r.x0*(m_colourbitdepth/8)) ;
+  height = r.y1 - r.y0 + 1 ;
+
+  // Each band counts separately and the counts are summed at the end
+  bands = threads ;
+  if (bands > height / STATS_MIN_BAND) bands = height / STATS_MIN_BAND ;
+  if (bands < 1) bands = 1 ;
+  band = (height + bands - 1) / bands ;
+  counts.resize(bands) ;
+  memset(&counts[0], 0, bands * sizeof(StatsCounts)) ;
+  for (unsigned int y=band, n=1; y < height; y+=band, n++){
+    workers.push_back(std::thread(statsBand, std::cref(job), y, y + band < height?y + band:height, &counts[n])) ;
   }
-  if (!allocateImg(width,height,1)) return false ;
-  
-  // casting to signed shouldn't be a problem as we have a configured file limit under 2 GB
-  // and large image files are just wrong for OLEDs
-  if (read(f, m_img, m_memsize) != (signed)m_memsize){
-    return false ; // couldn't read all of the image
+  statsBand(job, 0, band < height?band:height, &counts[0]) ;
+  for (i=0; i < workers.size(); i++) workers[i].join() ;
+
+  memset(stats, 0, sizeof(DisplayStats)) ;
+  for (i=0; i < bands; i++){
+    for (unsigned int b=0; b < STATS_BANKS; b++){
+      for (c=0; c < 4; c++){
+	for (v=0; v < 256; v++) stats->histogram[c][v] += counts[i].bank[b][c][v] ;
+      }
+    }
+  }
+  if (m_colourbitdepth == 8){
+    for (c=0; c < 3; c++) memcpy(stats->histogram[c], stats->histogram[DISPLAY_STATS_LUMA], sizeof(stats->histogram[c])) ;
   }
 
+  stats->pixels = job.width * height ;
+  for (c=0; c < 4; c++){
+    for (v=0; !stats->histogram[c][v]; v++) ;
+    stats->min[c] = v ;
+    for (v=255; !stats->histogram[c][v]; v--) ;
+    stats->max[c] = v ;
+    for (sum=0, v=0; v < 256; v++) sum += (uint64_t)v * stats->histogram[c][v] ;
+    stats->mean[c] = (float)sum / stats->pixels ;
+  }
   return true ;
 }
- 
-bool DisplayImage::createImage(unsigned int width, unsigned int height, unsigned int bitdepth)
+
+bool DisplayImage::createDistribution(unsigned int threads)
 {
-  if (!allocateImg(width, height, bitdepth)) return false ;
+  if (!m_pStats) m_pStats = new DisplayStats() ;
+  return getStatistics(m_pStats, NULL, threads) ;
+}
 
-  return zeroImg() ;
+unsigned int DisplayImage::getRedDistribution(uint8_t intensity)
+{
+  return m_pStats?m_pStats->histogram[DISPLAY_STATS_RED][intensity]:0 ;
 }
 
-bool DisplayImage::allocateImg(unsigned int width, unsigned int height, unsigned int bitdepth)
+unsigned int DisplayImage::getGreenDistribution(uint8_t intensity)
 {
-  unsigned int size = 0, stride =0;
+  return m_pStats?m_pStats->histogram[DISPLAY_STATS_GREEN][intensity]:0 ;
+}
 
-  if (width == 0 || height == 0){
-    // This is an error but can be treated as
-    // an empty image
-    if (m_img) delete[] m_img ;
-    m_img = NULL;
-    m_memsize = 0 ;
-    m_width = 0 ;
-    m_height = 0 ;
-    m_stride = 0 ;
-    return true ;
+unsigned int DisplayImage::getBlueDistribution(uint8_t intensity)
+{
+  return m_pStats?m_pStats->histogram[DISPLAY_STATS_BLUE][intensity]:0 ;
+}
+
+unsigned int DisplayImage::getLumaDistribution(uint8_t intensity)
+{
+  return m_pStats?m_pStats->histogram[DISPLAY_STATS_LUMA][intensity]:0 ;
+}
+
+// Copy modes. apply() works on one byte of a pixel and applyWord() on eight
+// bytes, or 64 packed 1 bit pixels, at a time.
+struct CopyOverwrite{
+  static inline unsigned char apply(unsigned char d, unsigned char s, unsigned char fg){ return s ; }
+  static inline uint64_t applyWord(uint64_t d, uint64_t s, unsigned char fg){ return s ; }
+};
+struct CopyXor{
+  static inline unsigned char apply(unsigned char d, unsigned char s, unsigned char fg){ return d ^ s ; }
+  static inline uint64_t applyWord(uint64_t d, uint64_t s, unsigned char fg){ return d ^ s ; }
+};
+// ~(~d | ~s) is the same as d AND s
+struct CopyInvertOr{
+  static inline unsigned char apply(unsigned char d, unsigned char s, unsigned char fg){ return d & s ; }
+  static inline uint64_t applyWord(uint64_t d, uint64_t s, unsigned char fg){ return d & s ; }
+};
+struct CopyMaxColourKey{
+  static inline unsigned char apply(unsigned char d, unsigned char s, unsigned char fg){ return (s == 255)?d:s ; }
+  static inline uint64_t applyWord(uint64_t d, uint64_t s, unsigned char fg){
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL ;
+    uint64_t t = ~s ; // bytes of s which are 255 become zero
+    uint64_t zero = ~(((t & low7) + low7) | t | low7) ; // top bit set in the zero bytes of t
+    uint64_t keep = (zero >> 7) * 0xFF ;
+    return (d & keep) | (s & ~keep) ;
   }
-    
-  // packed byte file should hold ceil(x/8) * y bytes rounded up to whole byte per row.
-  if (bitdepth == 1){
-    stride = width/8 + (width%8?1:0);
-    size = stride * height ;
-    if (size > XMB_LOAD_MAX_SIZE){
-      // File is very large, likely to be corrupt or not an image file
-      return false ;
+};
+struct CopyAlphaMask{
+  static inline unsigned char apply(unsigned char d, unsigned char s, unsigned char fg){ return ((s*d)/255) + (((255-s)*fg)/255) ; }
+  static inline uint64_t applyWord(uint64_t d, uint64_t s, unsigned char fg){
+    uint64_t r = 0 ;
+    for (unsigned int i=0; i < 64; i+=8){
+      r |= ((uint64_t)apply((d >> i) & 0xFF, (s >> i) & 0xFF, fg)) << i ;
     }
-  }else if(bitdepth == 32){
-    // RGBA
-    stride = 4 * width ;
-    size = stride * height ;
-  }else if(bitdepth == 16){
-    // RGB 565
-    stride = 2 * width ;
-    size = stride * height ;
-  }else if(bitdepth == 8){
-    // Greyscale
-    stride = width ;
-    size = stride * height ;
-  }else{
-    // Unsupported
-    return false ;
+    return r ;
   }
+};
+
+// Copy rows of a source image into the destination. Pointers are to the first
+// pixel of the first row to process. Rows are processed eight bytes at a time.
+template <class OP>
+static void copyKernel(unsigned char *dst, unsigned int dststride,
+		       const unsigned char *src, unsigned int srcstride,
+		       unsigned int rowbytes, unsigned int height, unsigned char fg)
+{
+  unsigned int i = 0 ;
+  uint64_t d = 0, v = 0 ;
+
+  for (unsigned int cy=0; cy < height; cy++){
+    for (i=0; i + 8 <= rowbytes; i += 8){
+      memcpy(&d, dst + i, 8) ;
+      memcpy(&v, src + i, 8) ;
+      d = OP::applyWord(d, v, fg) ;
+      memcpy(dst + i, &d, 8) ;
+    }
+    for (; i < rowbytes; i++){
+      dst[i] = OP::apply(dst[i], src[i], fg) ;
+    }
+    dst += dststride ;
+    src += srcstride ;
+  }
+}
 
-  m_colourbitdepth = bitdepth ;
+static void copyModeKernel(int mode, unsigned int bits, unsigned char *dst, unsigned int dststride,
+			   const unsigned char *src, unsigned int srcstride,
+			   unsigned int rowbytes, unsigned int height, unsigned char fg)
+{
+  if (mode == 1){ // XOR
+    copyKernel<CopyXor>(dst, dststride, src, srcstride, rowbytes, height, fg) ;
+  }else if(mode == 2){ // Invert OR
+    copyKernel<CopyInvertOr>(dst, dststride, src, srcstride, rowbytes, height, fg) ;
+  }else if(mode == 4){ // 'Max Colour' Transparency
+    copyKernel<CopyMaxColourKey>(dst, dststride, src, srcstride, rowbytes, height, fg) ;
+  }else if(mode == 8 && bits == 8){ // Alpha blend mask. Src is a mask of alpha values, fg colour is applied
+    copyKernel<CopyAlphaMask>(dst, dststride, src, srcstride, rowbytes, height, fg) ;
+  }else{ // Overwrite
+    for (unsigned int cy=0; cy < height; cy++){
+      memcpy(dst, src, rowbytes) ;
+      dst += dststride ;
+      src += srcstride ;
+    }
+  }
+}
 
-  if (!m_bResourceImage && m_img) delete[] m_img ; // remove old image and replace with this one.
-  m_bResourceImage = false ; // this is an image which can be removed from memory
-  
-  // Allocate memory
-  m_img = new unsigned char[size] ;
-  if (!m_img) return false ; // cannot allocate memory for image
+// Read and write up to 8 bytes of packed pixels as a little endian word so
+// bit x of a row is bit x of the word
+static inline uint64_t loadBits(const unsigned char *p, unsigned int bytes)
+{
+  uint64_t v = 0 ;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&v, p, bytes) ;
+#else
+  for (unsigned int i=0; i < bytes; i++) v |= ((uint64_t)p[i]) << (i*8) ;
+#endif
+  return v ;
+}
 
-  m_memsize = size ;
-  m_width = width ;
-  m_height = height ;
-  m_stride = stride ;
- 
-  return true ;
+static inline void storeBits(unsigned char *p, uint64_t v, unsigned int bytes)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(p, &v, bytes) ;
+#else
+  for (unsigned int i=0; i < bytes; i++) p[i] = v >> (i*8) ;
+#endif
 }
 
-bool DisplayImage::zeroImg()
+// Combine nbits bits of src starting at bit srcbit into dst starting at bit
+// dstbit using the copy mode OP. Bits are packed LSB first as in 1 bit images.
+// Rows are moved in 56 bit words, shifted into place and merged with a mask.
+template <class OP>
+static void blitBitsOp(unsigned char *dst, unsigned int dstbit, const unsigned char *src, unsigned int srcbit, unsigned int nbits)
 {
-  if (m_bResourceImage) return false ;
-  memset(m_img, 0, m_memsize) ;
-  return true ;
+  unsigned int dshift = dstbit % 8, sshift = srcbit % 8 ;
+  unsigned int n = 0, dbytes = 0 ;
+  uint64_t v = 0, mask = 0, d = 0 ;
+
+  dst += dstbit / 8 ;
+  src += srcbit / 8 ;
+
+  while (nbits > 0){
+    n = nbits > 56?56:nbits ;
+    mask = ((((uint64_t)1) << n) - 1) << dshift ;
+    dbytes = (n + dshift + 7) / 8 ;
+
+    v = (loadBits(src, (n + sshift + 7) / 8) >> sshift) << dshift ;
+    d = loadBits(dst, dbytes) ;
+    d = (d & ~mask) | (OP::applyWord(d, v, 0) & mask) ;
+    storeBits(dst, d, dbytes) ;
+
+    nbits -= n ;
+    src += n / 8 ;
+    dst += n / 8 ;
+  }
 }
 
-bool DisplayImage::eraseBackground()
+// Copy nbits bits from src starting at bit srcbit to dst starting at bit
+// dstbit, with a plain byte copy when both fall on a byte boundary.
+static void blitBits(unsigned char *dst, unsigned int dstbit, const unsigned char *src, unsigned int srcbit, unsigned int nbits)
 {
-  unsigned int pixel = 0 ;
-  unsigned short n16bit = 0 ;
+  unsigned int bytes = 0 ;
 
-  if (m_colourbitdepth == 1){
-    return zeroImg() ;
+  if (dstbit % 8 || srcbit % 8){
+    blitBitsOp<CopyOverwrite>(dst, dstbit, src, srcbit, nbits) ;
+    return ;
   }
 
-  for (unsigned int cy=0; cy < m_height; cy++){
-    for (unsigned int cx=0; cx < m_width; cx++){
-      if (m_colourbitdepth == 32){
-	pixel = (cx*4)+(cy*m_stride) ;
-	m_img[pixel] = m_bg_r ;
-	m_img[pixel+1] = m_bg_g ;
-	m_img[pixel+2] = m_bg_b ;
-	m_img[pixel+3] = m_bg_a ;
-      }else if(m_colourbitdepth == 16){
-	pixel = (cx*2)+(cy*m_stride) ;
-	n16bit = to565(m_bg_r, m_bg_g, m_bg_b) ;
-	m_img[pixel] = n16bit >> 8;
-	m_img[pixel+1] = n16bit & 0x00FF ;
-      }else if(m_colourbitdepth == 8){
-	pixel = cx + (cy*m_stride) ;
-	m_img[pixel] = m_bg_grey ;
-      }else{
-	return false ; // Not supported
-      }
-    }
+  // Byte aligned, only the last byte needs masking
+  dst += dstbit / 8 ;
+  src += srcbit / 8 ;
+  bytes = nbits / 8 ;
+  memcpy(dst, src, bytes) ;
+  if (nbits % 8){
+    unsigned char m = 0xFF >> (8 - (nbits % 8)) ;
+    dst[bytes] = (dst[bytes] & ~m) | (src[bytes] & m) ;
   }
-  return true ;
 }
-bool DisplayImage::copy_rotate90_right(const DisplayImage &img)
-{
-  // Create an identical image, but rotated
-  if (!createImage(img.m_height, img.m_width, img.m_colourbitdepth))
-    return false ;
- 
-  unsigned char *p = m_img ;
 
-  for (unsigned int cx=0; cx < img.m_width; cx++){
-    for (unsigned int cy= img.m_height; cy > 0; cy--){
-      *p++ = img.m_img[(cx*(img.m_colourbitdepth/8))+((cy-1)*img.m_stride)];
-    }
+// Copy rows of a 1 bit image. Modes other than XOR and invert OR overwrite.
+static void copyBitsModeKernel(int mode, unsigned char *dst, unsigned int dststride, unsigned int dstbit,
+			       const unsigned char *src, unsigned int srcstride, unsigned int srcbit,
+			       unsigned int width, unsigned int height)
+{
+  for (unsigned int cy=0; cy < height; cy++){
+    if (mode == 1) blitBitsOp<CopyXor>(dst, dstbit, src, srcbit, width) ;
+    else if (mode == 2) blitBitsOp<CopyInvertOr>(dst, dstbit, src, srcbit, width) ;
+    else blitBits(dst, dstbit, src, srcbit, width) ;
+    dst += dststride ;
+    src += srcstride ;
   }
+}
+
+// Overlap of a source image placed on a destination
+typedef struct{
+  unsigned int srcx, srcy ; // first source pixel
+  unsigned int dstx, dsty ; // first destination pixel
+  unsigned int width, height ;
+} BlitArea ;
 
+// Intersect src placed with its top left at offx,offy with the clip of dst
+// once. Returns false if they do not overlap.
+static bool clipBlit(const DisplayImage &d, const DisplayImage &s, int offx, int offy, BlitArea *area)
+{
+  DisplayRect c ;
+  int64_t x0 = offx, y0 = offy ;
+  int64_t x1 = (int64_t)offx + s.get_width() - 1, y1 = (int64_t)offy + s.get_height() - 1 ;
+
+  if (!d.getClip(&c)) return false ;
+  if (x0 < c.x0) x0 = c.x0 ;
+  if (y0 < c.y0) y0 = c.y0 ;
+  if (x1 > c.x1) x1 = c.x1 ;
+  if (y1 > c.y1) y1 = c.y1 ;
+  if (x0 > x1 || y0 > y1) return false ;
+
+  area->dstx = x0 ;
+  area->dsty = y0 ;
+  area->srcx = x0 - offx ;
+  area->srcy = y0 - offy ;
+  area->width = x1 - x0 + 1 ;
+  area->height = y1 - y0 + 1 ;
   return true ;
 }
 
-bool DisplayImage::copy(const DisplayImage &img, int mode, unsigned int offx, unsigned int offy)
+bool DisplayImage::copy(const DisplayImage &img, int mode, int offx, int offy)
 {
-  unsigned int despixel = 0;
-  unsigned int srcpixel = 0 ;
-
-  // Colour bit depths should match. I could implement 8 to 32 and 32 to 8 conversion
-  // but this code grows quickly to include 16bit colour and other colour depths. 
-  // The rule needs to be that the bit depths match and any future need to mismatch images will require
-  // an image conversion routine to change bit depth.
-  if (img.m_colourbitdepth != m_colourbitdepth) return false ;
+  unsigned int bytes = 0 ;
+  BlitArea area ;
+
+  if (img.m_colourbitdepth != m_colourbitdepth){
+    // Convert the source to this colour depth using this image's colours
+    DisplayImage converted ;
+    converted.setFGCol(m_fg_r, m_fg_g, m_fg_b, m_fg_a) ;
+    converted.setBGCol(m_bg_r, m_bg_g, m_bg_b, m_bg_a) ;
+    converted.setFGGrey(m_fg_grey) ;
+    converted.setBGGrey(m_bg_grey) ;
+    converted.setDither(m_dither) ;
+    if (!converted.convert(img, m_colourbitdepth)) return false ;
+    return copy(converted, mode, offx, offy) ;
+  }
   if (m_colourbitdepth != 32 && 
+      m_colourbitdepth != 24 && 
       m_colourbitdepth != 16 && 
-      m_colourbitdepth != 8){
-    return false ; // only 32/16/8 bit images supported at the moment
+      m_colourbitdepth != 8 &&
+      m_colourbitdepth != 1){
+    return false ; // only 32/24/16/8/1 bit images supported at the moment
   }
-
-  for (unsigned int cy=0; cy < m_height; cy++){
-    for (unsigned int cx=0; cx < m_width; cx++){
-      if ((cx - offx) >= 0 && (cx - offx) < img.m_width && (cy - offy) >= 0 && (cy - offy) < img.m_height){
-	// Within the drawable area for the parent image
-	despixel = (cx*(m_colourbitdepth/8))+(cy*m_stride) ;
-	srcpixel = ((cx-offx)*(m_colourbitdepth/8)) + ((cy-offy)*img.m_stride);
-
-	if (mode == 1){ // XOR
-	  for (unsigned int cbd=0; cbd < m_colourbitdepth/8;cbd++){
-	    m_img[despixel+cbd] ^= img.m_img[srcpixel+cbd] ;
-	  }
-	}else if(mode == 2){ // Invert OR
-	  for (unsigned int cbd=0; cbd < m_colourbitdepth/8;cbd++){
-	    m_img[despixel+cbd] = ~(~(m_img[despixel+cbd]) | ~(img.m_img[srcpixel+cbd])) ;
-	  }
-	}else if(mode == 4){ // 'Max Colour' Transparency
-	  for (unsigned int cbd=0; cbd < m_colourbitdepth/8;cbd++){
-	    m_img[despixel+cbd] = (img.m_img[srcpixel+cbd] == 255)?m_img[despixel+cbd]:img.m_img[srcpixel+cbd] ;
-	  }
-	}else if(mode == 8 && m_colourbitdepth == 8){ // Alpha blend mask. Src is a mask of alpha values, fg colour is applied
-	  for (unsigned int cbd=0; cbd < m_colourbitdepth/8;cbd++){
-	    m_img[despixel+cbd] = (((img.m_img[srcpixel+cbd])*m_img[despixel+cbd])/255) + (((255-img.m_img[srcpixel+cbd])*m_fg_grey)/255);
-	  }
-	}else{ // Overwrite
-	  for (unsigned int cbd=0; cbd < m_colourbitdepth/8;cbd++){
-	    m_img[despixel+cbd] = img.m_img[srcpixel+cbd] ;
-	  }
-	}
+  if (!m_img || !img.m_img) return false ;
+
+  if (!clipBlit(*this, img, offx, offy, &area)) return true ;
+  markDirty(area.dstx, area.dsty, area.dstx+area.width-1, area.dsty+area.height-1) ;
+  bytes = m_colourbitdepth/8 ;
+
+  if (&img == this){
+    // Copying within this image, such as to scroll. Rows are walked from the
+    // side the copy moves towards so no row is written before it is read. A
+    // row moving sideways is staged first as the kernels work in words.
+    std::vector<unsigned char> row(m_stride) ;
+    unsigned int cy = 0 ;
+    for (unsigned int i=0; i < area.height; i++){
+      cy = area.dsty > area.srcy ? area.height - 1 - i : i ;
+      unsigned char *dst = m_img + (area.dsty+cy)*m_stride ;
+      const unsigned char *src = m_img + (area.srcy+cy)*m_stride ;
+      if (area.dsty == area.srcy){
+	memcpy(&row[0], src, m_stride) ;
+	src = &row[0] ;
+      }
+      if (m_colourbitdepth == 1){
+	copyBitsModeKernel(mode, dst, m_stride, area.dstx, src, m_stride, area.srcx, area.width, 1) ;
+      }else{
+	copyModeKernel(mode, m_colourbitdepth, dst + area.dstx*bytes, m_stride,
+		       src + area.srcx*bytes, m_stride, area.width*bytes, 1, m_fg_grey) ;
       }
     }
+    return true ;
+  }
+
+  if (m_colourbitdepth == 1){
+    copyBitsModeKernel(mode, m_img + (area.dsty*m_stride), m_stride, area.dstx,
+		       img.m_img + (area.srcy*img.m_stride), img.m_stride, area.srcx, area.width, area.height) ;
+    return true ;
   }
+
+  copyModeKernel(mode, m_colourbitdepth,
+		 m_img + (area.dstx*bytes) + (area.dsty*m_stride), m_stride,
+		 img.m_img + (area.srcx*bytes) + (area.srcy*img.m_stride), img.m_stride,
+		 area.width*bytes, area.height, m_fg_grey) ;
   return true ;
 }
 
-inline bool DisplayImage::setPixel(unsigned int x, unsigned int y, bool bSet)
+bool DisplayImage::composite(const DisplayImage &img, unsigned int op, int offx, int offy, bool bPremultiplied)
 {
-  unsigned short n16bit = 0;
+  // Masks giving the source factor from the destination alpha and the
+  // destination factor from the source alpha, see simdCompositeRGBA
+  static const uint8_t factors[][4] = {
+    {0x00, 0x00, 0x00, 0x00}, // clear
+    {0x00, 0xFF, 0x00, 0x00}, // src
+    {0x00, 0x00, 0x00, 0xFF}, // dst
+    {0x00, 0xFF, 0xFF, 0xFF}, // src over
+    {0xFF, 0xFF, 0x00, 0xFF}, // dst over
+    {0xFF, 0x00, 0x00, 0x00}, // src in
+    {0x00, 0x00, 0xFF, 0x00}, // dst in
+    {0xFF, 0xFF, 0x00, 0x00}, // src out
+    {0x00, 0x00, 0xFF, 0xFF}, // dst out
+    {0xFF, 0x00, 0xFF, 0xFF}, // src atop
+    {0xFF, 0xFF, 0xFF, 0x00}, // dst atop
+    {0xFF, 0xFF, 0xFF, 0xFF}, // xor
+    {0x00, 0xFF, 0x00, 0xFF}  // plus
+  };
+  BlitArea area ;
+  unsigned char *dst = NULL ;
+  const unsigned char *src = NULL ;
+
+  if (m_colourbitdepth != 32 || img.m_colourbitdepth != 32) return false ;
+  if (op > DISPLAY_PD_PLUS || !m_img || !img.m_img) return false ;
+
+  if (!clipBlit(*this, img, offx, offy, &area)) return true ;
+  markDirty(area.dstx, area.dsty, area.dstx+area.width-1, area.dsty+area.height-1) ;
+
+  dst = m_img + (area.dstx*4) + (area.dsty*m_stride) ;
+  src = img.m_img + (area.srcx*4) + (area.srcy*img.m_stride) ;
+  for (unsigned int cy=0; cy < area.height; cy++){
+    simdCompositeRGBA(dst, src, area.width, factors[op], !bPremultiplied) ;
+    dst += m_stride ;
+    src += img.m_stride ;
+  }
+  return true ;
+}
 
-  if (m_colourbitdepth == 16){
-    if (bSet)
-      n16bit = to565(m_fg_r, m_fg_g, m_fg_b) ;
-    else
-      n16bit = to565(m_bg_r, m_bg_g, m_bg_b) ;
+bool DisplayImage::convert(const DisplayImage &img, unsigned int bitdepth)
+{
+  RowConverter converter ;
+  unsigned char fg[4], bg[4] ;
+  unsigned char *buffer = NULL ;
+  unsigned int stride = 0, size = 0 ;
+
+  if (!img.m_img) return false ;
+  stride = imageStride(img.m_width, bitdepth) ;
+  if (stride == 0) return false ; // Unsupported
+
+  getPixelPattern(true, fg, bitdepth) ;
+  getPixelPattern(false, bg, bitdepth) ;
+  if (!converter.begin(img.m_colourbitdepth, bitdepth, img.m_width, fg, bg, m_fg_grey, m_bg_grey, m_dither)) return false ;
+
+  // Convert into a new buffer so the source can be this image
+  size = stride * img.m_height ;
+  buffer = new unsigned char[size] ;
+  if (!buffer) return false ;
+  for (unsigned int y=0; y < img.m_height; y++){
+    converter.convert(img.m_img + (y*img.m_stride), buffer + (y*stride)) ;
   }
 
-  if (x >= m_width || y >= m_height) return false ; // out of image boundary
-  
-  if (bSet){
-    if (m_colourbitdepth == 32){
-      m_img[(x*4) + y*m_stride] = m_fg_r ;
-      m_img[(x*4) + y*m_stride+1] = m_fg_g ;
-      m_img[(x*4) + y*m_stride+2] = m_fg_b ;
-      m_img[(x*4) + y*m_stride+3] = m_fg_a ;
-    }else if (m_colourbitdepth == 16){
-      m_img[(x*2) + y*m_stride] = n16bit >> 8 ;
-      m_img[(x*2) + y*m_stride+1] = 0x00FF & n16bit ;
-    }else if (m_colourbitdepth == 8){
-      m_img[x + y*m_stride] = m_fg_grey ;
-    }else if (m_colourbitdepth == 1){
-      m_img[(x/8)+y*m_stride] |= 1 << (x%8) ;
-    }
-  }else{
-    if (m_colourbitdepth == 32){
-      m_img[(x*4) + y*m_stride] = m_bg_r ;
-      m_img[(x*4) + y*m_stride+1] = m_bg_g ;
-      m_img[(x*4) + y*m_stride+2] = m_bg_b ;
-      m_img[(x*4) + y*m_stride+3] = m_bg_a ;
-    }else if (m_colourbitdepth == 16){
-      m_img[(x*2) + y*m_stride] = n16bit >> 8 ;
-      m_img[(x*2) + y*m_stride+1] = 0x00FF & n16bit ;
-    }else if (m_colourbitdepth == 8){
-      m_img[x + y*m_stride] = m_bg_grey ;
-    }else if (m_colourbitdepth == 1){
-      m_img[(x/8)+y*m_stride] &= ~(1 << (x%8)) ;
-    }
+  releaseImg() ;
+  m_img = buffer ;
+  m_memsize = size ;
+  m_width = img.m_width ;
+  m_height = img.m_height ;
+  m_stride = stride ;
+  m_colourbitdepth = bitdepth ;
+
+  m_nDirty = 0 ;
+  markDirty(0, 0, m_width-1, m_height-1) ;
+  return true ;
+}
+
+bool DisplayImage::setPixel(unsigned int x, unsigned int y, bool bSet)
+{
+  if (!plotPixel(x, y, bSet)) return false ;
+  markDirty(x, y, x, y) ;
+  return true ;
+}
+
+bool DisplayImage::plotPixel(unsigned int x, unsigned int y, bool bSet)
+{
+  unsigned char pattern[4] ;
+  unsigned char *row = NULL ;
+
+  DisplayRect c ;
+
+  if (!getClip(&c)) return false ;
+  if ((int)x < c.x0 || (int)y < c.y0 || (int)x > c.x1 || (int)y > c.y1) return false ; // outside of the clip
+
+  getPixelPattern(bSet, pattern) ;
+  row = m_img + (y*m_stride) ;
+
+  switch(m_colourbitdepth){
+  case 32:
+    PixelFormat32::put(row, x, pattern) ;
+    break ;
+  case 24:
+    PixelFormat24::put(row, x, pattern) ;
+    break ;
+  case 16:
+    PixelFormat16::put(row, x, pattern) ;
+    break ;
+  case 8:
+    PixelFormat8::put(row, x, pattern) ;
+    break ;
+  case 1:
+    PixelFormat1::put(row, x, pattern) ;
+    break ;
   }
   return true ;
 }
@@ -679,6 +3074,8 @@ void DisplayImage::printImg()
 DisplayFont::DisplayFont()
 {
   m_pBuffer = NULL ;
+  m_pMap = NULL ;
+  m_nMapSize = 0 ;
   m_nFontWidth = 0 ;
   m_nFontHeight = 0;
   m_nTotalChars = 0;
@@ -686,7 +3083,16 @@ DisplayFont::DisplayFont()
 
 DisplayFont::~DisplayFont()
 {
-  if (m_pBuffer) delete[] m_pBuffer ;
+  releaseBuffer() ;
+}
+
+void DisplayFont::releaseBuffer()
+{
+  if (m_pMap) munmap(m_pMap, m_nMapSize) ;
+  else if (m_pBuffer) delete[] m_pBuffer ;
+  m_pBuffer = NULL ;
+  m_pMap = NULL ;
+  m_nMapSize = 0 ;
 }
 
 bool DisplayFont::loadFile(int f)
@@ -698,53 +3104,73 @@ bool DisplayFont::loadFile(int f)
   uint32_t height = 0 ;
   uint32_t chars = 0;
   unsigned char *buffer = NULL ;
-  char szSig[4] ;
-
-  // Not great as it assumes little endian packing (or depends on hardware big/little endian configuration)
+  unsigned char head[DISPLAYFORMAT_HEADER_SIZE] ;
+  DisplayFormatHeader hdr ;
+  void *map = NULL ;
+  size_t mapsize = 0 ;
+
+  if (!readAll(f, head, 4)) return false ;
+
+  if (displayFormatIsHeader(head)){
+    if (!readAll(f, head + 4, DISPLAYFORMAT_HEADER_SIZE - 4)) return false ;
+    if (!displayFormatReadHeader(head, &hdr) || hdr.type != DISPLAYFORMAT_FONT || hdr.bitdepth != 1 ||
+	!assetLayoutValid(hdr)){
+      fprintf(stderr, "Cannot open the font file, unsupported format\n") ;
+      return false ;
+    }
+    if (!(buffer = loadAssetData(f, hdr, &map, &mapsize))) return false ;
+    width = hdr.width ;
+    height = hdr.height ;
+    chars = hdr.chars ;
+  }else{
+    // Files from older versions of psf2bin. Not great as it assumes little
+    // endian packing (or depends on hardware big/little endian configuration)
 
-  // Read and check sig
-  if (read(f, szSig, 3) != 3) return false ;
-  szSig[3] = '\0' ; // terminate string
-  if (strcmp(szSig, "FNT") != 0){
-    fprintf(stderr, "Cannot open the font file, invalid signature\n") ;
-    return false ; // not a font file
-  }
+    // Check sig
+    if (memcmp(head, "FNT", 3) != 0){
+      fprintf(stderr, "Cannot open the font file, invalid signature\n") ;
+      return false ; // not a font file
+    }
   
-  // Read the number of supported characters in file
-  if (read(f, &chars, sizeof(uint32_t)) != sizeof(uint32_t)){
-    return false ;
-  }
+    // Read the number of supported characters in file. The first byte
+    // followed the signature.
+    ((unsigned char*)&chars)[0] = head[3] ;
+    if (!readAll(f, ((unsigned char*)&chars) + 1, sizeof(uint32_t) - 1)){
+      return false ;
+    }
 
-  // Read the width and then height of each font
-  if (read(f, &width, sizeof(uint32_t)) != sizeof(uint32_t)){
-    return false ;
-  }
-  if (read(f, &height, sizeof(uint32_t)) != sizeof(uint32_t)){
-    return false ;
-  }
+    // Read the width and then height of each font
+    if (!readAll(f, &width, sizeof(uint32_t))){
+      return false ;
+    }
+    if (!readAll(f, &height, sizeof(uint32_t))){
+      return false ;
+    }
 
-  // packed byte file should hold ceil(x/8) * y bytes rounded up to whole byte per row.
-  size = (width/8 + (width%8?1:0)) * height ;
-  size *= chars ; // multiply by the number of characters in the file
-  if (size > XMB_LOAD_MAX_SIZE){
-    // File is very large, likely to be corrupt or not an image file
-    return false ;
-  }
+    // packed byte file should hold ceil(x/8) * y bytes rounded up to whole byte per row.
+    size = (width/8 + (width%8?1:0)) * height ;
+    size *= chars ; // multiply by the number of characters in the file
+    if (size > XMB_LOAD_MAX_SIZE){
+      // File is very large, likely to be corrupt or not an image file
+      return false ;
+    }
 
-  // Allocate memory
-  buffer = new unsigned char[size] ;
-  if (!buffer) return false ; // cannot allocate memory for image
+    // Allocate memory
+    buffer = new unsigned char[size] ;
+    if (!buffer) return false ; // cannot allocate memory for image
 
-  // casting to signed shouldn't be a problem as we have a configured file limit under 2 GB
-  // and large image files are just wrong for OLEDs
-  if (read(f, buffer, size) != (signed)size){
-    return false ; // couldn't read all of the image
+    if (!readAll(f, buffer, size)){
+      delete[] buffer ;
+      return false ; // couldn't read all of the image
+    }
   }
 
-  if (!m_pBuffer) delete[] m_pBuffer ; // remove old image and replace with this one.
+  releaseBuffer() ; // remove old image and replace with this one.
 
   // Write all attributes of the font to object
   m_pBuffer = buffer ;
+  m_pMap = map ;
+  m_nMapSize = mapsize ;
   m_nFontWidth = width ;
   m_nFontHeight = height ;
   m_nTotalChars = chars ;
@@ -755,11 +3181,13 @@ DisplayImage *DisplayFont::createText(char *szTxt, DisplayImage *cimg)
 {
   unsigned char letter = '*' ;
   uint32_t writetocol = 0 ; // update to point at start of new letter
-  uint32_t readbyte = 0, writebyte = 0 ;
+  uint32_t writerow = 0, nbits = 0 ;
   uint32_t fontstride = 0 ;
+  const unsigned char *glyph = NULL ;
   int nLen = strlen(szTxt) ;
   int nLines = 1, onLine = 0, onCharCol = 0 ;
   if (nLen == 0) return NULL ; // No string to show
+  if (cimg && cimg->m_colourbitdepth != 1) return NULL ; // Only 1 bit images can be reused
 
   DisplayImage *img = NULL ;
   
@@ -798,23 +3226,80 @@ DisplayImage *DisplayFont::createText(char *szTxt, DisplayImage *cimg)
 
     // determine starting column in output text. Increment to next char after call 
     writetocol = m_nFontWidth * onCharCol++ ;
-    
+    if (writetocol >= img->m_width) continue ; // off the right of the image
+
+    // Clip the glyph to the image width
+    nbits = img->m_width - writetocol ;
+    if (nbits > m_nFontWidth) nbits = m_nFontWidth ;
+
+    glyph = m_pBuffer + (fontstride * letter * m_nFontHeight) ;
     for (uint32_t cy=0; cy < m_nFontHeight; cy++){
-      for (uint32_t cx=0; cx < m_nFontWidth;cx++){
-	writebyte = (cx+writetocol)/8 + (cy * img->m_stride) + (img->m_stride * onLine * m_nFontHeight) ;
-
-	if (writebyte >= img->m_memsize) return img ; // no more memory to write to. Stop processing
-	
-	readbyte = cx/8 + (cy * fontstride) + (fontstride * letter * m_nFontHeight) ;
-	if ((m_pBuffer[readbyte] & (1 << (cx%8))) > 0){
-	  img->m_img[writebyte] |= 1 << ((cx+writetocol)%8) ; // set image bit to on
+      writerow = cy + (onLine * m_nFontHeight) ;
+      if (writerow >= img->m_height) return img ; // no more memory to write to. Stop processing
+
+      blitBits(img->m_img + (writerow * img->m_stride), writetocol, glyph + (cy * fontstride), 0, nbits) ;
+    }
+  }
+  
+  return img ;
+}
+
+bool DisplayFont::drawText(DisplayImage &img, int x, int y, const char *szTxt, bool bTransparent)
+{
+  uint32_t fontstride = m_nFontWidth/8 +(m_nFontWidth%8?1:0) ;
+  unsigned char letter = '*' ;
+  const unsigned char *glyph = NULL, *row = NULL ;
+  int cx = x, cy = y, maxx = x, rowy = 0, bx0 = 0, bx1 = 0 ;
+  uint32_t start = 0, end = 0 ;
+  bool bOn = false ;
+  DisplayRect c ;
+
+  if (!m_pBuffer || !img.m_img || !szTxt) return false ;
+  if (!img.getClip(&c)) return true ; // nothing can be drawn
+
+  for (const char *p = szTxt; *p != '\0'; p++){
+    letter = *p ;
+
+    if (letter == '\n'){
+      cx = x ; // carriage return
+      cy += m_nFontHeight ;
+      continue ;
+    }
+    if (letter >= m_nTotalChars) letter = 0 ; // Cannot exceed number of letters in font image
+
+    // Skip glyphs wholly outside of the clip
+    if (cx <= c.x1 && cx + (int)m_nFontWidth > c.x0 &&
+	cy <= c.y1 && cy + (int)m_nFontHeight > c.y0){
+      glyph = m_pBuffer + (fontstride * letter * m_nFontHeight) ;
+      for (uint32_t gy=0; gy < m_nFontHeight; gy++){
+	rowy = cy + gy ;
+	if (rowy < c.y0 || rowy > c.y1) continue ;
+	row = glyph + (gy * fontstride) ;
+
+	if (img.m_colourbitdepth == 1 && !bTransparent){
+	  // Packed glyph rows match the image layout
+	  bx0 = cx < c.x0?c.x0:cx ;
+	  bx1 = cx + (int)m_nFontWidth - 1 > c.x1?c.x1:cx + (int)m_nFontWidth - 1 ;
+	  blitBits(img.m_img + (rowy * img.m_stride), bx0, row, bx0 - cx, bx1 - bx0 + 1) ;
+	  continue ;
 	}
-	else{
-	  img->m_img[writebyte] &= ~(1 << ((cx+writetocol)%8)) ; // set image bit to off
+
+	// Split the row into runs of set and clear pixels and fill each run
+	start = 0 ;
+	while (start < m_nFontWidth){
+	  bOn = (row[start/8] & (1 << (start%8))) != 0 ;
+	  end = start + 1 ;
+	  while (end < m_nFontWidth && ((row[end/8] & (1 << (end%8))) != 0) == bOn) end++ ;
+	  if (bOn || !bTransparent) img.fillSpan(cx + start, cx + end - 1, rowy, bOn) ;
+	  start = end ;
 	}
       }
     }
+    cx += m_nFontWidth ;
+    if (cx > maxx) maxx = cx ;
   }
-  
-  return img ;
+
+  // Nothing is marked when no glyph was placed, such as for only new lines
+  if (maxx > x) img.markDirty(x, y, maxx - 1, cy + m_nFontHeight - 1) ;
+  return true ;
 }
@@ -12,14 +12,79 @@ class PCF8833LCD ; // Philips Colour LCD Display
 #endif
 
 class DisplayFont ; 
+struct jpeg_decompress_struct ;
+class Display565Encoder ;
 
 // Generous 10MB image limit for single image files
 #define XMB_LOAD_MAX_SIZE 10485760
 
+// Number of separate damaged areas tracked by an image before they are merged
+#define DISPLAY_MAX_DIRTY_RECTS 8
+
+// Porter-Duff operators for DisplayImage::composite
+#define DISPLAY_PD_CLEAR 0
+#define DISPLAY_PD_SRC 1
+#define DISPLAY_PD_DST 2
+#define DISPLAY_PD_OVER 3
+#define DISPLAY_PD_DST_OVER 4
+#define DISPLAY_PD_IN 5
+#define DISPLAY_PD_DST_IN 6
+#define DISPLAY_PD_OUT 7
+#define DISPLAY_PD_DST_OUT 8
+#define DISPLAY_PD_ATOP 9
+#define DISPLAY_PD_DST_ATOP 10
+#define DISPLAY_PD_XOR 11
+#define DISPLAY_PD_PLUS 12
+
+// Orientations for DisplayImage::transform. Rotations are clockwise.
+#define DISPLAY_ROTATE_0 0
+#define DISPLAY_ROTATE_90 1
+#define DISPLAY_ROTATE_180 2
+#define DISPLAY_ROTATE_270 3
+#define DISPLAY_FLIP_H 4
+#define DISPLAY_FLIP_V 5
+
+// Filters for DisplayImage::scale
+#define DISPLAY_SCALE_NEAREST 0
+#define DISPLAY_SCALE_BILINEAR 1
+#define DISPLAY_SCALE_BOX 2
+
+// Dithering used when reducing colours, see DisplayImage::setDither
+#define DISPLAY_DITHER_NONE 0
+#define DISPLAY_DITHER_ORDERED 1
+#define DISPLAY_DITHER_DIFFUSION 2
+
+// Rectangle of pixels with inclusive corners x0,y0 and x1,y1
+typedef struct{
+  int x0, y0, x1, y1 ;
+} DisplayRect ;
+
+// Channels of DisplayStats
+#define DISPLAY_STATS_RED 0
+#define DISPLAY_STATS_GREEN 1
+#define DISPLAY_STATS_BLUE 2
+#define DISPLAY_STATS_LUMA 3
+
+// Histograms and summary of an image, see DisplayImage::getStatistics.
+// Arrays are indexed by the DISPLAY_STATS_ channels. Grey images have the
+// same counts in every channel and 16 bit pixels are counted after
+// expanding to 8 bits per channel. Luma is the grey level used by convert.
+typedef struct{
+  unsigned int histogram[4][256] ;
+  unsigned int pixels ;
+  unsigned char min[4], max[4] ;
+  float mean[4] ;
+} DisplayStats ;
+
+// Vertex of a polygon, see DisplayImage::drawPolygon
+typedef struct{
+  int x, y ;
+} DisplayPoint ;
+
 class DisplayImage{
 public:
   DisplayImage() ;
-  DisplayImage(const DisplayImage &img){ *this = img; };
+  DisplayImage(const DisplayImage &img){ init(); *this = img; };
   ~DisplayImage();
 #ifdef DISPLAY_SDD1306OLED
   friend class SDD1306OLED ;
@@ -28,6 +93,9 @@ public:
   friend class PCF8833LCD ;
 #endif
   friend class DisplayFont ;
+  friend class Display565Encoder ;
+  friend class DisplayList ;
+  friend class DisplaySwapChain ;
 
   // Copy image
   DisplayImage& operator=(const DisplayImage &img) ;
@@ -46,16 +114,50 @@ public:
   // Returns false if the line cannot be drawn at all, but this is more for information than an error.
   bool drawLine(int x0, int y0, int x1, int y1) ;
 
+  // Draw circles and ellipses centred on xc,yc. Set bFill to fill them.
+  // Returns false if nothing could be drawn.
+  bool drawCircle(int xc, int yc, unsigned int r, bool bFill=false) ;
+  bool drawEllipse(int xc, int yc, unsigned int rx, unsigned int ry, bool bFill=false) ;
+
+  // Draw part of an ellipse outline from angle start to end in degrees.
+  // 0 is 3 o'clock and angles increase clockwise.
+  bool drawArc(int xc, int yc, unsigned int rx, unsigned int ry, int start, int end) ;
+
+  // Draw a rectangle as drawRect with corners rounded to radius
+  bool drawRoundRect(int x0, int y0, int width, int height, unsigned int radius, bool bFill=false) ;
+
+  // Draw the outline of a polygon through n points, closing back to the
+  // first. Filled polygons cover the pixels whose centres are inside by
+  // the even-odd rule.
+  bool drawPolygon(const DisplayPoint *points, unsigned int n, bool bFill=false) ;
+
+  // Anti-aliased outlines which blend the FG colour into the image. 8, 16,
+  // 24 and 32 bit images only, 1 bit images are drawn as above.
+  bool drawLineAA(int x0, int y0, int x1, int y1) ;
+  bool drawCircleAA(int xc, int yc, unsigned int r) ;
+  bool drawEllipseAA(int xc, int yc, unsigned int rx, unsigned int ry) ;
+
   // Load from existing header file. Used when XBM resource is built into the
   // executable binary
   bool loadXBM(unsigned int w, unsigned int h, unsigned char *bits) ;
 
   // Load a 24 bit jpeg into the image object (becomes 32bit with alpha for 32)
-  // Supports greyscale when bits is 8.
-  bool loadJPG(const char *szFilename, unsigned int bits = 32) ;
+  // Supports greyscale when bits is 8, and 1 bit through the FG and BG grey
+  // using the dithering set by setDither.
+  // Set width and/or height to load at a smaller size. The decoder scales by
+  // 1/2, 1/4 or 1/8 while decoding and the rest is scaled to the exact size
+  // as rows are read. Leave one as 0 to keep the aspect ratio.
+  // Regular files are memory mapped and decoded in place.
+  bool loadJPG(const char *szFilename, unsigned int bits = 32, unsigned int width = 0, unsigned int height = 0) ;
+
+  // Load a jpeg held in memory, such as an asset bundle or mapped file. The
+  // data is read in place and only needs to stay valid during the call.
+  bool loadJPG(const uint8_t *data, size_t len, unsigned int bits = 32, unsigned int width = 0, unsigned int height = 0) ;
   
   // Load a custom binary representation from file.
-  // Use XBM2Bin utility to create
+  // Use XBM2Bin utility to create. Files in the current format are mapped
+  // and used in place, older files are read into memory. Compressed files
+  // are expanded into the image as they are read.
   bool loadFile(int f) ;
 
   // Set all bits to zero, clearing the image values
@@ -77,12 +179,22 @@ public:
   // This is only for 32 bit image formats.
   bool setColourPixel(unsigned int x, unsigned int y, unsigned char r, unsigned char g, unsigned char b) ;
 
-  // Create distribution. Returns false if no image or colour depth unsupported
-  // This is for colour RGB images. Returns false for 1bit images.
-  bool createDistribution() ;
+  // Create distribution of the whole image, kept for the get functions
+  // below. Storage is allocated on first use. threads splits the counting
+  // across that many threads. Returns false if no image or for 1 bit images.
+  bool createDistribution(unsigned int threads = 1) ;
+
+  // Statistics of the pixels within roi, or the whole image if roi is NULL,
+  // written to stats. The image distribution is left alone so this suits
+  // metering a part of each camera frame for auto exposure. Returns false if
+  // no image, 1 bit images or roi has no pixels on the image.
+  bool getStatistics(DisplayStats *stats, const DisplayRect *roi = NULL, unsigned int threads = 1) const ;
+
+  // Statistics from the last createDistribution, or NULL if never created
+  const DisplayStats *getDistribution() const {return m_pStats;};
 
   // Get number of red pixels at the value set by intensity contained in the image
-  // intensity is 0-255
+  // intensity is 0-255. Returns 0 if no distribution has been created.
   unsigned int getRedDistribution(uint8_t intensity) ;
 
   // Get number of green pixels at the value set by intensity contained in the image
@@ -93,30 +205,114 @@ public:
   // intensity is 0-255
   unsigned int getBlueDistribution(uint8_t intensity) ;
 
+  // Get number of pixels with luminance grey of intensity
+  unsigned int getLumaDistribution(uint8_t intensity) ;
+
   // Utility function. Coverts 8bit colour to 4bit.
   static uint8_t to4bit(uint8_t byte) ;
 
   // Create 16 bit colour image. Not used internally so image
   // will retain 32 bits. Buffer must be delete[] after use.
+  // outbuff must hold width*height values, or twice that with bRle.
+  // Use Display565Encoder to convert into smaller buffers.
   uint16_t* out565(uint16_t *outbuff=NULL, bool bRle=false);
 
-  // Copy the image to this objects image. Can be offset by offx and offy
-  bool copy(const DisplayImage &img, int mode=0, unsigned int offx=0, unsigned int offy=0) ;
-
-  // Copy and rotate the image by 90 degrees clockwise.
-  // This will replace any previous images and reallocate to hold
-  // the rotated image.
+  // Pack a 1 bit image into the page layout of SSD1306 style panels. Each
+  // byte holds 8 rows of one column with the top row in bit 0, bytes of a
+  // page run left to right and pages run top to bottom. Rows past the
+  // bottom of the image are 0. Only the columns and pages of window are
+  // packed when set, such as a 1 bit DisplaySwapChain window. Buffer must be
+  // delete[] after use when outbuff is NULL, otherwise outbuff holds columns
+  // times pages bytes. Returns NULL if the image is not 1 bit or window is
+  // outside of it.
+  unsigned char* outPages(unsigned char *outbuff=NULL, const DisplayRect *window=NULL) ;
+
+  // Copy the image to this objects image with its top left at offx,offy.
+  // Offsets can be negative and the source is clipped to this image.
+  // mode 0 overwrites, 1 is XOR, 2 is invert OR, 4 keeps this image where the
+  // source is 255 and 8 blends the FG grey through an 8 bit alpha mask.
+  // 1 bit images support modes 0 to 2. A source of another colour depth is
+  // converted with convert first. img can be this image to scroll it.
+  bool copy(const DisplayImage &img, int mode=0, int offx=0, int offy=0) ;
+
+  // Composite a 32 bit RGBA image onto this 32 bit image with its top left at
+  // offx,offy using one of the DISPLAY_PD_ operators. Offsets can be negative
+  // and the source is clipped to this image. Set bPremultiplied when the
+  // colour in both images is already multiplied by alpha, otherwise straight
+  // alpha is converted for the operation and back. Uses the vector kernels
+  // in displaysimd. Returns false for other colour depths or operators.
+  bool composite(const DisplayImage &img, unsigned int op = DISPLAY_PD_OVER, int offx=0, int offy=0, bool bPremultiplied=false) ;
+
+  // Replace this image with img converted to a bitdepth of 32, 24, 16, 8 or 1.
+  // 1 bit pixels become the FG and BG colours of this image, or the FG and
+  // BG grey for 8 bits. Colour becomes luminance grey (see toGrey) and grey
+  // becomes 1 bit by whichever of the FG and BG grey is nearer. Converted
+  // colour is opaque. img can be this image.
+  bool convert(const DisplayImage &img, unsigned int bitdepth) ;
+
+  // Convert this image in place, see above
+  bool convert(unsigned int bitdepth){return convert(*this, bitdepth);};
+
+  // Copy img rotated or flipped by one of the DISPLAY_ROTATE_ or DISPLAY_FLIP_
+  // orientations into this image, for any colour depth. If this image already
+  // has the resulting size and colour depth its buffer is written in place, so
+  // a frame can be rotated for the panel on every update without allocating.
+  // Otherwise the image is reallocated. img can be this image.
+  bool transform(const DisplayImage &img, unsigned int orientation) ;
+
+  // Resample img to fill this image, which must already be created at the
+  // target size with the same colour depth. Supports 32, 24, 16 and 8 bit
+  // images with one of the DISPLAY_SCALE_ filters. Box averages the source
+  // area under each pixel, which suits shrinking to thumbnails. Channels,
+  // including alpha, are filtered separately in fixed point. Set threads to
+  // split large images into bands of rows scaled in parallel. img cannot be
+  // this image.
+  bool scale(const DisplayImage &img, unsigned int filter = DISPLAY_SCALE_BILINEAR, unsigned int threads = 1) ;
+
+  // Copy and rotate the image by 90 degrees clockwise, see transform
   bool copy_rotate90_right(const DisplayImage &img) ;
 
   void setBGGrey(unsigned char grey){m_bg_grey = grey;};
 
   void setFGGrey(unsigned char grey){m_fg_grey = grey;};
 
+  // Dither with one of the DISPLAY_DITHER_ modes when reducing colour to 1 bit
+  // or RGB 565 in convert, loadJPG, out565 and Display565Encoder. Ordered
+  // dithering uses an 8x8 Bayer matrix. Diffusion is integer Floyd-Steinberg
+  // which keeps two rows of error so it runs as rows are decoded.
+  void setDither(unsigned int dither){m_dither = dither;};
+
   void setBGCol(unsigned char red, unsigned char green, unsigned char blue, unsigned char alpha){m_bg_r = red;m_bg_g = green; m_bg_b=blue;m_bg_a = alpha;};
 
   void setFGCol(unsigned char red, unsigned char green, unsigned char blue, unsigned char alpha){m_fg_r = red;m_fg_g = green; m_fg_b=blue;m_fg_a = alpha;};
-  unsigned int get_width(){return m_width;};
-  unsigned int get_height(){return m_height;};
+  unsigned int get_width() const{return m_width;};
+  unsigned int get_height() const{return m_height;};
+
+  // Damaged areas of the image since the last clearDirty. Every call which
+  // changes the image adds the area it touched. Overlapping areas are merged
+  // and no more than DISPLAY_MAX_DIRTY_RECTS are held, so drivers can send
+  // only the windows which changed.
+  unsigned int getDirtyCount(){return m_nDirty;};
+
+  // Read damaged area at index. Returns false if index is out of range
+  bool getDirtyRect(unsigned int index, DisplayRect *rect) ;
+
+  // Forget all damaged areas. Call once the display has been updated
+  void clearDirty(){m_nDirty = 0;};
+
+  // Add an area to the damaged list. The corners are inclusive and clipped to
+  // the image and clip. Use when writing to the image outside of the class methods.
+  void markDirty(int x0, int y0, int x1, int y1) ;
+
+  // Restrict drawing to clip, or the whole image when NULL. Draw, fill,
+  // copy, composite and text calls leave pixels outside of it alone, so
+  // part of a scene can be redrawn. zeroImg and whole image operations such
+  // as loading, convert and transform ignore it.
+  void setClip(const DisplayRect *clip) ;
+
+  // Area drawing is limited to, the clip within the image. Returns false if
+  // nothing can be drawn.
+  bool getClip(DisplayRect *clip) const ;
 
 protected:
   // Draw vertical lines. Used internally, but not needed for users as
@@ -127,21 +323,158 @@ protected:
   // Not required for direct user access but used by other draw methods
   bool drawH(int x0, int x1, int y);
 
+  // Fill pixels x0 to x1 (inclusive) along row y using the FG colour when bSet
+  // is true, otherwise the BG colour. The run is clipped once and then written
+  // as whole bytes or words. Returns false if nothing could be drawn.
+  bool fillSpan(int x0, int x1, int y, bool bSet);
+
+  // Fill the rectangle with corners x0,y0 and x1,y1 (inclusive) using spans.
+  // Returns false if nothing could be drawn.
+  bool fillRect(int x0, int y0, int x1, int y1, bool bSet);
+
+  // Draw a box of corners cx0,cy0 and cx1,cy1 grown by rx and ry with the
+  // corners rounded as quarters of an ellipse. Used for ellipses and rounded
+  // rectangles.
+  bool drawRoundBox(int cx0, int cy0, int cx1, int cy1, unsigned int rx, unsigned int ry, bool bFill) ;
+
+  // Blend pattern, the FG pixel, into x,y by alpha 0 to 255. Returns false
+  // if outside the image or alpha is 0.
+  bool blendPixel(int x, int y, unsigned int alpha, const unsigned char *pattern) ;
+
+  // Write the FG (bSet true) or BG colour for one pixel into pattern as it
+  // would be stored in m_img. Pattern must hold at least 4 bytes.
+  void getPixelPattern(bool bSet, unsigned char *pattern);
+
+  // As above for an image of another bitdepth
+  void getPixelPattern(bool bSet, unsigned char *pattern, unsigned int bitdepth) const ;
+
+  // Decode from a jpeg source which has been created and set up by a loadJPG
+  // call. The decompressor is always destroyed before returning.
+  bool decodeJPG(struct jpeg_decompress_struct *pinfo, unsigned int bits, unsigned int width, unsigned int height, const char *szName) ;
+
+  // Write a single pixel without tracking damage. Used by draw methods
+  // which mark their whole area once.
+  bool plotPixel(unsigned int x, unsigned int y, bool bSet) ;
+
+  // Set members to an empty image
+  void init() ;
+
+  // Free or unmap the image buffer
+  void releaseImg() ;
+
   bool allocateImg(unsigned int height, unsigned int width, unsigned int bitdepth) ;
   unsigned char *m_img ;
+  void *m_pMap ; // mapping holding m_img when loaded from an asset file
+  size_t m_nMapSize ;
   unsigned int m_memsize ;
   unsigned int m_width ;
   unsigned int m_height ;
   unsigned int m_stride ;
   bool m_bResourceImage ;
   unsigned int m_colourbitdepth ;
-  unsigned int m_red_distribution[256] ;
-  unsigned int m_green_distribution[256] ;
-  unsigned int m_blue_distribution[256] ;
+  DisplayStats *m_pStats ; // allocated by createDistribution
   
   unsigned char m_fg_r, m_fg_g, m_fg_b, m_fg_a;
   unsigned char m_bg_r, m_bg_g, m_bg_b, m_bg_a;
   unsigned char m_fg_grey, m_bg_grey ;
+  unsigned int m_dither ;
+
+  DisplayRect m_dirty[DISPLAY_MAX_DIRTY_RECTS] ;
+  unsigned int m_nDirty ;
+
+  DisplayRect m_clip ;
+  bool m_bClip ; // drawing limited to m_clip
+};
+
+// Converts rows from one colour depth to another, see DisplayImage::convert.
+// Lookup tables and scratch rows are set up once by begin so whole images
+// and decoded JPEG scanlines convert a row at a time.
+class RowConverter{
+public:
+  RowConverter() ;
+  ~RowConverter() ;
+
+  // Rows of width pixels convert from srcbits to dstbits. fg and bg are the
+  // pixel patterns 1 bit sources expand to, as stored at dstbits. dither is
+  // one of the DISPLAY_DITHER_ modes for 1 and 16 bit targets. Returns false
+  // if either depth is unsupported.
+  bool begin(unsigned int srcbits, unsigned int dstbits, unsigned int width,
+	     const unsigned char *fg, const unsigned char *bg,
+	     unsigned char fg_grey, unsigned char bg_grey,
+	     unsigned int dither = DISPLAY_DITHER_NONE) ;
+
+  // Convert the next row, top to bottom. src and dst must not overlap.
+  void convert(const unsigned char *src, unsigned char *dst) ;
+
+protected:
+  // Dither a grey row between the FG and BG grey into bits
+  void ditherBits(const unsigned char *grey, unsigned char *dst) ;
+
+  // Free the scratch rows
+  void release() ;
+
+  unsigned int m_srcbits, m_dstbits ;
+  unsigned int m_width ;
+  unsigned char m_fg[4], m_bg[4] ;
+  uint64_t m_expand[256] ; // 8 grey pixels for each byte of bits
+  unsigned char m_threshold[256] ; // bit value for each grey
+  unsigned char *m_pGrey ; // grey scratch row
+  uint16_t *m_p565 ; // 565 scratch row
+  unsigned int m_dither ;
+  unsigned int m_nRow ; // rows converted so far
+  int16_t *m_pErrCur, *m_pErrNext ; // diffused error for this row and the next
+  int m_lo, m_hi ; // grey levels of 1 bit targets
+  bool m_bHiIsFG ;
+private:
+  // Not copyable, the scratch rows belong to one converter
+  RowConverter(const RowConverter &) ;
+  RowConverter &operator=(const RowConverter &) ;
+};
+
+// Incremental RGB 565 conversion of a DisplayImage into caller buffers of any
+// size. Each call to encode fills the buffer and remembers where it stopped so
+// a frame can be sent through a small DMA buffer, converting the next chunk
+// while the last one is transferred. The image must not change until the
+// frame is complete.
+class Display565Encoder{
+public:
+  Display565Encoder() ;
+  ~Display565Encoder() ;
+
+  // Start a new frame from img. RLE output is written as count and colour
+  // pairs, identical to DisplayImage::out565. Returns false if the image
+  // colour depth cannot be converted.
+  bool begin(const DisplayImage &img, bool bRle=false) ;
+
+  // Convert the next part of the frame into buff which holds bytes bytes.
+  // Returns the number of bytes written, which is 0 once the frame is done.
+  // RLE pairs are never split so buffers need at least 4 bytes, or 2 without
+  // RLE. A smaller buffer returns (size_t)-1 as nothing can be written.
+  size_t encode(uint16_t *buff, size_t bytes) ;
+
+  // True once all of the frame has been written
+  bool isComplete(){return m_bComplete;};
+
+protected:
+  // Convert up to n pixels from m_nPixel into dst. Dithered frames are
+  // converted a row at a time so no more than the rest of the row is
+  // returned. Returns the number of pixels converted.
+  unsigned int fetch(uint16_t *dst, unsigned int n) ;
+
+  const DisplayImage *m_pImg ;
+  RowConverter m_converter ; // dithers rows when the image asks for it
+  unsigned char *m_pRow ; // dithered row
+  unsigned int m_nRow ; // image row held in m_pRow
+  bool m_bDither ;
+  unsigned int m_nPixel ; // next pixel to convert
+  bool m_bRle ;
+  bool m_bComplete ;
+  uint16_t m_last ; // colour of the pending RLE run
+  uint16_t m_count ; // length of the pending RLE run
+private:
+  // Not copyable, the dithered row belongs to one encoder
+  Display565Encoder(const Display565Encoder &) ;
+  Display565Encoder &operator=(const Display565Encoder &) ;
 };
 
 class DisplayFont{
@@ -150,19 +483,37 @@ public:
   ~DisplayFont();
 
   // Load font from file. Use utility
-  // to convert PSF compressed files to a binary format to load
+  // to convert PSF compressed files to a binary format to load.
+  // Files in the current format are mapped and used in place.
   bool loadFile(int f) ;
 
   // Create a buffer with a text string to display
   // This returns an DisplayImage which can be written to the display
   // The returned image will need to be deleted by the caller
+  // A reused cimg must be a 1 bit image. Text outside of it is clipped.
   DisplayImage *createText(char *szTxt, DisplayImage *cimg = NULL) ;
 
+  // Draw text straight into an existing 1, 8, 16, 24 or 32 bit image with the
+  // top left of the first character at x,y. Set glyph pixels use the image FG
+  // colour and the rest use the BG colour unless bTransparent is set.
+  // Text is clipped to the image and a new line starts again from x.
+  // Returns false if the font or image is not loaded.
+  bool drawText(DisplayImage &img, int x, int y, const char *szTxt, bool bTransparent = false) ;
+
+  // Size of each character in pixels
+  unsigned int get_width() const{return m_nFontWidth;};
+  unsigned int get_height() const{return m_nFontHeight;};
+
 protected:
+  // Free or unmap the font image
+  void releaseBuffer() ;
+
   uint32_t m_nFontWidth ;
   uint32_t m_nFontHeight ;
   uint32_t m_nTotalChars ;
   unsigned char *m_pBuffer ;
+  void *m_pMap ; // mapping holding m_pBuffer when loaded from an asset file
+  size_t m_nMapSize ;
 };
 
 
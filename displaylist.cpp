@@ -0,0 +1,558 @@
+#include "displaylist.hpp"
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+// Pixels along each side of the tiles a threaded replay is split into. A 32
+// bit tile is 16KB so stays in cache, and tiles of 1 bit images start on a
+// byte.
+#define DISPLAYLIST_TILE 64
+
+// Rectangle from two corners in any order, limited to the range of int
+static DisplayRect boundsOf(int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+{
+  DisplayRect r ;
+
+  if (x0 > x1){int64_t t = x0; x0 = x1; x1 = t;}
+  if (y0 > y1){int64_t t = y0; y0 = y1; y1 = t;}
+  r.x0 = x0 < INT32_MIN?INT32_MIN:x0 ;
+  r.y0 = y0 < INT32_MIN?INT32_MIN:y0 ;
+  r.x1 = x1 > INT32_MAX?INT32_MAX:x1 ;
+  r.y1 = y1 > INT32_MAX?INT32_MAX:y1 ;
+  return r ;
+}
+
+// Overlap of a and b in out. Returns false if they do not overlap.
+static bool intersect(const DisplayRect &a, const DisplayRect &b, DisplayRect *out)
+{
+  out->x0 = a.x0 > b.x0?a.x0:b.x0 ;
+  out->y0 = a.y0 > b.y0?a.y0:b.y0 ;
+  out->x1 = a.x1 < b.x1?a.x1:b.x1 ;
+  out->y1 = a.y1 < b.y1?a.y1:b.y1 ;
+  return out->x0 <= out->x1 && out->y0 <= out->y1 ;
+}
+
+static bool contains(const DisplayRect &outer, const DisplayRect &inner)
+{
+  return inner.x0 >= outer.x0 && inner.x1 <= outer.x1 &&
+    inner.y0 >= outer.y0 && inner.y1 <= outer.y1 ;
+}
+
+// Add r to areas less any parts already in them, so no pixel is in two areas
+static void addArea(std::vector<DisplayRect> &areas, const DisplayRect &r)
+{
+  std::vector<DisplayRect> pieces(1, r), left ;
+  DisplayRect o, p ;
+
+  for (size_t i=0; i < areas.size() && !pieces.empty(); i++){
+    left.clear() ;
+    for (size_t j=0; j < pieces.size(); j++){
+      p = pieces[j] ;
+      if (!intersect(p, areas[i], &o)){
+	left.push_back(p) ;
+	continue ;
+      }
+      // Up to four strips around the overlap
+      if (p.y0 < o.y0){DisplayRect s = {p.x0, p.y0, p.x1, o.y0 - 1}; left.push_back(s);}
+      if (p.y1 > o.y1){DisplayRect s = {p.x0, o.y1 + 1, p.x1, p.y1}; left.push_back(s);}
+      if (p.x0 < o.x0){DisplayRect s = {p.x0, o.y0, o.x0 - 1, o.y1}; left.push_back(s);}
+      if (p.x1 > o.x1){DisplayRect s = {o.x1 + 1, o.y0, p.x1, o.y1}; left.push_back(s);}
+    }
+    pieces.swap(left) ;
+  }
+  areas.insert(areas.end(), pieces.begin(), pieces.end()) ;
+}
+
+DisplayList::DisplayList()
+{
+  // Same defaults as DisplayImage
+  m_fg[0] = m_fg[1] = m_fg[2] = m_fg[3] = 0 ;
+  m_bg[0] = m_bg[1] = m_bg[2] = m_bg[3] = 255 ;
+  m_fg_grey = 0 ;
+  m_bg_grey = 255 ;
+  m_nReplayed = 0 ;
+}
+
+void DisplayList::clear()
+{
+  m_commands.clear() ;
+}
+
+void DisplayList::setFGCol(unsigned char red, unsigned char green, unsigned char blue, unsigned char alpha)
+{
+  m_fg[0] = red ;
+  m_fg[1] = green ;
+  m_fg[2] = blue ;
+  m_fg[3] = alpha ;
+}
+
+void DisplayList::setBGCol(unsigned char red, unsigned char green, unsigned char blue, unsigned char alpha)
+{
+  m_bg[0] = red ;
+  m_bg[1] = green ;
+  m_bg[2] = blue ;
+  m_bg[3] = alpha ;
+}
+
+DisplayList::Command &DisplayList::begin(unsigned int type)
+{
+  m_commands.push_back(Command()) ;
+  Command &cmd = m_commands.back() ;
+
+  cmd.type = type ;
+  cmd.bOpaque = false ;
+  cmd.bFlag = false ;
+  memset(cmd.p, 0, sizeof(cmd.p)) ;
+  memcpy(cmd.fg, m_fg, 4) ;
+  memcpy(cmd.bg, m_bg, 4) ;
+  cmd.fg_grey = m_fg_grey ;
+  cmd.bg_grey = m_bg_grey ;
+  cmd.img = NULL ;
+  cmd.font = NULL ;
+  return cmd ;
+}
+
+unsigned int DisplayList::eraseBackground()
+{
+  Command &cmd = begin(DISPLAYLIST_ERASE) ;
+  cmd.bounds = boundsOf(INT32_MIN, INT32_MIN, INT32_MAX, INT32_MAX) ;
+  cmd.cover = cmd.bounds ;
+  cmd.bOpaque = true ;
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawRect(int x0, int y0, int width, int height, bool bFill)
+{
+  Command &cmd = begin(DISPLAYLIST_RECT) ;
+  cmd.p[0] = x0 ;
+  cmd.p[1] = y0 ;
+  cmd.p[2] = width ;
+  cmd.p[3] = height ;
+  cmd.bFlag = bFill ;
+  cmd.bounds = boundsOf(x0, y0, (int64_t)x0 + width, (int64_t)y0 + height) ;
+  if (bFill && height > 0){
+    // The fill stops a row short of the bottom edge
+    cmd.cover = boundsOf(x0, y0, (int64_t)x0 + width, (int64_t)y0 + height - 1) ;
+    cmd.bOpaque = true ;
+  }
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawLine(int x0, int y0, int x1, int y1)
+{
+  Command &cmd = begin(DISPLAYLIST_LINE) ;
+  cmd.p[0] = x0 ;
+  cmd.p[1] = y0 ;
+  cmd.p[2] = x1 ;
+  cmd.p[3] = y1 ;
+  cmd.bounds = boundsOf(x0, y0, x1, y1) ;
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawCircle(int xc, int yc, unsigned int r, bool bFill)
+{
+  return drawEllipse(xc, yc, r, r, bFill) ;
+}
+
+unsigned int DisplayList::drawEllipse(int xc, int yc, unsigned int rx, unsigned int ry, bool bFill)
+{
+  Command &cmd = begin(DISPLAYLIST_ELLIPSE) ;
+  cmd.p[0] = xc ;
+  cmd.p[1] = yc ;
+  cmd.p[2] = rx ;
+  cmd.p[3] = ry ;
+  cmd.bFlag = bFill ;
+  cmd.bounds = boundsOf((int64_t)xc - rx, (int64_t)yc - ry, (int64_t)xc + rx, (int64_t)yc + ry) ;
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawArc(int xc, int yc, unsigned int rx, unsigned int ry, int start, int end)
+{
+  Command &cmd = begin(DISPLAYLIST_ARC) ;
+  cmd.p[0] = xc ;
+  cmd.p[1] = yc ;
+  cmd.p[2] = rx ;
+  cmd.p[3] = ry ;
+  cmd.p[4] = start ;
+  cmd.p[5] = end ;
+  cmd.bounds = boundsOf((int64_t)xc - rx, (int64_t)yc - ry, (int64_t)xc + rx, (int64_t)yc + ry) ;
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawRoundRect(int x0, int y0, int width, int height, unsigned int radius, bool bFill)
+{
+  Command &cmd = begin(DISPLAYLIST_ROUNDRECT) ;
+  cmd.p[0] = x0 ;
+  cmd.p[1] = y0 ;
+  cmd.p[2] = width ;
+  cmd.p[3] = height ;
+  cmd.p[4] = radius ;
+  cmd.bFlag = bFill ;
+  cmd.bounds = boundsOf(x0, y0, (int64_t)x0 + width, (int64_t)y0 + height) ;
+  if (bFill){
+    // Rows between the corners are filled edge to edge
+    int64_t r = radius, w = width < 0?-(int64_t)width:width, h = height < 0?-(int64_t)height:height ;
+    if (r > w/2) r = w/2 ;
+    if (r > h/2) r = h/2 ;
+    cmd.cover = cmd.bounds ;
+    cmd.cover.y0 += r ;
+    cmd.cover.y1 -= r ;
+    cmd.bOpaque = cmd.cover.y0 <= cmd.cover.y1 ;
+  }
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawPolygon(const DisplayPoint *points, unsigned int n, bool bFill)
+{
+  Command &cmd = begin(DISPLAYLIST_POLYGON) ;
+  cmd.bFlag = bFill ;
+  if (points && n > 0){
+    cmd.points.assign(points, points + n) ;
+    cmd.bounds = boundsOf(points[0].x, points[0].y, points[0].x, points[0].y) ;
+    for (unsigned int i=1; i < n; i++){
+      if (points[i].x < cmd.bounds.x0) cmd.bounds.x0 = points[i].x ;
+      if (points[i].x > cmd.bounds.x1) cmd.bounds.x1 = points[i].x ;
+      if (points[i].y < cmd.bounds.y0) cmd.bounds.y0 = points[i].y ;
+      if (points[i].y > cmd.bounds.y1) cmd.bounds.y1 = points[i].y ;
+    }
+  }else{
+    // Empty, never drawn
+    cmd.bounds.x0 = cmd.bounds.y0 = 1 ;
+    cmd.bounds.x1 = cmd.bounds.y1 = 0 ;
+  }
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawLineAA(int x0, int y0, int x1, int y1)
+{
+  Command &cmd = begin(DISPLAYLIST_LINE_AA) ;
+  cmd.p[0] = x0 ;
+  cmd.p[1] = y0 ;
+  cmd.p[2] = x1 ;
+  cmd.p[3] = y1 ;
+  cmd.bounds = boundsOf(x0, y0, x1, y1) ;
+  // Blended neighbours fall a pixel beyond the line
+  cmd.bounds = boundsOf((int64_t)cmd.bounds.x0 - 1, (int64_t)cmd.bounds.y0 - 1,
+			(int64_t)cmd.bounds.x1 + 1, (int64_t)cmd.bounds.y1 + 1) ;
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawCircleAA(int xc, int yc, unsigned int r)
+{
+  return drawEllipseAA(xc, yc, r, r) ;
+}
+
+unsigned int DisplayList::drawEllipseAA(int xc, int yc, unsigned int rx, unsigned int ry)
+{
+  Command &cmd = begin(DISPLAYLIST_ELLIPSE_AA) ;
+  cmd.p[0] = xc ;
+  cmd.p[1] = yc ;
+  cmd.p[2] = rx ;
+  cmd.p[3] = ry ;
+  cmd.bounds = boundsOf((int64_t)xc - rx - 1, (int64_t)yc - ry - 1, (int64_t)xc + rx + 1, (int64_t)yc + ry + 1) ;
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::copy(const DisplayImage &img, int mode, int offx, int offy)
+{
+  Command &cmd = begin(DISPLAYLIST_COPY) ;
+  cmd.img = &img ;
+  cmd.p[0] = mode ;
+  cmd.p[1] = offx ;
+  cmd.p[2] = offy ;
+  cmd.bounds = boundsOf(offx, offy, (int64_t)offx + img.get_width() - 1, (int64_t)offy + img.get_height() - 1) ;
+  if (mode == 0 && img.get_width() > 0 && img.get_height() > 0){
+    cmd.cover = cmd.bounds ;
+    cmd.bOpaque = true ;
+  }
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::composite(const DisplayImage &img, unsigned int op, int offx, int offy, bool bPremultiplied)
+{
+  Command &cmd = begin(DISPLAYLIST_COMPOSITE) ;
+  cmd.img = &img ;
+  cmd.p[0] = op ;
+  cmd.p[1] = offx ;
+  cmd.p[2] = offy ;
+  cmd.bFlag = bPremultiplied ;
+  cmd.bounds = boundsOf(offx, offy, (int64_t)offx + img.get_width() - 1, (int64_t)offy + img.get_height() - 1) ;
+  if ((op == DISPLAY_PD_SRC || op == DISPLAY_PD_CLEAR) && img.get_width() > 0 && img.get_height() > 0){
+    // Destination is ignored, but only 32 bit images can be composited so
+    // schedule checks the depths before using it as a cover
+    cmd.cover = cmd.bounds ;
+    cmd.bOpaque = true ;
+  }
+  return m_commands.size() - 1 ;
+}
+
+unsigned int DisplayList::drawText(DisplayFont &font, int x, int y, const char *szTxt, bool bTransparent)
+{
+  Command &cmd = begin(DISPLAYLIST_TEXT) ;
+  int64_t lines = 1, longest = 0, len = 0 ;
+
+  cmd.font = &font ;
+  cmd.p[0] = x ;
+  cmd.p[1] = y ;
+  cmd.bFlag = bTransparent ;
+  if (szTxt) cmd.text = szTxt ;
+
+  for (size_t i=0; i < cmd.text.size(); i++){
+    if (cmd.text[i] == '\n'){
+      lines++ ;
+      len = 0 ;
+    }else if (++len > longest){
+      longest = len ;
+    }
+  }
+  cmd.bounds = boundsOf(x, y, x + (longest * font.get_width()) - 1, y + (lines * font.get_height()) - 1) ;
+  if (longest == 0){
+    // Empty, never drawn
+    cmd.bounds.x0 = cmd.bounds.y0 = 1 ;
+    cmd.bounds.x1 = cmd.bounds.y1 = 0 ;
+  }
+  if (!bTransparent && lines == 1 && longest > 0){
+    cmd.cover = cmd.bounds ;
+    cmd.bOpaque = true ;
+  }
+  return m_commands.size() - 1 ;
+}
+
+bool DisplayList::getBounds(unsigned int index, DisplayRect *rect) const
+{
+  if (index >= m_commands.size() || !rect) return false ;
+  *rect = m_commands[index].bounds ;
+  return true ;
+}
+
+bool DisplayList::isCover(const Command &cmd, const DisplayImage &target) const
+{
+  if (!cmd.bOpaque) return false ;
+  // Composite draws nothing unless both images are 32 bit
+  if (cmd.type == DISPLAYLIST_COMPOSITE) return target.m_colourbitdepth == 32 && cmd.img->m_colourbitdepth == 32 ;
+  return true ;
+}
+
+void DisplayList::schedule(const DisplayImage &target, const DisplayRect &area, const std::vector<unsigned int> *candidates, std::vector<unsigned int> &order) const
+{
+  std::vector<unsigned int> visible ;
+  std::vector<DisplayRect> covers, drawn ;
+  std::vector<std::vector<unsigned int> > batches ;
+  std::vector<unsigned int> types, batchOf ;
+  DisplayRect r ;
+  bool bCovered = false ;
+
+  // Walk back from the last command so the opaque areas painted later are
+  // known when deciding if a command can be seen
+  for (size_t c=candidates?candidates->size():m_commands.size(); c-- > 0; ){
+    unsigned int i = candidates?(*candidates)[c]:c ;
+    const Command &cmd = m_commands[i] ;
+    if (!intersect(cmd.bounds, area, &r)) continue ;
+    bCovered = false ;
+    for (size_t j=0; j < covers.size() && !bCovered; j++) bCovered = contains(covers[j], r) ;
+    if (bCovered) continue ;
+    visible.push_back(i) ;
+    drawn.push_back(r) ;
+    if (isCover(cmd, target) && intersect(cmd.cover, area, &r)) covers.push_back(r) ;
+  }
+
+  // Place each command in the first batch of its kind after every batch
+  // holding an earlier command it overlaps. Commands which do not overlap
+  // touch different pixels so can run in any order.
+  batchOf.resize(visible.size()) ;
+  for (size_t k=visible.size(); k-- > 0; ){
+    unsigned int type = m_commands[visible[k]].type, first = 0 ;
+    for (size_t j=visible.size()-1; j > k; j--){
+      if (batchOf[j] + 1 > first && intersect(drawn[j], drawn[k], &r)) first = batchOf[j] + 1 ;
+    }
+    while (first < types.size() && types[first] != type) first++ ;
+    if (first == types.size()){
+      types.push_back(type) ;
+      batches.push_back(std::vector<unsigned int>()) ;
+    }
+    batches[first].push_back(visible[k]) ;
+    batchOf[k] = first ;
+  }
+
+  order.clear() ;
+  for (size_t b=0; b < batches.size(); b++) order.insert(order.end(), batches[b].begin(), batches[b].end()) ;
+}
+
+void DisplayList::run(DisplayImage &target, const Command &cmd) const
+{
+  target.setFGCol(cmd.fg[0], cmd.fg[1], cmd.fg[2], cmd.fg[3]) ;
+  target.setBGCol(cmd.bg[0], cmd.bg[1], cmd.bg[2], cmd.bg[3]) ;
+  target.setFGGrey(cmd.fg_grey) ;
+  target.setBGGrey(cmd.bg_grey) ;
+
+  switch(cmd.type){
+  case DISPLAYLIST_ERASE:
+    target.eraseBackground() ;
+    break ;
+  case DISPLAYLIST_RECT:
+    target.drawRect(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3], cmd.bFlag) ;
+    break ;
+  case DISPLAYLIST_LINE:
+    target.drawLine(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3]) ;
+    break ;
+  case DISPLAYLIST_ELLIPSE:
+    target.drawEllipse(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3], cmd.bFlag) ;
+    break ;
+  case DISPLAYLIST_ARC:
+    target.drawArc(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3], cmd.p[4], cmd.p[5]) ;
+    break ;
+  case DISPLAYLIST_ROUNDRECT:
+    target.drawRoundRect(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3], cmd.p[4], cmd.bFlag) ;
+    break ;
+  case DISPLAYLIST_POLYGON:
+    if (!cmd.points.empty()) target.drawPolygon(&cmd.points[0], cmd.points.size(), cmd.bFlag) ;
+    break ;
+  case DISPLAYLIST_LINE_AA:
+    target.drawLineAA(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3]) ;
+    break ;
+  case DISPLAYLIST_ELLIPSE_AA:
+    target.drawEllipseAA(cmd.p[0], cmd.p[1], cmd.p[2], cmd.p[3]) ;
+    break ;
+  case DISPLAYLIST_COPY:
+    target.copy(*cmd.img, cmd.p[0], cmd.p[1], cmd.p[2]) ;
+    break ;
+  case DISPLAYLIST_COMPOSITE:
+    target.composite(*cmd.img, cmd.p[0], cmd.p[1], cmd.p[2], cmd.bFlag) ;
+    break ;
+  case DISPLAYLIST_TEXT:
+    cmd.font->drawText(target, cmd.p[0], cmd.p[1], cmd.text.c_str(), cmd.bFlag) ;
+    break ;
+  }
+}
+
+void DisplayList::replayTiles(DisplayImage &target, const std::vector<DisplayRect> &areas, unsigned int threads)
+{
+  // Pieces of the areas in one grid cell are drawn by one thread, as
+  // pieces of a 1 bit cell can share bytes
+  struct Tile{
+    std::vector<DisplayRect> areas ;
+    unsigned int bin ; // cell of the tile grid holding the areas
+  };
+  unsigned int cols = (target.m_width + DISPLAYLIST_TILE - 1) / DISPLAYLIST_TILE ;
+  unsigned int rows = (target.m_height + DISPLAYLIST_TILE - 1) / DISPLAYLIST_TILE ;
+  std::vector<std::vector<unsigned int> > bins(cols * rows) ;
+  std::vector<Tile> tiles ;
+  std::vector<int> cellTile(cols * rows, -1) ; // index in tiles of each cell
+  std::vector<std::thread> workers ;
+  std::atomic<unsigned int> next(0), replayed(0) ;
+  DisplayRect whole = {0, 0, (int)target.m_width - 1, (int)target.m_height - 1}, r ;
+
+  // Bin the commands by the grid cells they touch
+  for (unsigned int i=0; i < m_commands.size(); i++){
+    if (!intersect(m_commands[i].bounds, whole, &r)) continue ;
+    for (int y=r.y0/DISPLAYLIST_TILE; y <= r.y1/DISPLAYLIST_TILE; y++){
+      for (int x=r.x0/DISPLAYLIST_TILE; x <= r.x1/DISPLAYLIST_TILE; x++) bins[y*cols + x].push_back(i) ;
+    }
+  }
+
+  // Split the areas on the grid
+  for (size_t a=0; a < areas.size(); a++){
+    for (int y=areas[a].y0/DISPLAYLIST_TILE; y <= areas[a].y1/DISPLAYLIST_TILE; y++){
+      for (int x=areas[a].x0/DISPLAYLIST_TILE; x <= areas[a].x1/DISPLAYLIST_TILE; x++){
+	DisplayRect cell = {x*DISPLAYLIST_TILE, y*DISPLAYLIST_TILE,
+			    (x+1)*DISPLAYLIST_TILE - 1, (y+1)*DISPLAYLIST_TILE - 1} ;
+	if (!intersect(cell, areas[a], &r) || bins[y*cols + x].empty()) continue ;
+	if (cellTile[y*cols + x] < 0){
+	  cellTile[y*cols + x] = tiles.size() ;
+	  tiles.push_back(Tile()) ;
+	  tiles.back().bin = y*cols + x ;
+	}
+	tiles[cellTile[y*cols + x]].areas.push_back(r) ;
+      }
+    }
+  }
+  if (threads > tiles.size()) threads = tiles.size() ;
+  if (threads < 1) return ;
+
+  // Each thread draws through its own view of the target buffer so the clip
+  // and colours are not shared
+  std::vector<DisplayImage> views(threads) ;
+  for (unsigned int i=0; i < threads; i++){
+    DisplayImage &v = views[i] ;
+    v.m_img = target.m_img ;
+    v.m_bResourceImage = true ; // not owned by the view
+    v.m_memsize = target.m_memsize ;
+    v.m_width = target.m_width ;
+    v.m_height = target.m_height ;
+    v.m_stride = target.m_stride ;
+    v.m_colourbitdepth = target.m_colourbitdepth ;
+    v.m_dither = target.m_dither ;
+  }
+
+  // Threads take the next waiting tile until none are left
+  auto work = [this, &target, &tiles, &bins, &next, &replayed](DisplayImage *view){
+    std::vector<unsigned int> order ;
+    unsigned int i = 0 ;
+    while ((i = next++) < tiles.size()){
+      for (size_t a=0; a < tiles[i].areas.size(); a++){
+	view->setClip(&tiles[i].areas[a]) ;
+	schedule(target, tiles[i].areas[a], &bins[tiles[i].bin], order) ;
+	for (size_t j=0; j < order.size(); j++) run(*view, m_commands[order[j]]) ;
+	replayed += order.size() ;
+      }
+    }
+  };
+  for (unsigned int i=1; i < threads; i++) workers.push_back(std::thread(work, &views[i])) ;
+  work(&views[0]) ;
+  for (size_t i=0; i < workers.size(); i++) workers[i].join() ;
+  m_nReplayed = replayed ;
+
+  for (unsigned int i=0; i < threads; i++){
+    for (unsigned int j=0; j < views[i].getDirtyCount(); j++){
+      if (views[i].getDirtyRect(j, &r)) target.markDirty(r.x0, r.y0, r.x1, r.y1) ;
+    }
+  }
+}
+
+bool DisplayList::replay(DisplayImage &target, const DisplayRect *damage, unsigned int n, unsigned int threads)
+{
+  std::vector<DisplayRect> areas ;
+  std::vector<unsigned int> order ;
+  DisplayRect base, r ;
+
+  m_nReplayed = 0 ;
+  if (!target.m_img) return false ;
+  if (!target.getClip(&base)) return true ; // nothing can be drawn
+
+  if (!damage){
+    areas.push_back(base) ;
+  }else{
+    for (unsigned int i=0; i < n; i++){
+      r = boundsOf(damage[i].x0, damage[i].y0, damage[i].x1, damage[i].y1) ;
+      if (intersect(r, base, &r)) addArea(areas, r) ;
+    }
+  }
+
+  if (threads > 1){
+    replayTiles(target, areas, threads) ;
+    return true ;
+  }
+
+  // Keep the caller's clip and colours
+  DisplayRect clip = target.m_clip ;
+  bool bClip = target.m_bClip ;
+  unsigned char fg[4] = {target.m_fg_r, target.m_fg_g, target.m_fg_b, target.m_fg_a} ;
+  unsigned char bg[4] = {target.m_bg_r, target.m_bg_g, target.m_bg_b, target.m_bg_a} ;
+  unsigned char fg_grey = target.m_fg_grey, bg_grey = target.m_bg_grey ;
+
+  for (size_t a=0; a < areas.size(); a++){
+    target.setClip(&areas[a]) ;
+    schedule(target, areas[a], NULL, order) ;
+    for (size_t i=0; i < order.size(); i++) run(target, m_commands[order[i]]) ;
+    m_nReplayed += order.size() ;
+  }
+
+  target.m_clip = clip ;
+  target.m_bClip = bClip ;
+  target.setFGCol(fg[0], fg[1], fg[2], fg[3]) ;
+  target.setBGCol(bg[0], bg[1], bg[2], bg[3]) ;
+  target.setFGGrey(fg_grey) ;
+  target.setBGGrey(bg_grey) ;
+  return true ;
+}
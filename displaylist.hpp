@@ -0,0 +1,127 @@
+#ifndef __DISPLAYLIST_HPP
+#define __DISPLAYLIST_HPP
+
+#include "displayimage.hpp"
+#include <string>
+#include <vector>
+
+// Kinds of recorded command, used to batch replays
+#define DISPLAYLIST_ERASE 0
+#define DISPLAYLIST_RECT 1
+#define DISPLAYLIST_LINE 2
+#define DISPLAYLIST_ELLIPSE 3
+#define DISPLAYLIST_ARC 4
+#define DISPLAYLIST_ROUNDRECT 5
+#define DISPLAYLIST_POLYGON 6
+#define DISPLAYLIST_LINE_AA 7
+#define DISPLAYLIST_ELLIPSE_AA 8
+#define DISPLAYLIST_COPY 9
+#define DISPLAYLIST_COMPOSITE 10
+#define DISPLAYLIST_TEXT 11
+#define DISPLAYLIST_TYPES 12
+
+// Records draw calls so a scene can be replayed onto a DisplayImage as often
+// as needed. Each command keeps the colours set when it was recorded and a
+// bounding box, so on replay:
+// - commands outside the image or the damaged areas are skipped
+// - commands wholly painted over by a later opaque fill, erase or copy are
+//   skipped
+// - commands of one kind are run together when nothing between them
+//   overlaps, which gives the same pixels as running them in order
+// A mostly static scene is recorded once and replayed into the areas which
+// changed each frame.
+class DisplayList{
+public:
+  DisplayList() ;
+
+  // Forget all commands
+  void clear() ;
+
+  // Number of commands recorded
+  unsigned int size() const {return m_commands.size();};
+
+  // Colours used by commands recorded after the call, see the DisplayImage
+  // functions of the same name
+  void setFGCol(unsigned char red, unsigned char green, unsigned char blue, unsigned char alpha) ;
+  void setBGCol(unsigned char red, unsigned char green, unsigned char blue, unsigned char alpha) ;
+  void setFGGrey(unsigned char grey){m_fg_grey = grey;};
+  void setBGGrey(unsigned char grey){m_bg_grey = grey;};
+
+  // Record draw calls. Parameters are as the DisplayImage and DisplayFont
+  // functions of the same name. Polygon points and text are copied but
+  // images and fonts are not and must stay valid while the list is used.
+  // Each returns the index of the command.
+  unsigned int eraseBackground() ;
+  unsigned int drawRect(int x0, int y0, int width, int height, bool bFill=false) ;
+  unsigned int drawLine(int x0, int y0, int x1, int y1) ;
+  unsigned int drawCircle(int xc, int yc, unsigned int r, bool bFill=false) ;
+  unsigned int drawEllipse(int xc, int yc, unsigned int rx, unsigned int ry, bool bFill=false) ;
+  unsigned int drawArc(int xc, int yc, unsigned int rx, unsigned int ry, int start, int end) ;
+  unsigned int drawRoundRect(int x0, int y0, int width, int height, unsigned int radius, bool bFill=false) ;
+  unsigned int drawPolygon(const DisplayPoint *points, unsigned int n, bool bFill=false) ;
+  unsigned int drawLineAA(int x0, int y0, int x1, int y1) ;
+  unsigned int drawCircleAA(int xc, int yc, unsigned int r) ;
+  unsigned int drawEllipseAA(int xc, int yc, unsigned int rx, unsigned int ry) ;
+  unsigned int copy(const DisplayImage &img, int mode=0, int offx=0, int offy=0) ;
+  unsigned int composite(const DisplayImage &img, unsigned int op = DISPLAY_PD_OVER, int offx=0, int offy=0, bool bPremultiplied=false) ;
+  unsigned int drawText(DisplayFont &font, int x, int y, const char *szTxt, bool bTransparent = false) ;
+
+  // Area command index can draw in, for working out what to damage when a
+  // command changes. Returns false if index is out of range.
+  bool getBounds(unsigned int index, DisplayRect *rect) const ;
+
+  // Draw the list onto target within the n damaged areas, or all of it when
+  // damage is NULL. Overlapping areas are only drawn once. The clip and
+  // colours of target are restored afterwards. Returns false if target has
+  // no image.
+  // With more than one thread the areas are split on a grid of tiles and
+  // the commands touching each tile are drawn into it by whichever thread is
+  // free. Tiles do not share pixels, or bytes of 1 bit images, so the
+  // result is identical to drawing on one thread. Images and fonts used by
+  // the list must not change during the replay.
+  bool replay(DisplayImage &target, const DisplayRect *damage = NULL, unsigned int n = 0, unsigned int threads = 1) ;
+
+  // Commands run by the last replay, counting each damaged area separately
+  unsigned int getReplayed() const {return m_nReplayed;};
+
+protected:
+  struct Command{
+    unsigned int type ;
+    DisplayRect bounds ; // pixels which may change
+    DisplayRect cover ; // pixels always overwritten, when bOpaque
+    bool bOpaque ;
+    int p[6] ; // coordinates, sizes and options in call order
+    bool bFlag ; // bFill, bPremultiplied or bTransparent
+    unsigned char fg[4], bg[4] ;
+    unsigned char fg_grey, bg_grey ;
+    const DisplayImage *img ;
+    DisplayFont *font ;
+    std::string text ;
+    std::vector<DisplayPoint> points ;
+  };
+
+  // Start a command of type with the current colours
+  Command &begin(unsigned int type) ;
+
+  // Commands which draw in area of target, in an order giving the same
+  // result as recording order with commands of one kind run together. Only
+  // the commands listed in candidates, in recording order, are considered
+  // when it is set.
+  void schedule(const DisplayImage &target, const DisplayRect &area, const std::vector<unsigned int> *candidates, std::vector<unsigned int> &order) const ;
+
+  // True if cmd overwrites every pixel of its cover when drawn on target
+  bool isCover(const Command &cmd, const DisplayImage &target) const ;
+
+  // Replay areas of target split into tiles on threads threads
+  void replayTiles(DisplayImage &target, const std::vector<DisplayRect> &areas, unsigned int threads) ;
+
+  // Run a command on target, setting the target colours first
+  void run(DisplayImage &target, const Command &cmd) const ;
+
+  std::vector<Command> m_commands ;
+  unsigned char m_fg[4], m_bg[4] ;
+  unsigned char m_fg_grey, m_bg_grey ;
+  unsigned int m_nReplayed ;
+};
+
+#endif
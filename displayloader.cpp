@@ -0,0 +1,293 @@
+#include "displayloader.hpp"
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+
+// Check a result without blocking
+template <class T>
+static bool isReady(const std::shared_future<T> &f)
+{
+  return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready ;
+}
+
+DisplayLoader::DisplayLoader(unsigned int threads, unsigned int cachesize)
+{
+  m_nCacheSize = cachesize ;
+  m_bStop = false ;
+  if (threads == 0) threads = 1 ;
+
+  for (unsigned int i=0; i < threads; i++){
+    m_workers.push_back(std::thread(&DisplayLoader::worker, this)) ;
+  }
+}
+
+DisplayLoader::~DisplayLoader()
+{
+  std::deque<Job> abandoned ;
+
+  {
+    std::lock_guard<std::mutex> lock(m_lock) ;
+    m_bStop = true ;
+    abandoned.swap(m_loads) ;
+    abandoned.insert(abandoned.end(), m_prefetches.begin(), m_prefetches.end()) ;
+    m_prefetches.clear() ;
+  }
+  m_wake.notify_all() ;
+
+  // Resolve the futures of work which never started
+  for (size_t i=0; i < abandoned.size(); i++) abandoned[i].run(true) ;
+
+  for (size_t i=0; i < m_workers.size(); i++) m_workers[i].join() ;
+}
+
+void DisplayLoader::worker()
+{
+  while (true){
+    Job job ;
+    {
+      std::unique_lock<std::mutex> lock(m_lock) ;
+      while (!m_bStop && m_loads.empty() && m_prefetches.empty()) m_wake.wait(lock) ;
+      if (m_bStop) return ;
+
+      if (!m_loads.empty()){
+	job = m_loads.front() ;
+	m_loads.pop_front() ;
+      }else{
+	job = m_prefetches.front() ;
+	m_prefetches.pop_front() ;
+      }
+    }
+    job.run(false) ;
+  }
+}
+
+void DisplayLoader::promote(const std::string &key)
+{
+  for (std::deque<Job>::iterator it = m_prefetches.begin(); it != m_prefetches.end(); it++){
+    if (it->key == key){
+      m_loads.push_back(*it) ;
+      m_prefetches.erase(it) ;
+      return ;
+    }
+  }
+}
+
+void DisplayLoader::touch(const std::string &key)
+{
+  m_order.remove(key) ;
+  m_order.push_front(key) ;
+
+  // Evict the least recently used entries which have finished loading
+  std::list<std::string>::iterator it = m_order.end() ;
+  while (m_order.size() > m_nCacheSize && it != m_order.begin()){
+    it-- ;
+    std::map<std::string, CacheEntry>::iterator entry = m_cache.find(*it) ;
+    if (entry == m_cache.end() ||
+	(entry->second.image.result.valid() && isReady(entry->second.image.result)) ||
+	(entry->second.font.result.valid() && isReady(entry->second.font.result))){
+      if (entry != m_cache.end()) m_cache.erase(entry) ;
+      it = m_order.erase(it) ;
+    }
+  }
+}
+
+void DisplayLoader::forget(const std::string &key)
+{
+  m_cache.erase(key) ;
+  m_order.remove(key) ;
+}
+
+template <class T>
+std::shared_future<std::shared_ptr<T> > DisplayLoader::request(const std::string &key,
+							       std::function<std::shared_ptr<T>()> load,
+							       bool bPrefetch,
+							       std::function<void(std::shared_ptr<T>)> callback)
+{
+  std::unique_lock<std::mutex> lock(m_lock) ;
+  std::map<std::string, CacheEntry>::iterator it = m_cache.find(key) ;
+
+  if (it != m_cache.end()){
+    // Already loaded or on its way
+    Slot<T> &s = slot(it->second, (T*)NULL) ;
+    std::shared_future<std::shared_ptr<T> > result = s.result ;
+    if (!bPrefetch) promote(key) ;
+    touch(key) ;
+    if (callback){
+      if (isReady(result)){
+	lock.unlock() ;
+	callback(result.get()) ;
+      }else{
+	s.callbacks.push_back(callback) ;
+      }
+    }
+    return result ;
+  }
+
+  std::shared_ptr<std::promise<std::shared_ptr<T> > > promise(new std::promise<std::shared_ptr<T> >) ;
+  Slot<T> &s = slot(m_cache[key], (T*)NULL) ;
+  std::shared_future<std::shared_ptr<T> > result = promise->get_future().share() ;
+  s.result = result ;
+  s.promise = promise ;
+  if (callback) s.callbacks.push_back(callback) ;
+
+  Job job ;
+  job.key = key ;
+  job.run = [this, key, load, promise](bool bCancel){
+    std::shared_ptr<T> asset ;
+    if (!bCancel) asset = load() ;
+    finish<T>(key, promise, asset) ;
+  };
+  if (bPrefetch) m_prefetches.push_back(job) ;
+  else m_loads.push_back(job) ;
+  touch(key) ;
+
+  lock.unlock() ;
+  m_wake.notify_one() ;
+  return result ;
+}
+
+template <class T>
+void DisplayLoader::finish(const std::string &key, std::shared_ptr<std::promise<std::shared_ptr<T> > > promise,
+			   std::shared_ptr<T> result)
+{
+  std::vector<std::function<void(std::shared_ptr<T>)> > callbacks ;
+
+  {
+    // Publish under the lock so requests see either a ready result or a
+    // pending one which will still run their callback
+    std::lock_guard<std::mutex> lock(m_lock) ;
+    std::map<std::string, CacheEntry>::iterator it = m_cache.find(key) ;
+    if (it != m_cache.end() && slot(it->second, (T*)NULL).promise == promise){
+      callbacks.swap(slot(it->second, (T*)NULL).callbacks) ;
+      if (!result) forget(key) ;
+    }
+    promise->set_value(result) ;
+  }
+
+  for (size_t i=0; i < callbacks.size(); i++) callbacks[i](result) ;
+}
+
+// Load functions run on the worker threads
+
+static DisplayImagePtr loadJPGAsset(std::string filename, unsigned int bits, unsigned int width, unsigned int height)
+{
+  DisplayImagePtr img(new DisplayImage) ;
+  if (!img->loadJPG(filename.c_str(), bits, width, height)) return DisplayImagePtr() ;
+  return img ;
+}
+
+static DisplayImagePtr loadBitmapAsset(std::string filename)
+{
+  DisplayImagePtr img(new DisplayImage) ;
+  int f = open(filename.c_str(), O_RDONLY) ;
+  if (f < 0){
+    fprintf(stderr, "Cannot open bitmap %s\n", filename.c_str()) ;
+    return DisplayImagePtr() ;
+  }
+  bool bLoaded = img->loadFile(f) ;
+  close(f) ;
+  if (!bLoaded) return DisplayImagePtr() ;
+  return img ;
+}
+
+static DisplayFontPtr loadFontAsset(std::string filename)
+{
+  DisplayFontPtr font(new DisplayFont) ;
+  int f = open(filename.c_str(), O_RDONLY) ;
+  if (f < 0){
+    fprintf(stderr, "Cannot open font %s\n", filename.c_str()) ;
+    return DisplayFontPtr() ;
+  }
+  bool bLoaded = font->loadFile(f) ;
+  close(f) ;
+  if (!bLoaded) return DisplayFontPtr() ;
+  return font ;
+}
+
+static std::string jpgKey(const char *szFilename, unsigned int bits, unsigned int width, unsigned int height)
+{
+  char szParams[64] ;
+  snprintf(szParams, sizeof(szParams), "jpg:%u:%ux%u:", bits, width, height) ;
+  return std::string(szParams) + szFilename ;
+}
+
+DisplayImageFuture DisplayLoader::loadJPG(const char *szFilename, unsigned int bits,
+					  unsigned int width, unsigned int height,
+					  DisplayImageCallback callback)
+{
+  std::string filename(szFilename) ;
+  return request<DisplayImage>(jpgKey(szFilename, bits, width, height),
+			       [filename, bits, width, height](){return loadJPGAsset(filename, bits, width, height);},
+			       false, callback) ;
+}
+
+DisplayImageFuture DisplayLoader::loadBitmap(const char *szFilename, DisplayImageCallback callback)
+{
+  std::string filename(szFilename) ;
+  return request<DisplayImage>("bmp:" + filename,
+			       [filename](){return loadBitmapAsset(filename);},
+			       false, callback) ;
+}
+
+DisplayFontFuture DisplayLoader::loadFont(const char *szFilename, DisplayFontCallback callback)
+{
+  std::string filename(szFilename) ;
+  return request<DisplayFont>("fnt:" + filename,
+			      [filename](){return loadFontAsset(filename);},
+			      false, callback) ;
+}
+
+void DisplayLoader::prefetchJPG(const char *szFilename, unsigned int bits,
+				unsigned int width, unsigned int height)
+{
+  std::string filename(szFilename) ;
+  request<DisplayImage>(jpgKey(szFilename, bits, width, height),
+			[filename, bits, width, height](){return loadJPGAsset(filename, bits, width, height);},
+			true, NULL) ;
+}
+
+void DisplayLoader::prefetchBitmap(const char *szFilename)
+{
+  std::string filename(szFilename) ;
+  request<DisplayImage>("bmp:" + filename, [filename](){return loadBitmapAsset(filename);}, true, NULL) ;
+}
+
+void DisplayLoader::prefetchFont(const char *szFilename)
+{
+  std::string filename(szFilename) ;
+  request<DisplayFont>("fnt:" + filename, [filename](){return loadFontAsset(filename);}, true, NULL) ;
+}
+
+void DisplayLoader::cancelPrefetch()
+{
+  std::deque<Job> abandoned ;
+
+  {
+    // Forget the entries with the queue so a load in the meantime queues the
+    // asset again rather than waiting on an abandoned job. Prefetches have no
+    // callbacks and a load would have moved the job to m_loads, so nothing is
+    // waiting on the entries.
+    std::lock_guard<std::mutex> lock(m_lock) ;
+    abandoned.swap(m_prefetches) ;
+    for (size_t i=0; i < abandoned.size(); i++) forget(abandoned[i].key) ;
+  }
+  for (size_t i=0; i < abandoned.size(); i++) abandoned[i].run(true) ;
+}
+
+void DisplayLoader::clearCache()
+{
+  std::lock_guard<std::mutex> lock(m_lock) ;
+  std::map<std::string, CacheEntry>::iterator it = m_cache.begin() ;
+
+  // Entries still loading stay so their callbacks run
+  while (it != m_cache.end()){
+    if ((it->second.image.result.valid() && isReady(it->second.image.result)) ||
+	(it->second.font.result.valid() && isReady(it->second.font.result))){
+      m_order.remove(it->first) ;
+      m_cache.erase(it++) ;
+    }else{
+      it++ ;
+    }
+  }
+}
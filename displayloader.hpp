@@ -0,0 +1,128 @@
+#ifndef __DISPLAYLOADER_HPP
+#define __DISPLAYLOADER_HPP
+
+#include "displayimage.hpp"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::shared_ptr<DisplayImage> DisplayImagePtr ;
+typedef std::shared_ptr<DisplayFont> DisplayFontPtr ;
+typedef std::shared_future<DisplayImagePtr> DisplayImageFuture ;
+typedef std::shared_future<DisplayFontPtr> DisplayFontFuture ;
+
+// Called from a worker thread once an asset has loaded, or straight away on
+// the calling thread when the asset is already cached. The pointer is empty
+// if the asset could not be loaded.
+typedef std::function<void(DisplayImagePtr)> DisplayImageCallback ;
+typedef std::function<void(DisplayFontPtr)> DisplayFontCallback ;
+
+// Loads images and fonts on a pool of worker threads so the render thread
+// does not stall on decoding. Each call returns a future straight away.
+// Loaded assets are kept in a small cache, so a prefetch hint for the next few
+// slides means the later load returns an asset that has already been decoded.
+// Requests for an asset already queued or cached share the same result.
+class DisplayLoader{
+public:
+  // threads is the number of workers. cachesize is the number of loaded
+  // assets remembered for reuse.
+  DisplayLoader(unsigned int threads = 2, unsigned int cachesize = 8) ;
+
+  // Queued work which has not started is abandoned. Running loads complete.
+  ~DisplayLoader() ;
+
+  // Load a JPEG, see DisplayImage::loadJPG for bits, width and height
+  DisplayImageFuture loadJPG(const char *szFilename, unsigned int bits = 32,
+			     unsigned int width = 0, unsigned int height = 0,
+			     DisplayImageCallback callback = NULL) ;
+
+  // Load a bitmap written by xbm2bin, see DisplayImage::loadFile
+  DisplayImageFuture loadBitmap(const char *szFilename, DisplayImageCallback callback = NULL) ;
+
+  // Load a font written by psf2bin, see DisplayFont::loadFile
+  DisplayFontFuture loadFont(const char *szFilename, DisplayFontCallback callback = NULL) ;
+
+  // Prefetch hints. The asset is decoded when no load requests are waiting
+  // and kept in the cache for a later load call.
+  void prefetchJPG(const char *szFilename, unsigned int bits = 32,
+		   unsigned int width = 0, unsigned int height = 0) ;
+  void prefetchBitmap(const char *szFilename) ;
+  void prefetchFont(const char *szFilename) ;
+
+  // Drop prefetch hints which have not started, such as when the user skips
+  // ahead. Futures already handed out for them will report an empty result.
+  // A later load of the same asset queues it again.
+  void cancelPrefetch() ;
+
+  // Forget all cached assets. Assets still held by the caller are unaffected.
+  void clearCache() ;
+
+protected:
+  struct Job{
+    std::string key ;
+    std::function<void(bool bCancel)> run ; // bCancel is set if the job was abandoned
+  };
+
+  // Result of one asset and the callbacks waiting for it
+  template <class T>
+  struct Slot{
+    std::shared_future<std::shared_ptr<T> > result ;
+    std::shared_ptr<std::promise<std::shared_ptr<T> > > promise ; // of the job filling result
+    std::vector<std::function<void(std::shared_ptr<T>)> > callbacks ;
+  };
+
+  // Keys name the asset type so only one of the slots is used
+  struct CacheEntry{
+    Slot<DisplayImage> image ;
+    Slot<DisplayFont> font ;
+  };
+  static Slot<DisplayImage> &slot(CacheEntry &entry, DisplayImage *){return entry.image;};
+  static Slot<DisplayFont> &slot(CacheEntry &entry, DisplayFont *){return entry.font;};
+
+  // Return the cached or queued result for key, otherwise queue load to
+  // create it. A callback is run as soon as the result is ready.
+  template <class T>
+  std::shared_future<std::shared_ptr<T> > request(const std::string &key,
+						  std::function<std::shared_ptr<T>()> load,
+						  bool bPrefetch,
+						  std::function<void(std::shared_ptr<T>)> callback) ;
+
+  // Publish the result of a job and run its callbacks. Failed loads are
+  // removed from the cache so they can be retried. The entry for key is only
+  // used if it still belongs to promise, not a later request for the key.
+  template <class T>
+  void finish(const std::string &key, std::shared_ptr<std::promise<std::shared_ptr<T> > > promise,
+	      std::shared_ptr<T> result) ;
+
+  // Move a queued prefetch for key to the load queue. Call with lock held.
+  void promote(const std::string &key) ;
+
+  // Mark key as most recently used and evict the oldest loaded entries
+  // beyond the cache size. Call with lock held.
+  void touch(const std::string &key) ;
+
+  // Remove key from the cache. Call with lock held.
+  void forget(const std::string &key) ;
+
+  void worker() ;
+
+  std::mutex m_lock ;
+  std::condition_variable m_wake ;
+  std::deque<Job> m_loads ; // waiting load requests, served first
+  std::deque<Job> m_prefetches ; // waiting prefetch hints
+  std::map<std::string, CacheEntry> m_cache ;
+  std::list<std::string> m_order ; // cache keys, most recently used first
+  unsigned int m_nCacheSize ;
+  std::vector<std::thread> m_workers ;
+  bool m_bStop ;
+};
+
+#endif
@@ -0,0 +1,1173 @@
+#include "displaysimd.hpp"
+#include "pixelformat.hpp"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DISPLAY_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DISPLAY_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*convert565fn)(const unsigned char *src, uint16_t *dst, unsigned int pixels) ;
+typedef unsigned int (*run565fn)(const uint16_t *p, uint16_t colour, unsigned int max) ;
+typedef void (*convertgreyfn)(const unsigned char *src, unsigned char *dst, unsigned int pixels) ;
+typedef void (*blendrowsfn)(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+			    unsigned char *dst, unsigned int start, unsigned int bytes) ;
+typedef void (*scalerowfn)(const unsigned char *src, unsigned char *dst, unsigned int width,
+			   const unsigned int *index, const int16_t *weights, unsigned int taps) ;
+typedef void (*compositefn)(unsigned char *dst, const unsigned char *src, unsigned int pixels, const uint8_t *factors) ;
+typedef unsigned int (*samefn)(const unsigned char *a, const unsigned char *b, unsigned int max) ;
+typedef void (*packpagefn)(const unsigned char *src, unsigned int stride, unsigned int rows,
+			   unsigned char *dst, unsigned int bytes) ;
+
+struct SimdKernels{
+  const char *name ;
+  convert565fn from32 ;
+  convert565fn from24 ;
+  convert565fn from16 ;
+  convert565fn from8 ;
+  run565fn run ;
+  convertgreyfn grey32 ;
+  convertgreyfn grey24 ;
+  convertgreyfn grey16 ;
+  blendrowsfn blend ;
+  scalerowfn scaleRGBA ; // 4 byte pixels
+  compositefn composite ; // premultiplied alpha
+  compositefn compositeStraight ;
+  samefn same ;
+  samefn sameBack ;
+  packpagefn packPage ;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar fallback
+
+template <class PF>
+static void convert565Scalar(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  for (unsigned int i=0; i < pixels; i++){
+    dst[i] = PF::get565(src + (i*PF::bytes)) ;
+  }
+}
+
+template <class PF>
+static void convertGreyScalar(const unsigned char *src, unsigned char *dst, unsigned int pixels)
+{
+  for (unsigned int i=0; i < pixels; i++){
+    dst[i] = PF::getGrey(src + (i*PF::bytes)) ;
+  }
+}
+
+// Blend bytes start to bytes of the rows. The vector kernels finish their
+// tails here.
+static void blendRowsScalar(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+			    unsigned char *dst, unsigned int start, unsigned int bytes)
+{
+  int acc = 0 ;
+
+  for (unsigned int i=start; i < bytes; i++){
+    acc = 1 << (SIMD_WEIGHT_BITS-1) ;
+    for (unsigned int t=0; t < taps; t++) acc += weights[t] * rows[t][i] ;
+    dst[i] = acc >> SIMD_WEIGHT_BITS ;
+  }
+}
+
+template <unsigned int C>
+static void scaleRowScalar(const unsigned char *src, unsigned char *dst, unsigned int width,
+			   const unsigned int *index, const int16_t *weights, unsigned int taps)
+{
+  const unsigned char *p = NULL ;
+  int acc[C] ;
+
+  for (unsigned int x=0; x < width; x++, index += taps, weights += taps){
+    for (unsigned int c=0; c < C; c++) acc[c] = 1 << (SIMD_WEIGHT_BITS-1) ;
+    for (unsigned int t=0; t < taps; t++){
+      p = src + (index[t]*C) ;
+      for (unsigned int c=0; c < C; c++) acc[c] += weights[t] * p[c] ;
+    }
+    for (unsigned int c=0; c < C; c++) dst[(x*C)+c] = acc[c] >> SIMD_WEIGHT_BITS ;
+  }
+}
+
+static unsigned int run565Scalar(const uint16_t *p, uint16_t colour, unsigned int max)
+{
+  unsigned int i = 0 ;
+  while (i < max && p[i] == colour) i++ ;
+  return i ;
+}
+
+// Words are compared until one differs, then bytes to find which
+static unsigned int sameBytesScalar(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  uint64_t x, y ;
+  for (; i+8 <= max; i+=8){
+    memcpy(&x, a + i, 8) ;
+    memcpy(&y, b + i, 8) ;
+    if (x != y) break ;
+  }
+  while (i < max && a[i] == b[i]) i++ ;
+  return i ;
+}
+
+static unsigned int sameBytesBackScalar(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  uint64_t x, y ;
+  for (; i+8 <= max; i+=8){
+    memcpy(&x, a + max - i - 8, 8) ;
+    memcpy(&y, b + max - i - 8, 8) ;
+    if (x != y) break ;
+  }
+  while (i < max && a[max-i-1] == b[max-i-1]) i++ ;
+  return i ;
+}
+
+// Each source byte of 8 rows is one 8x8 bit matrix to transpose
+static void packPageScalar(const unsigned char *src, unsigned int stride, unsigned int rows,
+			   unsigned char *dst, unsigned int bytes)
+{
+  uint64_t block = 0 ;
+  for (unsigned int j=0; j < bytes; j++){
+    block = 0 ;
+    for (unsigned int i=0; i < rows; i++) block |= (uint64_t)src[(i*stride)+j] << (i*8) ;
+    block = transposeBits(block) ;
+    for (unsigned int b=0; b < 8; b++) dst[(j*8)+b] = (block >> (b*8)) & 0xFF ;
+  }
+}
+
+// Divide by 255 with rounding, exact for x up to 255*255
+static inline unsigned int div255(unsigned int x)
+{
+  x += 128 ;
+  return (x + (x >> 8)) >> 8 ;
+}
+
+// Divide alpha back out of premultiplied RGBA pixels. Every instruction set
+// does the same single precision steps so results match the scalar code.
+static void unpremultiplyScalar(unsigned char *p, unsigned int pixels)
+{
+  int v = 0 ;
+  for (unsigned int i=0; i < pixels; i++, p += 4){
+    for (unsigned int c=0; c < 3; c++){
+      if (p[3] == 0){
+	p[c] = 0 ;
+      }else{
+	v = (int)((float)p[c] * 255.0f / (float)p[3] + 0.5f) ;
+	p[c] = v > 255?255:v ;
+      }
+    }
+  }
+}
+
+// Porter-Duff composite of RGBA pixels, see simdCompositeRGBA. With bStraight
+// the colour is premultiplied before the operation and divided out after.
+template <bool bStraight>
+static void compositeScalar(unsigned char *dst, const unsigned char *src, unsigned int pixels, const uint8_t *f)
+{
+  unsigned int as = 0, ad = 0, fa = 0, fb = 0, s = 0, d = 0, r = 0 ;
+
+  for (unsigned int i=0; i < pixels; i++, dst += 4, src += 4){
+    as = src[3] ;
+    ad = dst[3] ;
+    fa = (ad & f[0]) ^ f[1] ;
+    fb = (as & f[2]) ^ f[3] ;
+    for (unsigned int c=0; c < 4; c++){
+      s = src[c] ;
+      d = dst[c] ;
+      if (bStraight && c < 3){
+	s = div255(s * as) ;
+	d = div255(d * ad) ;
+      }
+      r = div255(s * fa) + div255(d * fb) ;
+      dst[c] = r > 255?255:r ;
+    }
+    if (bStraight) unpremultiplyScalar(dst, 1) ;
+  }
+}
+
+#ifdef DISPLAY_SIMD_X86
+////////////////////////////////////////////////////////////////////////////////
+// SSE2
+
+// Convert 4 RGBA pixels to 565 values held in 32 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i rgba565SSE2(__m128i px)
+{
+  __m128i r = _mm_slli_epi32(_mm_and_si128(px, _mm_set1_epi32(0xF8)), 8) ;
+  __m128i g = _mm_srli_epi32(_mm_and_si128(px, _mm_set1_epi32(0xFC00)), 5) ;
+  __m128i b = _mm_srli_epi32(_mm_and_si128(px, _mm_set1_epi32(0xF80000)), 19) ;
+  return _mm_or_si128(_mm_or_si128(r, g), b) ;
+}
+
+// Grey values held in 16 bit lanes to 565
+__attribute__((target("sse2")))
+static inline __m128i grey565SSE2(__m128i v)
+{
+  __m128i r = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xF8)), 8) ;
+  __m128i g = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xFC)), 3) ;
+  __m128i b = _mm_srli_epi16(v, 3) ;
+  return _mm_or_si128(_mm_or_si128(r, g), b) ;
+}
+
+__attribute__((target("sse2")))
+static void convert565From32SSE2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    __m128i a = rgba565SSE2(_mm_loadu_si128((const __m128i*)(src + (i*4)))) ;
+    __m128i b = rgba565SSE2(_mm_loadu_si128((const __m128i*)(src + (i*4) + 16))) ;
+    // Sign extend so the signed saturating pack keeps all 16 bits
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16) ;
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16) ;
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b)) ;
+  }
+  convert565Scalar<PixelFormat32>(src + (i*4), dst + i, pixels - i) ;
+}
+
+__attribute__((target("sse2")))
+static void convert565From16SSE2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + (i*2))) ;
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)) ;
+    _mm_storeu_si128((__m128i*)(dst + i), v) ;
+  }
+  convert565Scalar<PixelFormat16>(src + (i*2), dst + i, pixels - i) ;
+}
+
+__attribute__((target("sse2")))
+static void convert565From8SSE2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  __m128i zero = _mm_setzero_si128() ;
+  for (; i+16 <= pixels; i+=16){
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i)) ;
+    _mm_storeu_si128((__m128i*)(dst + i), grey565SSE2(_mm_unpacklo_epi8(v, zero))) ;
+    _mm_storeu_si128((__m128i*)(dst + i + 8), grey565SSE2(_mm_unpackhi_epi8(v, zero))) ;
+  }
+  convert565Scalar<PixelFormat8>(src + i, dst + i, pixels - i) ;
+}
+
+// Luminance of 4 pixels with red, green and blue in the low bytes of 32 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i greySSE2(__m128i px)
+{
+  __m128i mask = _mm_set1_epi32(0xFF) ;
+  __m128i r = _mm_and_si128(px, mask) ;
+  __m128i g = _mm_and_si128(_mm_srli_epi32(px, 8), mask) ;
+  __m128i b = _mm_and_si128(_mm_srli_epi32(px, 16), mask) ;
+  // Products fit in the low 16 bits of each lane
+  __m128i y = _mm_add_epi32(_mm_mullo_epi16(r, _mm_set1_epi32(77)), _mm_mullo_epi16(g, _mm_set1_epi32(150))) ;
+  y = _mm_add_epi32(y, _mm_add_epi32(_mm_mullo_epi16(b, _mm_set1_epi32(29)), _mm_set1_epi32(128))) ;
+  return _mm_srli_epi32(y, 8) ;
+}
+
+__attribute__((target("sse2")))
+static void convertGreyFrom32SSE2(const unsigned char *src, unsigned char *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= pixels; i+=16){
+    __m128i a = greySSE2(_mm_loadu_si128((const __m128i*)(src + (i*4)))) ;
+    __m128i b = greySSE2(_mm_loadu_si128((const __m128i*)(src + (i*4) + 16))) ;
+    __m128i c = greySSE2(_mm_loadu_si128((const __m128i*)(src + (i*4) + 32))) ;
+    __m128i d = greySSE2(_mm_loadu_si128((const __m128i*)(src + (i*4) + 48))) ;
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d))) ;
+  }
+  convertGreyScalar<PixelFormat32>(src + (i*4), dst + i, pixels - i) ;
+}
+
+// Taps are taken in pairs so madd multiplies and adds two rows at once
+__attribute__((target("sse2")))
+static void blendRowsSSE2(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+			  unsigned char *dst, unsigned int start, unsigned int bytes)
+{
+  const __m128i zero = _mm_setzero_si128() ;
+  unsigned int i = start, t = 0 ;
+  const unsigned char *pa = NULL, *pb = NULL ;
+
+  for (; i+16 <= bytes; i+=16){
+    __m128i acc[4] ;
+    for (int n=0; n < 4; n++) acc[n] = _mm_set1_epi32(1 << (SIMD_WEIGHT_BITS-1)) ;
+    for (t=0; t < taps; t+=2){
+      // An odd tap is paired with a zero weight
+      pa = rows[t] ;
+      pb = t+1 < taps?rows[t+1]:rows[t] ;
+      __m128i w = _mm_set1_epi32((uint16_t)weights[t] | ((t+1 < taps?weights[t+1]:0) << 16)) ;
+      __m128i a = _mm_loadu_si128((const __m128i*)(pa + i)) ;
+      __m128i b = _mm_loadu_si128((const __m128i*)(pb + i)) ;
+      __m128i lo = _mm_unpacklo_epi8(a, zero), blo = _mm_unpacklo_epi8(b, zero) ;
+      __m128i hi = _mm_unpackhi_epi8(a, zero), bhi = _mm_unpackhi_epi8(b, zero) ;
+      acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_unpacklo_epi16(lo, blo), w)) ;
+      acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_unpackhi_epi16(lo, blo), w)) ;
+      acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_unpacklo_epi16(hi, bhi), w)) ;
+      acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(_mm_unpackhi_epi16(hi, bhi), w)) ;
+    }
+    for (int n=0; n < 4; n++) acc[n] = _mm_srai_epi32(acc[n], SIMD_WEIGHT_BITS) ;
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(_mm_packs_epi32(acc[0], acc[1]),
+							   _mm_packs_epi32(acc[2], acc[3]))) ;
+  }
+  blendRowsScalar(rows, weights, taps, dst, i, bytes) ;
+}
+
+// One pixel at a time with two taps per madd
+__attribute__((target("sse2")))
+static void scaleRowRGBASSE2(const unsigned char *src, unsigned char *dst, unsigned int width,
+			     const unsigned int *index, const int16_t *weights, unsigned int taps)
+{
+  const __m128i zero = _mm_setzero_si128() ;
+  int32_t a = 0, b = 0 ;
+  int16_t wb = 0 ;
+
+  for (unsigned int x=0; x < width; x++, index += taps, weights += taps){
+    __m128i acc = _mm_set1_epi32(1 << (SIMD_WEIGHT_BITS-1)) ;
+    for (unsigned int t=0; t < taps; t+=2){
+      memcpy(&a, src + (index[t]*4), 4) ;
+      b = 0 ;
+      wb = 0 ;
+      if (t+1 < taps){
+	memcpy(&b, src + (index[t+1]*4), 4) ;
+	wb = weights[t+1] ;
+      }
+      __m128i ab = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(a), zero),
+				      _mm_unpacklo_epi8(_mm_cvtsi32_si128(b), zero)) ;
+      __m128i w = _mm_set1_epi32((uint16_t)weights[t] | (wb << 16)) ;
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(ab, w)) ;
+    }
+    acc = _mm_srai_epi32(acc, SIMD_WEIGHT_BITS) ;
+    acc = _mm_packs_epi32(acc, acc) ;
+    a = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc)) ;
+    memcpy(dst + (x*4), &a, 4) ;
+  }
+}
+
+__attribute__((target("sse2")))
+static unsigned int run565SSE2(const uint16_t *p, uint16_t colour, unsigned int max)
+{
+  unsigned int i = 0 ;
+  __m128i c = _mm_set1_epi16((short)colour) ;
+  for (; i+8 <= max; i+=8){
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + i)), c)) ;
+    if (mask != 0xFFFF) return i + (__builtin_ctz(~mask) >> 1) ;
+  }
+  return i + run565Scalar(p + i, colour, max - i) ;
+}
+
+__attribute__((target("sse2")))
+static unsigned int sameBytesSSE2(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= max; i+=16){
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)),
+						 _mm_loadu_si128((const __m128i*)(b + i)))) ;
+    if (mask != 0xFFFF) return i + __builtin_ctz(~mask) ;
+  }
+  return i + sameBytesScalar(a + i, b + i, max - i) ;
+}
+
+__attribute__((target("sse2")))
+static unsigned int sameBytesBackSSE2(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= max; i+=16){
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + max - i - 16)),
+							  _mm_loadu_si128((const __m128i*)(b + max - i - 16)))) ;
+    // Last byte in the top bit
+    if (mask != 0xFFFF) return i + __builtin_clz((~mask & 0xFFFF) << 16) ;
+  }
+  return i + sameBytesBackScalar(a, b, max - i) ;
+}
+
+// transposeBits on both 64 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i transposeBitsSSE2(__m128i x)
+{
+  __m128i t ;
+  t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 7)), _mm_set1_epi64x(0x00AA00AA00AA00AALL)) ;
+  x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 7))) ;
+  t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 14)), _mm_set1_epi64x(0x0000CCCC0000CCCCLL)) ;
+  x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 14))) ;
+  t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 28)), _mm_set1_epi64x(0x00000000F0F0F0F0LL)) ;
+  x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 28))) ;
+  return x ;
+}
+
+// 16 source bytes of 8 rows at a time. Interleaving the rows puts the 8
+// rows of each source byte in a 64 bit lane, which is then transposed.
+__attribute__((target("sse2")))
+static void packPageSSE2(const unsigned char *src, unsigned int stride, unsigned int rows,
+			 unsigned char *dst, unsigned int bytes)
+{
+  unsigned int j = 0 ;
+  __m128i r[8], a[8], b[8] ;
+  for (; j+16 <= bytes; j+=16){
+    for (unsigned int i=0; i < 8; i++){
+      r[i] = i < rows?_mm_loadu_si128((const __m128i*)(src + (i*stride) + j)):_mm_setzero_si128() ;
+    }
+    // Pairs of rows for bytes 0-7 and 8-15
+    for (unsigned int i=0; i < 4; i++){
+      a[i*2] = _mm_unpacklo_epi8(r[i*2], r[(i*2)+1]) ;
+      a[(i*2)+1] = _mm_unpackhi_epi8(r[i*2], r[(i*2)+1]) ;
+    }
+    // Rows 0-3 then 4-7 for bytes 0-3, 4-7, 8-11 and 12-15
+    b[0] = _mm_unpacklo_epi16(a[0], a[2]) ;
+    b[1] = _mm_unpackhi_epi16(a[0], a[2]) ;
+    b[2] = _mm_unpacklo_epi16(a[1], a[3]) ;
+    b[3] = _mm_unpackhi_epi16(a[1], a[3]) ;
+    b[4] = _mm_unpacklo_epi16(a[4], a[6]) ;
+    b[5] = _mm_unpackhi_epi16(a[4], a[6]) ;
+    b[6] = _mm_unpacklo_epi16(a[5], a[7]) ;
+    b[7] = _mm_unpackhi_epi16(a[5], a[7]) ;
+    // All 8 rows for two bytes in each
+    for (unsigned int i=0; i < 4; i++){
+      _mm_storeu_si128((__m128i*)(dst + (j*8) + (i*32)), transposeBitsSSE2(_mm_unpacklo_epi32(b[i], b[i+4]))) ;
+      _mm_storeu_si128((__m128i*)(dst + (j*8) + (i*32) + 16), transposeBitsSSE2(_mm_unpackhi_epi32(b[i], b[i+4]))) ;
+    }
+  }
+  packPageScalar(src + j, stride, rows, dst + (j*8), bytes - j) ;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i div255SSE2(__m128i x)
+{
+  x = _mm_add_epi16(x, _mm_set1_epi16(128)) ;
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8) ;
+}
+
+// Composite 2 RGBA pixels held in 16 bit lanes. f holds the factor masks
+// in 16 bit lanes. Results reach 510 before saturation.
+template <bool bStraight>
+__attribute__((target("sse2")))
+static inline __m128i composite2SSE2(__m128i s, __m128i d, const __m128i *f)
+{
+  __m128i as = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF) ;
+  __m128i ad = _mm_shufflehi_epi16(_mm_shufflelo_epi16(d, 0xFF), 0xFF) ;
+  if (bStraight){
+    // Premultiply the colour, alpha stays as it is
+    __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0) ;
+    s = _mm_or_si128(_mm_and_si128(alpha, s), _mm_andnot_si128(alpha, div255SSE2(_mm_mullo_epi16(s, as)))) ;
+    d = _mm_or_si128(_mm_and_si128(alpha, d), _mm_andnot_si128(alpha, div255SSE2(_mm_mullo_epi16(d, ad)))) ;
+  }
+  __m128i fa = _mm_xor_si128(_mm_and_si128(ad, f[0]), f[1]) ;
+  __m128i fb = _mm_xor_si128(_mm_and_si128(as, f[2]), f[3]) ;
+  return _mm_add_epi16(div255SSE2(_mm_mullo_epi16(s, fa)), div255SSE2(_mm_mullo_epi16(d, fb))) ;
+}
+
+// Unpremultiply one pixel held in 32 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i unpremultiply1SSE2(__m128i px)
+{
+  __m128 v = _mm_cvtepi32_ps(px) ;
+  __m128 a = _mm_shuffle_ps(v, v, 0xFF) ;
+  __m128i alpha = _mm_set_epi32(-1, 0, 0, 0) ;
+  __m128i r = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(_mm_mul_ps(v, _mm_set1_ps(255.0f)), a), _mm_set1_ps(0.5f))) ;
+  r = _mm_andnot_si128(_mm_castps_si128(_mm_cmpeq_ps(a, _mm_setzero_ps())), r) ; // no colour without alpha
+  return _mm_or_si128(_mm_and_si128(alpha, px), _mm_andnot_si128(alpha, r)) ;
+}
+
+// Unpremultiply 4 RGBA pixels
+__attribute__((target("sse2")))
+static inline __m128i unpremultiply4SSE2(__m128i px)
+{
+  __m128i zero = _mm_setzero_si128() ;
+  __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero) ;
+  lo = _mm_packs_epi32(unpremultiply1SSE2(_mm_unpacklo_epi16(lo, zero)), unpremultiply1SSE2(_mm_unpackhi_epi16(lo, zero))) ;
+  hi = _mm_packs_epi32(unpremultiply1SSE2(_mm_unpacklo_epi16(hi, zero)), unpremultiply1SSE2(_mm_unpackhi_epi16(hi, zero))) ;
+  return _mm_packus_epi16(lo, hi) ;
+}
+
+template <bool bStraight>
+__attribute__((target("sse2")))
+static void compositeSSE2(unsigned char *dst, const unsigned char *src, unsigned int pixels, const uint8_t *factors)
+{
+  unsigned int i = 0 ;
+  __m128i zero = _mm_setzero_si128() ;
+  __m128i f[4] ;
+  for (unsigned int n=0; n < 4; n++) f[n] = _mm_set1_epi16(factors[n]) ;
+
+  for (; i+4 <= pixels; i+=4){
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + (i*4))) ;
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + (i*4))) ;
+    __m128i lo = composite2SSE2<bStraight>(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), f) ;
+    __m128i hi = composite2SSE2<bStraight>(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), f) ;
+    __m128i out = _mm_packus_epi16(lo, hi) ;
+    if (bStraight) out = unpremultiply4SSE2(out) ;
+    _mm_storeu_si128((__m128i*)(dst + (i*4)), out) ;
+  }
+  compositeScalar<bStraight>(dst + (i*4), src + (i*4), pixels - i, factors) ;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2
+
+__attribute__((target("avx2")))
+static inline __m256i rgba565AVX2(__m256i px)
+{
+  __m256i r = _mm256_slli_epi32(_mm256_and_si256(px, _mm256_set1_epi32(0xF8)), 8) ;
+  __m256i g = _mm256_srli_epi32(_mm256_and_si256(px, _mm256_set1_epi32(0xFC00)), 5) ;
+  __m256i b = _mm256_srli_epi32(_mm256_and_si256(px, _mm256_set1_epi32(0xF80000)), 19) ;
+  return _mm256_or_si256(_mm256_or_si256(r, g), b) ;
+}
+
+// Pack two sets of 8 lanes of 565 values into 16 values in order
+__attribute__((target("avx2")))
+static inline __m256i pack565AVX2(__m256i a, __m256i b)
+{
+  return _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8) ;
+}
+
+__attribute__((target("avx2")))
+static void convert565From32AVX2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= pixels; i+=16){
+    __m256i a = rgba565AVX2(_mm256_loadu_si256((const __m256i*)(src + (i*4)))) ;
+    __m256i b = rgba565AVX2(_mm256_loadu_si256((const __m256i*)(src + (i*4) + 32))) ;
+    _mm256_storeu_si256((__m256i*)(dst + i), pack565AVX2(a, b)) ;
+  }
+  convert565Scalar<PixelFormat32>(src + (i*4), dst + i, pixels - i) ;
+}
+
+// Load 8 RGB pixels as RGBA with the alpha byte cleared. Reads 4 bytes past
+// the last pixel.
+__attribute__((target("avx2")))
+static inline __m256i loadRGBAVX2(const unsigned char *src)
+{
+  const __m256i shuffle = _mm256_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1,
+					   0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1) ;
+  __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)),
+				      _mm_loadu_si128((const __m128i*)(src + 12)), 1) ;
+  return _mm256_shuffle_epi8(v, shuffle) ;
+}
+
+__attribute__((target("avx2")))
+static void convert565From24AVX2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  // Keep the over-read of the second load inside the buffer
+  for (; i+18 <= pixels; i+=16){
+    __m256i a = rgba565AVX2(loadRGBAVX2(src + (i*3))) ;
+    __m256i b = rgba565AVX2(loadRGBAVX2(src + (i*3) + 24)) ;
+    _mm256_storeu_si256((__m256i*)(dst + i), pack565AVX2(a, b)) ;
+  }
+  convert565Scalar<PixelFormat24>(src + (i*3), dst + i, pixels - i) ;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i greyAVX2(__m256i px)
+{
+  __m256i mask = _mm256_set1_epi32(0xFF) ;
+  __m256i r = _mm256_and_si256(px, mask) ;
+  __m256i g = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask) ;
+  __m256i b = _mm256_and_si256(_mm256_srli_epi32(px, 16), mask) ;
+  __m256i y = _mm256_add_epi32(_mm256_mullo_epi16(r, _mm256_set1_epi32(77)), _mm256_mullo_epi16(g, _mm256_set1_epi32(150))) ;
+  y = _mm256_add_epi32(y, _mm256_add_epi32(_mm256_mullo_epi16(b, _mm256_set1_epi32(29)), _mm256_set1_epi32(128))) ;
+  return _mm256_srli_epi32(y, 8) ;
+}
+
+// Pack two sets of 8 grey values in 32 bit lanes to 16 bytes in order
+__attribute__((target("avx2")))
+static inline __m128i packGreyAVX2(__m256i a, __m256i b)
+{
+  __m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8) ;
+  v = _mm256_packus_epi16(v, v) ;
+  return _mm256_castsi256_si128(_mm256_permute4x64_epi64(v, 0x08)) ;
+}
+
+__attribute__((target("avx2")))
+static void convertGreyFrom32AVX2(const unsigned char *src, unsigned char *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= pixels; i+=16){
+    __m256i a = greyAVX2(_mm256_loadu_si256((const __m256i*)(src + (i*4)))) ;
+    __m256i b = greyAVX2(_mm256_loadu_si256((const __m256i*)(src + (i*4) + 32))) ;
+    _mm_storeu_si128((__m128i*)(dst + i), packGreyAVX2(a, b)) ;
+  }
+  convertGreyScalar<PixelFormat32>(src + (i*4), dst + i, pixels - i) ;
+}
+
+__attribute__((target("avx2")))
+static void convertGreyFrom24AVX2(const unsigned char *src, unsigned char *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  // Keep the over-read of the second load inside the buffer
+  for (; i+18 <= pixels; i+=16){
+    __m256i a = greyAVX2(loadRGBAVX2(src + (i*3))) ;
+    __m256i b = greyAVX2(loadRGBAVX2(src + (i*3) + 24)) ;
+    _mm_storeu_si128((__m128i*)(dst + i), packGreyAVX2(a, b)) ;
+  }
+  convertGreyScalar<PixelFormat24>(src + (i*3), dst + i, pixels - i) ;
+}
+
+// As the SSE2 version with each 128 bit lane handling 16 bytes
+__attribute__((target("avx2")))
+static void blendRowsAVX2(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+			  unsigned char *dst, unsigned int start, unsigned int bytes)
+{
+  const __m256i zero = _mm256_setzero_si256() ;
+  unsigned int i = start, t = 0 ;
+  const unsigned char *pa = NULL, *pb = NULL ;
+
+  for (; i+32 <= bytes; i+=32){
+    __m256i acc[4] ;
+    for (int n=0; n < 4; n++) acc[n] = _mm256_set1_epi32(1 << (SIMD_WEIGHT_BITS-1)) ;
+    for (t=0; t < taps; t+=2){
+      pa = rows[t] ;
+      pb = t+1 < taps?rows[t+1]:rows[t] ;
+      __m256i w = _mm256_set1_epi32((uint16_t)weights[t] | ((t+1 < taps?weights[t+1]:0) << 16)) ;
+      __m256i a = _mm256_loadu_si256((const __m256i*)(pa + i)) ;
+      __m256i b = _mm256_loadu_si256((const __m256i*)(pb + i)) ;
+      __m256i lo = _mm256_unpacklo_epi8(a, zero), blo = _mm256_unpacklo_epi8(b, zero) ;
+      __m256i hi = _mm256_unpackhi_epi8(a, zero), bhi = _mm256_unpackhi_epi8(b, zero) ;
+      acc[0] = _mm256_add_epi32(acc[0], _mm256_madd_epi16(_mm256_unpacklo_epi16(lo, blo), w)) ;
+      acc[1] = _mm256_add_epi32(acc[1], _mm256_madd_epi16(_mm256_unpackhi_epi16(lo, blo), w)) ;
+      acc[2] = _mm256_add_epi32(acc[2], _mm256_madd_epi16(_mm256_unpacklo_epi16(hi, bhi), w)) ;
+      acc[3] = _mm256_add_epi32(acc[3], _mm256_madd_epi16(_mm256_unpackhi_epi16(hi, bhi), w)) ;
+    }
+    for (int n=0; n < 4; n++) acc[n] = _mm256_srai_epi32(acc[n], SIMD_WEIGHT_BITS) ;
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(_mm256_packs_epi32(acc[0], acc[1]),
+								 _mm256_packs_epi32(acc[2], acc[3]))) ;
+  }
+  blendRowsSSE2(rows, weights, taps, dst, i, bytes) ;
+}
+
+__attribute__((target("avx2")))
+static void convert565From16AVX2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= pixels; i+=16){
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + (i*2))) ;
+    v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)) ;
+    _mm256_storeu_si256((__m256i*)(dst + i), v) ;
+  }
+  convert565Scalar<PixelFormat16>(src + (i*2), dst + i, pixels - i) ;
+}
+
+__attribute__((target("avx2")))
+static void convert565From8AVX2(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= pixels; i+=16){
+    __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i))) ;
+    __m256i r = _mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xF8)), 8) ;
+    __m256i g = _mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xFC)), 3) ;
+    __m256i b = _mm256_srli_epi16(v, 3) ;
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_or_si256(r, g), b)) ;
+  }
+  convert565Scalar<PixelFormat8>(src + i, dst + i, pixels - i) ;
+}
+
+__attribute__((target("avx2")))
+static unsigned int run565AVX2(const uint16_t *p, uint16_t colour, unsigned int max)
+{
+  unsigned int i = 0 ;
+  __m256i c = _mm256_set1_epi16((short)colour) ;
+  for (; i+16 <= max; i+=16){
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(p + i)), c)) ;
+    if (mask != 0xFFFFFFFF) return i + (__builtin_ctz(~mask) >> 1) ;
+  }
+  return i + run565SSE2(p + i, colour, max - i) ;
+}
+
+__attribute__((target("avx2")))
+static unsigned int sameBytesAVX2(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  for (; i+32 <= max; i+=32){
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+								_mm256_loadu_si256((const __m256i*)(b + i)))) ;
+    if (mask != 0xFFFFFFFF) return i + __builtin_ctz(~mask) ;
+  }
+  return i + sameBytesSSE2(a + i, b + i, max - i) ;
+}
+
+__attribute__((target("avx2")))
+static unsigned int sameBytesBackAVX2(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  for (; i+32 <= max; i+=32){
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + max - i - 32)),
+								_mm256_loadu_si256((const __m256i*)(b + max - i - 32)))) ;
+    if (mask != 0xFFFFFFFF) return i + __builtin_clz(~mask) ;
+  }
+  return i + sameBytesBackSSE2(a, b, max - i) ;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255AVX2(__m256i x)
+{
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128)) ;
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8) ;
+}
+
+// Composite 4 RGBA pixels held in 16 bit lanes, as composite2SSE2
+template <bool bStraight>
+__attribute__((target("avx2")))
+static inline __m256i composite4AVX2(__m256i s, __m256i d, const __m256i *f)
+{
+  __m256i as = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF) ;
+  __m256i ad = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(d, 0xFF), 0xFF) ;
+  if (bStraight){
+    __m256i alpha = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0) ;
+    s = _mm256_blendv_epi8(div255AVX2(_mm256_mullo_epi16(s, as)), s, alpha) ;
+    d = _mm256_blendv_epi8(div255AVX2(_mm256_mullo_epi16(d, ad)), d, alpha) ;
+  }
+  __m256i fa = _mm256_xor_si256(_mm256_and_si256(ad, f[0]), f[1]) ;
+  __m256i fb = _mm256_xor_si256(_mm256_and_si256(as, f[2]), f[3]) ;
+  return _mm256_add_epi16(div255AVX2(_mm256_mullo_epi16(s, fa)), div255AVX2(_mm256_mullo_epi16(d, fb))) ;
+}
+
+// Unpremultiply two pixels held in 32 bit lanes
+__attribute__((target("avx2")))
+static inline __m256i unpremultiply2AVX2(__m256i px)
+{
+  __m256 v = _mm256_cvtepi32_ps(px) ;
+  __m256 a = _mm256_shuffle_ps(v, v, 0xFF) ;
+  __m256i alpha = _mm256_set_epi32(-1, 0, 0, 0, -1, 0, 0, 0) ;
+  __m256i r = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(v, _mm256_set1_ps(255.0f)), a), _mm256_set1_ps(0.5f))) ;
+  r = _mm256_andnot_si256(_mm256_castps_si256(_mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_EQ_OQ)), r) ;
+  return _mm256_blendv_epi8(r, px, alpha) ;
+}
+
+// Unpremultiply 8 RGBA pixels. Unpacking and packing are both within 128 bit
+// lanes so pixels return to their places.
+__attribute__((target("avx2")))
+static inline __m256i unpremultiply8AVX2(__m256i px)
+{
+  __m256i zero = _mm256_setzero_si256() ;
+  __m256i lo = _mm256_unpacklo_epi8(px, zero), hi = _mm256_unpackhi_epi8(px, zero) ;
+  lo = _mm256_packs_epi32(unpremultiply2AVX2(_mm256_unpacklo_epi16(lo, zero)), unpremultiply2AVX2(_mm256_unpackhi_epi16(lo, zero))) ;
+  hi = _mm256_packs_epi32(unpremultiply2AVX2(_mm256_unpacklo_epi16(hi, zero)), unpremultiply2AVX2(_mm256_unpackhi_epi16(hi, zero))) ;
+  return _mm256_packus_epi16(lo, hi) ;
+}
+
+template <bool bStraight>
+__attribute__((target("avx2")))
+static void compositeAVX2(unsigned char *dst, const unsigned char *src, unsigned int pixels, const uint8_t *factors)
+{
+  unsigned int i = 0 ;
+  __m256i zero = _mm256_setzero_si256() ;
+  __m256i f[4] ;
+  for (unsigned int n=0; n < 4; n++) f[n] = _mm256_set1_epi16(factors[n]) ;
+
+  for (; i+8 <= pixels; i+=8){
+    __m256i s = _mm256_loadu_si256((const __m256i*)(src + (i*4))) ;
+    __m256i d = _mm256_loadu_si256((const __m256i*)(dst + (i*4))) ;
+    __m256i lo = composite4AVX2<bStraight>(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), f) ;
+    __m256i hi = composite4AVX2<bStraight>(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), f) ;
+    __m256i out = _mm256_packus_epi16(lo, hi) ;
+    if (bStraight) out = unpremultiply8AVX2(out) ;
+    _mm256_storeu_si256((__m256i*)(dst + (i*4)), out) ;
+  }
+  compositeSSE2<bStraight>(dst + (i*4), src + (i*4), pixels - i, factors) ;
+}
+#endif
+
+#ifdef DISPLAY_SIMD_NEON
+////////////////////////////////////////////////////////////////////////////////
+// NEON
+
+// Shift and insert the top bits of each channel into 565
+static inline uint16x8_t rgb565NEON(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+  uint16x8_t out = vshll_n_u8(r, 8) ;
+  out = vsriq_n_u16(out, vshll_n_u8(g, 8), 5) ;
+  out = vsriq_n_u16(out, vshll_n_u8(b, 8), 11) ;
+  return out ;
+}
+
+static void convert565From32NEON(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    uint8x8x4_t px = vld4_u8(src + (i*4)) ;
+    vst1q_u16(dst + i, rgb565NEON(px.val[0], px.val[1], px.val[2])) ;
+  }
+  convert565Scalar<PixelFormat32>(src + (i*4), dst + i, pixels - i) ;
+}
+
+static void convert565From24NEON(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    uint8x8x3_t px = vld3_u8(src + (i*3)) ;
+    vst1q_u16(dst + i, rgb565NEON(px.val[0], px.val[1], px.val[2])) ;
+  }
+  convert565Scalar<PixelFormat24>(src + (i*3), dst + i, pixels - i) ;
+}
+
+static void convert565From16NEON(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    vst1q_u16(dst + i, vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + (i*2))))) ;
+  }
+  convert565Scalar<PixelFormat16>(src + (i*2), dst + i, pixels - i) ;
+}
+
+static void convert565From8NEON(const unsigned char *src, uint16_t *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    uint8x8_t v = vld1_u8(src + i) ;
+    vst1q_u16(dst + i, rgb565NEON(v, v, v)) ;
+  }
+  convert565Scalar<PixelFormat8>(src + i, dst + i, pixels - i) ;
+}
+
+static unsigned int run565NEON(const uint16_t *p, uint16_t colour, unsigned int max)
+{
+  unsigned int i = 0 ;
+  uint16x8_t c = vdupq_n_u16(colour) ;
+  for (; i+8 <= max; i+=8){
+    uint64x2_t eq = vreinterpretq_u64_u16(vceqq_u16(vld1q_u16(p + i), c)) ;
+    if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != 0xFFFFFFFFFFFFFFFFULL) break ;
+  }
+  return i + run565Scalar(p + i, colour, max - i) ;
+}
+
+static unsigned int sameBytesNEON(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= max; i+=16){
+    uint64x2_t eq = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) ;
+    if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != 0xFFFFFFFFFFFFFFFFULL) break ;
+  }
+  return i + sameBytesScalar(a + i, b + i, max - i) ;
+}
+
+static unsigned int sameBytesBackNEON(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  unsigned int i = 0 ;
+  for (; i+16 <= max; i+=16){
+    uint64x2_t eq = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(a + max - i - 16), vld1q_u8(b + max - i - 16))) ;
+    if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != 0xFFFFFFFFFFFFFFFFULL) break ;
+  }
+  return i + sameBytesBackScalar(a, b, max - i) ;
+}
+
+static inline uint8x16_t transposeBitsNEON(uint32x4_t v)
+{
+  uint64x2_t x = vreinterpretq_u64_u32(v), t ;
+  t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, 7)), vdupq_n_u64(0x00AA00AA00AA00AAULL)) ;
+  x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, 7))) ;
+  t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, 14)), vdupq_n_u64(0x0000CCCC0000CCCCULL)) ;
+  x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, 14))) ;
+  t = vandq_u64(veorq_u64(x, vshrq_n_u64(x, 28)), vdupq_n_u64(0x00000000F0F0F0F0ULL)) ;
+  x = veorq_u64(x, veorq_u64(t, vshlq_n_u64(t, 28))) ;
+  return vreinterpretq_u8_u64(x) ;
+}
+
+// As packPageSSE2 with zips in place of unpacks
+static void packPageNEON(const unsigned char *src, unsigned int stride, unsigned int rows,
+			 unsigned char *dst, unsigned int bytes)
+{
+  unsigned int j = 0 ;
+  uint8x16_t r[8] ;
+  uint8x16x2_t a[4] ;
+  uint16x8x2_t b[4] ;
+  uint32x4x2_t c ;
+  for (; j+16 <= bytes; j+=16){
+    for (unsigned int i=0; i < 8; i++) r[i] = i < rows?vld1q_u8(src + (i*stride) + j):vdupq_n_u8(0) ;
+    for (unsigned int i=0; i < 4; i++) a[i] = vzipq_u8(r[i*2], r[(i*2)+1]) ;
+    // Rows 0-3 and 4-7 for bytes 0-7 then 8-15
+    b[0] = vzipq_u16(vreinterpretq_u16_u8(a[0].val[0]), vreinterpretq_u16_u8(a[1].val[0])) ;
+    b[1] = vzipq_u16(vreinterpretq_u16_u8(a[0].val[1]), vreinterpretq_u16_u8(a[1].val[1])) ;
+    b[2] = vzipq_u16(vreinterpretq_u16_u8(a[2].val[0]), vreinterpretq_u16_u8(a[3].val[0])) ;
+    b[3] = vzipq_u16(vreinterpretq_u16_u8(a[2].val[1]), vreinterpretq_u16_u8(a[3].val[1])) ;
+    for (unsigned int i=0; i < 4; i++){
+      // Bytes 4i to 4i+3
+      c = vzipq_u32(vreinterpretq_u32_u16(b[i/2].val[i%2]), vreinterpretq_u32_u16(b[(i/2)+2].val[i%2])) ;
+      vst1q_u8(dst + (j*8) + (i*32), transposeBitsNEON(c.val[0])) ;
+      vst1q_u8(dst + (j*8) + (i*32) + 16, transposeBitsNEON(c.val[1])) ;
+    }
+  }
+  packPageScalar(src + j, stride, rows, dst + (j*8), bytes - j) ;
+}
+
+static void convertGreyFrom32NEON(const unsigned char *src, unsigned char *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    uint8x8x4_t px = vld4_u8(src + (i*4)) ;
+    uint16x8_t y = vmull_u8(px.val[0], vdup_n_u8(77)) ;
+    y = vmlal_u8(y, px.val[1], vdup_n_u8(150)) ;
+    y = vmlal_u8(y, px.val[2], vdup_n_u8(29)) ;
+    vst1_u8(dst + i, vrshrn_n_u16(y, 8)) ;
+  }
+  convertGreyScalar<PixelFormat32>(src + (i*4), dst + i, pixels - i) ;
+}
+
+static void convertGreyFrom24NEON(const unsigned char *src, unsigned char *dst, unsigned int pixels)
+{
+  unsigned int i = 0 ;
+  for (; i+8 <= pixels; i+=8){
+    uint8x8x3_t px = vld3_u8(src + (i*3)) ;
+    uint16x8_t y = vmull_u8(px.val[0], vdup_n_u8(77)) ;
+    y = vmlal_u8(y, px.val[1], vdup_n_u8(150)) ;
+    y = vmlal_u8(y, px.val[2], vdup_n_u8(29)) ;
+    vst1_u8(dst + i, vrshrn_n_u16(y, 8)) ;
+  }
+  convertGreyScalar<PixelFormat24>(src + (i*3), dst + i, pixels - i) ;
+}
+
+static void blendRowsNEON(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+			  unsigned char *dst, unsigned int start, unsigned int bytes)
+{
+  unsigned int i = start, t = 0 ;
+
+  for (; i+8 <= bytes; i+=8){
+    int32x4_t lo = vdupq_n_s32(1 << (SIMD_WEIGHT_BITS-1)) ;
+    int32x4_t hi = lo ;
+    for (t=0; t < taps; t++){
+      int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[t] + i))) ;
+      lo = vmlal_n_s16(lo, vget_low_s16(v), weights[t]) ;
+      hi = vmlal_n_s16(hi, vget_high_s16(v), weights[t]) ;
+    }
+    int16x8_t y = vcombine_s16(vshrn_n_s32(lo, SIMD_WEIGHT_BITS), vshrn_n_s32(hi, SIMD_WEIGHT_BITS)) ;
+    vst1_u8(dst + i, vqmovun_s16(y)) ;
+  }
+  blendRowsScalar(rows, weights, taps, dst, i, bytes) ;
+}
+
+static void scaleRowRGBANEON(const unsigned char *src, unsigned char *dst, unsigned int width,
+			     const unsigned int *index, const int16_t *weights, unsigned int taps)
+{
+  uint32_t px = 0 ;
+
+  for (unsigned int x=0; x < width; x++, index += taps, weights += taps){
+    int32x4_t acc = vdupq_n_s32(1 << (SIMD_WEIGHT_BITS-1)) ;
+    for (unsigned int t=0; t < taps; t++){
+      memcpy(&px, src + (index[t]*4), 4) ;
+      int16x4_t v = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(vcreate_u8(px)))) ;
+      acc = vmlal_n_s16(acc, v, weights[t]) ;
+    }
+    int16x4_t y = vshrn_n_s32(acc, SIMD_WEIGHT_BITS) ;
+    px = vget_lane_u32(vreinterpret_u32_u8(vqmovun_s16(vcombine_s16(y, y))), 0) ;
+    memcpy(dst + (x*4), &px, 4) ;
+  }
+}
+
+static inline uint8x8_t div255NEON(uint16x8_t x)
+{
+  x = vaddq_u16(x, vdupq_n_u16(128)) ;
+  return vshrn_n_u16(vsraq_n_u16(x, x, 8), 8) ;
+}
+
+// Composite 8 pixels at a time on planes from vld4. Straight alpha is
+// divided out with the scalar code so the results match.
+template <bool bStraight>
+static void compositeNEON(unsigned char *dst, const unsigned char *src, unsigned int pixels, const uint8_t *factors)
+{
+  unsigned int i = 0 ;
+  uint8x8_t ma = vdup_n_u8(factors[0]), xa = vdup_n_u8(factors[1]) ;
+  uint8x8_t mb = vdup_n_u8(factors[2]), xb = vdup_n_u8(factors[3]) ;
+
+  for (; i+8 <= pixels; i+=8){
+    uint8x8x4_t s = vld4_u8(src + (i*4)) ;
+    uint8x8x4_t d = vld4_u8(dst + (i*4)) ;
+    uint8x8_t fa = veor_u8(vand_u8(d.val[3], ma), xa) ;
+    uint8x8_t fb = veor_u8(vand_u8(s.val[3], mb), xb) ;
+    if (bStraight){
+      for (int c=0; c < 3; c++){
+	s.val[c] = div255NEON(vmull_u8(s.val[c], s.val[3])) ;
+	d.val[c] = div255NEON(vmull_u8(d.val[c], d.val[3])) ;
+      }
+    }
+    for (int c=0; c < 4; c++){
+      d.val[c] = vqadd_u8(div255NEON(vmull_u8(s.val[c], fa)), div255NEON(vmull_u8(d.val[c], fb))) ;
+    }
+    vst4_u8(dst + (i*4), d) ;
+    if (bStraight) unpremultiplyScalar(dst + (i*4), 8) ;
+  }
+  compositeScalar<bStraight>(dst + (i*4), src + (i*4), pixels - i, factors) ;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Runtime selection
+
+static SimdKernels selectKernels()
+{
+  SimdKernels k ;
+  const char *szForce = getenv("DISPLAYIMAGE_SIMD") ;
+  bool bScalar = szForce && strcmp(szForce, "scalar") == 0 ;
+
+  k.name = "scalar" ;
+  k.from32 = convert565Scalar<PixelFormat32> ;
+  k.from24 = convert565Scalar<PixelFormat24> ;
+  k.from16 = convert565Scalar<PixelFormat16> ;
+  k.from8 = convert565Scalar<PixelFormat8> ;
+  k.run = run565Scalar ;
+  k.grey32 = convertGreyScalar<PixelFormat32> ;
+  k.grey24 = convertGreyScalar<PixelFormat24> ;
+  k.grey16 = convertGreyScalar<PixelFormat16> ;
+  k.blend = blendRowsScalar ;
+  k.scaleRGBA = scaleRowScalar<4> ;
+  k.composite = compositeScalar<false> ;
+  k.compositeStraight = compositeScalar<true> ;
+  k.same = sameBytesScalar ;
+  k.sameBack = sameBytesBackScalar ;
+  k.packPage = packPageScalar ;
+  if (bScalar) return k ;
+
+#ifdef DISPLAY_SIMD_X86
+  __builtin_cpu_init() ;
+  if (__builtin_cpu_supports("sse2")){
+    // SSE2 has no byte shuffle so 24 bit stays scalar
+    k.name = "sse2" ;
+    k.from32 = convert565From32SSE2 ;
+    k.from16 = convert565From16SSE2 ;
+    k.from8 = convert565From8SSE2 ;
+    k.run = run565SSE2 ;
+    k.grey32 = convertGreyFrom32SSE2 ;
+    k.blend = blendRowsSSE2 ;
+    k.scaleRGBA = scaleRowRGBASSE2 ;
+    k.composite = compositeSSE2<false> ;
+    k.compositeStraight = compositeSSE2<true> ;
+    k.same = sameBytesSSE2 ;
+    k.sameBack = sameBytesBackSSE2 ;
+    k.packPage = packPageSSE2 ;
+  }
+  if (__builtin_cpu_supports("avx2") && !(szForce && strcmp(szForce, "sse2") == 0)){
+    k.name = "avx2" ;
+    k.from32 = convert565From32AVX2 ;
+    k.from24 = convert565From24AVX2 ;
+    k.from16 = convert565From16AVX2 ;
+    k.from8 = convert565From8AVX2 ;
+    k.run = run565AVX2 ;
+    k.grey32 = convertGreyFrom32AVX2 ;
+    k.grey24 = convertGreyFrom24AVX2 ;
+    k.blend = blendRowsAVX2 ;
+    k.composite = compositeAVX2<false> ;
+    k.compositeStraight = compositeAVX2<true> ;
+    k.same = sameBytesAVX2 ;
+    k.sameBack = sameBytesBackAVX2 ;
+  }
+#endif
+#ifdef DISPLAY_SIMD_NEON
+  k.name = "neon" ;
+  k.from32 = convert565From32NEON ;
+  k.from24 = convert565From24NEON ;
+  k.from16 = convert565From16NEON ;
+  k.from8 = convert565From8NEON ;
+  k.run = run565NEON ;
+  k.grey32 = convertGreyFrom32NEON ;
+  k.grey24 = convertGreyFrom24NEON ;
+  k.blend = blendRowsNEON ;
+  k.scaleRGBA = scaleRowRGBANEON ;
+  k.composite = compositeNEON<false> ;
+  k.compositeStraight = compositeNEON<true> ;
+  k.same = sameBytesNEON ;
+  k.sameBack = sameBytesBackNEON ;
+  k.packPage = packPageNEON ;
+#endif
+  return k ;
+}
+
+static const SimdKernels &kernels()
+{
+  static const SimdKernels k = selectKernels() ;
+  return k ;
+}
+
+bool simd565Convert(const unsigned char *src, unsigned int bitdepth, uint16_t *dst, unsigned int pixels)
+{
+  switch(bitdepth){
+  case 32:
+    kernels().from32(src, dst, pixels) ;
+    break ;
+  case 24:
+    kernels().from24(src, dst, pixels) ;
+    break ;
+  case 16:
+    kernels().from16(src, dst, pixels) ;
+    break ;
+  case 8:
+    kernels().from8(src, dst, pixels) ;
+    break ;
+  default:
+    return false ;
+  }
+  return true ;
+}
+
+bool simdGreyConvert(const unsigned char *src, unsigned int bitdepth, unsigned char *dst, unsigned int pixels)
+{
+  switch(bitdepth){
+  case 32:
+    kernels().grey32(src, dst, pixels) ;
+    break ;
+  case 24:
+    kernels().grey24(src, dst, pixels) ;
+    break ;
+  case 16:
+    kernels().grey16(src, dst, pixels) ;
+    break ;
+  case 8:
+    memcpy(dst, src, pixels) ;
+    break ;
+  default:
+    return false ;
+  }
+  return true ;
+}
+
+void simdBlendRows(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+		   unsigned char *dst, unsigned int bytes)
+{
+  kernels().blend(rows, weights, taps, dst, 0, bytes) ;
+}
+
+bool simdScaleRow(const unsigned char *src, unsigned int channels, unsigned char *dst, unsigned int width,
+		  const unsigned int *index, const int16_t *weights, unsigned int taps)
+{
+  switch(channels){
+  case 4:
+    kernels().scaleRGBA(src, dst, width, index, weights, taps) ;
+    break ;
+  case 1:
+    scaleRowScalar<1>(src, dst, width, index, weights, taps) ;
+    break ;
+  default:
+    return false ;
+  }
+  return true ;
+}
+
+unsigned int simd565Run(const uint16_t *p, uint16_t colour, unsigned int max)
+{
+  return kernels().run(p, colour, max) ;
+}
+
+unsigned int simdSameBytes(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  return kernels().same(a, b, max) ;
+}
+
+unsigned int simdSameBytesBack(const unsigned char *a, const unsigned char *b, unsigned int max)
+{
+  return kernels().sameBack(a, b, max) ;
+}
+
+void simdPackPage(const unsigned char *src, unsigned int stride, unsigned int rows,
+		  unsigned char *dst, unsigned int bytes)
+{
+  kernels().packPage(src, stride, rows, dst, bytes) ;
+}
+
+void simdCompositeRGBA(unsigned char *dst, const unsigned char *src, unsigned int pixels,
+		       const uint8_t *factors, bool bStraight)
+{
+  if (bStraight) kernels().compositeStraight(dst, src, pixels, factors) ;
+  else kernels().composite(dst, src, pixels, factors) ;
+}
+
+const char *simdName()
+{
+  return kernels().name ;
+}
@@ -0,0 +1,67 @@
+#ifndef __DISPLAYSIMD_HPP
+#define __DISPLAYSIMD_HPP
+
+#include <stdint.h>
+
+// Vector kernels used by DisplayImage. The instruction set is chosen at
+// runtime on first use: AVX2 or SSE2 on x86, NEON on ARM, otherwise a scalar
+// fallback. Set the environment variable DISPLAYIMAGE_SIMD to "scalar" to
+// force the fallback, or to "sse2" to use the SSE2 kernels on AVX2
+// hardware, when comparing results.
+
+// Convert pixels of an image buffer to host order RGB 565. bitdepth is the
+// depth of src and can be 32, 24, 16 or 8. Returns false if unsupported.
+bool simd565Convert(const unsigned char *src, unsigned int bitdepth, uint16_t *dst, unsigned int pixels) ;
+
+// Convert pixels of an image buffer to luminance grey using the toGrey
+// weights. bitdepth is the depth of src and can be 32, 24, 16 or 8.
+// Returns false if unsupported.
+bool simdGreyConvert(const unsigned char *src, unsigned int bitdepth, unsigned char *dst, unsigned int pixels) ;
+
+// Fixed point weights used by simdBlendRows sum to 1 << SIMD_WEIGHT_BITS
+#define SIMD_WEIGHT_BITS 14
+
+// Weighted sum of bytes in taps rows, rounded and written to dst. Weights
+// are not negative and sum to 1 << SIMD_WEIGHT_BITS. Used for the vertical
+// pass of scaling.
+void simdBlendRows(const unsigned char *const *rows, const int16_t *weights, unsigned int taps,
+		   unsigned char *dst, unsigned int bytes) ;
+
+// Horizontal pass of scaling for rows of 1 or 4 byte pixels. Channel c of
+// destination pixel x is the weighted sum of that channel in the taps source
+// pixels listed at index[x*taps], using the weights at weights[x*taps] which
+// sum to 1 << SIMD_WEIGHT_BITS. Returns false if channels is unsupported.
+bool simdScaleRow(const unsigned char *src, unsigned int channels, unsigned char *dst, unsigned int width,
+		  const unsigned int *index, const int16_t *weights, unsigned int taps) ;
+
+// Count how many values at the start of p equal colour, checking no more
+// than max values. Used to find RLE runs.
+unsigned int simd565Run(const uint16_t *p, uint16_t colour, unsigned int max) ;
+
+// Count how many bytes at the start of a equal those at the start of b,
+// checking no more than max. Used to find what changed between frames.
+unsigned int simdSameBytes(const unsigned char *a, const unsigned char *b, unsigned int max) ;
+
+// As simdSameBytes but counting back from a + max and b + max
+unsigned int simdSameBytesBack(const unsigned char *a, const unsigned char *b, unsigned int max) ;
+
+// Pack up to 8 rows of a 1 bit image into a page of an SSD1306 style
+// panel. Each of the first bytes bytes of the rows, stride apart, holds 8
+// columns lowest bit first and becomes 8 bytes of dst, one per column with
+// the first row in bit 0. Rows past rows are taken as zero.
+void simdPackPage(const unsigned char *src, unsigned int stride, unsigned int rows,
+		  unsigned char *dst, unsigned int bytes) ;
+
+// Porter-Duff composite of 32 bit RGBA src pixels onto dst. The source is
+// weighted by (dst alpha & factors[0]) ^ factors[1] and the destination by
+// (src alpha & factors[2]) ^ factors[3], with each factor 0 or 255, which
+// describes every operator. With bStraight the colours are multiplied by
+// alpha for the operation and divided out of the result, otherwise both are
+// taken to be premultiplied.
+void simdCompositeRGBA(unsigned char *dst, const unsigned char *src, unsigned int pixels,
+		       const uint8_t *factors, bool bStraight) ;
+
+// Name of the instruction set in use
+const char *simdName() ;
+
+#endif
@@ -0,0 +1,222 @@
+#include "displayswap.hpp"
+#include "displaysimd.hpp"
+#include <stdio.h>
+#include <string.h>
+
+// m_state holds the newest presented buffer, the buffer last acquired and
+// whether the newest has been acquired yet, so both change in one step
+#define SWAP_FRONT(s) ((s) & 3)
+#define SWAP_SHOWN(s) (((s) >> 2) & 3)
+#define SWAP_FRESH 16
+
+static bool rectsTouch(const DisplayRect &a, const DisplayRect &b)
+{
+  return a.x0 <= b.x1+1 && b.x0 <= a.x1+1 && a.y0 <= b.y1+1 && b.y0 <= a.y1+1 ;
+}
+
+static void rectUnion(DisplayRect &a, const DisplayRect &b)
+{
+  if (b.x0 < a.x0) a.x0 = b.x0 ;
+  if (b.y0 < a.y0) a.y0 = b.y0 ;
+  if (b.x1 > a.x1) a.x1 = b.x1 ;
+  if (b.y1 > a.y1) a.y1 = b.y1 ;
+}
+
+static unsigned int rectArea(const DisplayRect &a)
+{
+  return (a.x1 - a.x0 + 1) * (a.y1 - a.y0 + 1) ;
+}
+
+// Add r to the n windows, merging as DisplayImage::markDirty does
+static void addWindow(DisplayRect *windows, unsigned int &n, DisplayRect r)
+{
+  unsigned int i = 0 ;
+
+  for (i=0; i < n; i++){
+    if (r.x0 >= windows[i].x0 && r.x1 <= windows[i].x1 &&
+	r.y0 >= windows[i].y0 && r.y1 <= windows[i].y1) return ;
+  }
+
+  i = 0 ;
+  while (i < n){
+    if (rectsTouch(r, windows[i])){
+      rectUnion(r, windows[i]) ;
+      windows[i] = windows[--n] ;
+      i = 0 ;
+    }else{
+      i++ ;
+    }
+  }
+
+  if (n < DISPLAYSWAP_MAX_WINDOWS){
+    windows[n++] = r ;
+    return ;
+  }
+
+  // Full. Merge with the window which grows the least
+  unsigned int best = 0, bestgrowth = 0xFFFFFFFF ;
+  for (i=0; i < n; i++){
+    DisplayRect u = windows[i] ;
+    rectUnion(u, r) ;
+    unsigned int growth = rectArea(u) - rectArea(windows[i]) ;
+    if (growth < bestgrowth){
+      bestgrowth = growth ;
+      best = i ;
+    }
+  }
+  rectUnion(r, windows[best]) ;
+  windows[best] = windows[--n] ;
+  addWindow(windows, n, r) ;
+}
+
+DisplaySwapChain::DisplaySwapChain()
+{
+  m_nBuffers = 0 ;
+  m_back = 0 ;
+  m_bFirst = true ;
+  memset(m_nWindows, 0, sizeof(m_nWindows)) ;
+  m_state = 1 | (1 << 2) ;
+}
+
+bool DisplaySwapChain::create(unsigned int width, unsigned int height, unsigned int bitdepth, unsigned int buffers)
+{
+  if (buffers < 2 || buffers > DISPLAYSWAP_MAX_BUFFERS){
+    fprintf(stderr, "Swap chain needs 2 or %d buffers, not %u\n", DISPLAYSWAP_MAX_BUFFERS, buffers) ;
+    return false ;
+  }
+  for (unsigned int i=0; i < buffers; i++){
+    if (!m_buffers[i].createImage(width, height, bitdepth)) return false ;
+    m_nWindows[i] = 0 ;
+  }
+  m_nBuffers = buffers ;
+  m_back = 0 ;
+  m_bFirst = true ;
+  // Front and acquired are both buffer 1, which leaves buffer 2 as the next
+  // back buffer with three
+  m_state = 1 | (1 << 2) ;
+  return true ;
+}
+
+unsigned int DisplaySwapChain::diff(const DisplayImage &frame, const DisplayImage &previous, DisplayRect *windows)
+{
+  unsigned int n = 0 ;
+  DisplayRect r ;
+
+  if (!frame.m_img) return 0 ;
+  if (!previous.m_img || frame.m_width != previous.m_width || frame.m_height != previous.m_height ||
+      frame.m_colourbitdepth != previous.m_colourbitdepth){
+    r.x0 = r.y0 = 0 ;
+    r.x1 = frame.m_width - 1 ;
+    r.y1 = frame.m_height - 1 ;
+    windows[n++] = r ;
+    return n ;
+  }
+
+  unsigned int bits = frame.m_colourbitdepth ;
+  unsigned int bytes = (frame.m_width * bits + 7) / 8 ; // used bytes of a row
+  unsigned int x = 0, start = 0, end = 0, block = 0, same = 0 ;
+
+  for (unsigned int y=0; y < frame.m_height; y++){
+    const unsigned char *a = frame.m_img + y*frame.m_stride ;
+    const unsigned char *b = previous.m_img + y*previous.m_stride ;
+    x = 0 ;
+    while (x < bytes){
+      x += simdSameBytes(a + x, b + x, bytes - x) ;
+      if (x >= bytes) break ;
+
+      // Grow the span while another change is less than DISPLAYSWAP_GAP
+      // bytes past its end
+      start = x ;
+      end = x + 1 ;
+      while (end < bytes){
+	block = bytes - end < DISPLAYSWAP_GAP ? bytes - end : DISPLAYSWAP_GAP ;
+	same = simdSameBytesBack(a + end, b + end, block) ;
+	if (same == block) break ;
+	end += block - same ;
+      }
+      x = end ;
+
+      if (bits == 1){
+	// Down to the pixels which changed in the end bytes
+	r.x0 = start*8 + __builtin_ctz(a[start] ^ b[start]) ;
+	r.x1 = (end-1)*8 + 31 - __builtin_clz(a[end-1] ^ b[end-1]) ;
+	r.y0 = y & ~7 ;
+	r.y1 = r.y0 + 7 ;
+	if (r.y1 >= (int)frame.m_height) r.y1 = frame.m_height - 1 ;
+      }else{
+	r.x0 = start / (bits/8) ;
+	r.x1 = (end-1) / (bits/8) ;
+	r.y0 = r.y1 = y ;
+      }
+      if (r.x0 >= (int)frame.m_width) continue ; // padding bits of the row
+      if (r.x1 >= (int)frame.m_width) r.x1 = frame.m_width - 1 ;
+      addWindow(windows, n, r) ;
+    }
+  }
+  return n ;
+}
+
+void DisplaySwapChain::syncFrame(DisplayImage &dst, const DisplayImage &src)
+{
+  unsigned int bytes = (src.m_width * src.m_colourbitdepth + 7) / 8 ;
+  const unsigned char *s = src.m_img ;
+  unsigned char *d = dst.m_img ;
+  unsigned int first = 0, last = 0 ;
+
+  for (unsigned int y=0; y < src.m_height; y++, s += src.m_stride, d += dst.m_stride){
+    first = simdSameBytes(d, s, bytes) ;
+    if (first == bytes) continue ;
+    last = bytes - simdSameBytesBack(d, s, bytes) ;
+    memcpy(d + first, s + first, last - first) ;
+  }
+}
+
+void DisplaySwapChain::present(bool bKeep)
+{
+  if (m_nBuffers == 0) return ;
+
+  unsigned int state = m_state.load(std::memory_order_acquire) ;
+  unsigned int front = SWAP_FRONT(state), next = 0, newstate = 0 ;
+  DisplayRect *windows = m_windows[m_back] ;
+  unsigned int &n = m_nWindows[m_back] ;
+
+  if (m_bFirst){
+    windows[0].x0 = windows[0].y0 = 0 ;
+    windows[0].x1 = m_buffers[m_back].get_width() - 1 ;
+    windows[0].y1 = m_buffers[m_back].get_height() - 1 ;
+    n = 1 ;
+    m_bFirst = false ;
+  }else{
+    n = diff(m_buffers[m_back], m_buffers[front], windows) ;
+    // The driver has not taken the last frame so still needs its changes.
+    // If it takes it now the windows are more than needed, never less.
+    if (state & SWAP_FRESH){
+      for (unsigned int i=0; i < m_nWindows[front]; i++) addWindow(windows, n, m_windows[front][i]) ;
+    }
+  }
+
+  do{
+    // With three buffers draw next into the one which is neither presented
+    // nor held by the driver
+    next = m_nBuffers == 2 ? front : 3 - m_back - SWAP_SHOWN(state) ;
+    newstate = m_back | (SWAP_SHOWN(state) << 2) | SWAP_FRESH ;
+  }while (!m_state.compare_exchange_weak(state, newstate, std::memory_order_acq_rel)) ;
+
+  if (bKeep) syncFrame(m_buffers[next], m_buffers[m_back]) ;
+  m_back = next ;
+  m_buffers[m_back].clearDirty() ;
+}
+
+const DisplayImage *DisplaySwapChain::acquire(const DisplayRect **windows, unsigned int *count)
+{
+  unsigned int state = m_state.load(std::memory_order_acquire), front = 0 ;
+
+  do{
+    if (!(state & SWAP_FRESH)) return NULL ;
+    front = SWAP_FRONT(state) ;
+  }while (!m_state.compare_exchange_weak(state, front | (front << 2), std::memory_order_acq_rel)) ;
+
+  if (windows) *windows = m_windows[front] ;
+  if (count) *count = m_nWindows[front] ;
+  return &m_buffers[front] ;
+}
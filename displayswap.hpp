@@ -0,0 +1,75 @@
+#ifndef __DISPLAYSWAP_HPP
+#define __DISPLAYSWAP_HPP
+
+#include "displayimage.hpp"
+#include <atomic>
+
+// Most buffers in a swap chain and update windows listed for a frame
+#define DISPLAYSWAP_MAX_BUFFERS 3
+#define DISPLAYSWAP_MAX_WINDOWS 16
+
+// Unchanged bytes in a row which are sent as part of a window rather than
+// splitting it in two, as starting a window costs a few bytes of commands
+#define DISPLAYSWAP_GAP 16
+
+// Two or three frames for a panel which is only sent what has changed.
+// Draw the next frame into getBack() and call present(). The new frame is
+// compared with the last one and the changes listed as windows, the
+// rectangles a driver has to send to bring the panel up to date. A driver
+// calls acquire() for the newest frame and its windows. Windows of frames
+// presented since the last acquire are included, so skipped frames are not
+// lost.
+// Present is atomic, so acquire returns a whole frame with its windows and
+// never one being drawn. With two buffers the acquired frame becomes the back
+// buffer at the next present, so it must be sent first, such as by calling
+// present and acquire from one thread. With three buffers present never
+// touches the acquired frame, so a driver thread can send it while the next
+// frame is drawn. Only one thread should call acquire.
+class DisplaySwapChain{
+public:
+  DisplaySwapChain() ;
+
+  // Create buffers blank frames of width, height and bitdepth. buffers can
+  // be 2 or 3. The first frame presented is one window covering the whole
+  // image as the panel could be showing anything. Returns false if the
+  // frames cannot be created.
+  bool create(unsigned int width, unsigned int height, unsigned int bitdepth, unsigned int buffers = 2) ;
+
+  // Frame to draw into
+  DisplayImage &getBack(){return m_buffers[m_back];};
+
+  // Make the back buffer the newest frame and list its windows. With bKeep
+  // the new back buffer is brought up to date with the presented frame so
+  // drawing can carry on from it, otherwise it holds an older frame to be
+  // redrawn.
+  void present(bool bKeep = true) ;
+
+  // Take the newest presented frame, or NULL if there has been no present
+  // since the last call. windows and count are set to the areas which
+  // changed since the last frame taken. Both stay valid until the next
+  // acquire.
+  const DisplayImage *acquire(const DisplayRect **windows, unsigned int *count) ;
+
+  // List the areas where frame differs from previous in windows, which holds
+  // DISPLAYSWAP_MAX_WINDOWS. Windows are disjoint and changed bytes less
+  // than DISPLAYSWAP_GAP apart on a row share a window. Windows of 1 bit
+  // frames cover whole pages, 8 rows starting on a multiple of 8, as 1 bit
+  // panels are written a page at a time. frame is one window if the frames
+  // differ in size or depth. Returns the number of windows.
+  static unsigned int diff(const DisplayImage &frame, const DisplayImage &previous, DisplayRect *windows) ;
+
+protected:
+  // Copy the bytes of each row of src which differ from dst, which is the
+  // same size and depth
+  static void syncFrame(DisplayImage &dst, const DisplayImage &src) ;
+
+  DisplayImage m_buffers[DISPLAYSWAP_MAX_BUFFERS] ;
+  unsigned int m_nBuffers ;
+  unsigned int m_back ; // only changed by present
+  bool m_bFirst ; // nothing presented since create
+  DisplayRect m_windows[DISPLAYSWAP_MAX_BUFFERS][DISPLAYSWAP_MAX_WINDOWS] ;
+  unsigned int m_nWindows[DISPLAYSWAP_MAX_BUFFERS] ;
+  std::atomic<unsigned int> m_state ; // front and acquired buffers
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __PIXELFORMAT_HPP
+#define __PIXELFORMAT_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+// Conversion to and from RGB 565 colour
+#define to565(r,g,b)                                            \
+  ((((r) >> 3) << 11) | (((g) >> 2) << 5) | ((b) >> 3))
+
+#define from565_r(x) ((((x) >> 11) & 0x1f) * 255 / 31)
+#define from565_g(x) ((((x) >> 5) & 0x3f) * 255 / 63)
+#define from565_b(x) (((x) & 0x1f) * 255 / 31)
+
+// Luminance weighted grey (ITU-R BT.601) with weights summing to 256
+#define toGrey(r,g,b)                                           \
+  ((((r) * 77) + ((g) * 150) + ((b) * 29) + 128) >> 8)
+
+// Transpose an 8x8 matrix of bits where bit 8*i+j is row i, column j
+static inline uint64_t transposeBits(uint64_t x)
+{
+  uint64_t t = 0 ;
+
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL ;
+  x = x ^ t ^ (t << 7) ;
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL ;
+  x = x ^ t ^ (t << 14) ;
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL ;
+  x = x ^ t ^ (t << 28) ;
+  return x ;
+}
+
+// Pixel format policies. Each policy describes how one pixel is held in
+// DisplayImage::m_img so image kernels can be instantiated for each colour depth.
+// The depth is then resolved once per call instead of once per pixel.
+//
+// bits        - colour bit depth
+// bytes       - bytes used by one pixel (0 for packed 1 bit images)
+// put()       - write a pixel pattern from DisplayImage::getPixelPattern to column x of a row
+// getRGB()    - read a pixel as red, green and blue
+// putRGB()    - write a pixel from red, green and blue. Alpha is opaque.
+// getGrey()   - read a pixel as luminance grey
+// get565()    - read a pixel as RGB 565
+
+struct PixelFormat1{
+  enum{ bits = 1, bytes = 0 } ;
+  static inline void put(unsigned char *row, unsigned int x, const unsigned char *pattern){
+    if (pattern[0]) row[x/8] |= 1 << (x%8) ;
+    else row[x/8] &= ~(1 << (x%8)) ;
+  }
+};
+
+struct PixelFormat8{
+  enum{ bits = 8, bytes = 1 } ;
+  static inline void put(unsigned char *row, unsigned int x, const unsigned char *pattern){
+    row[x] = pattern[0] ;
+  }
+  static inline void getRGB(const unsigned char *p, unsigned char *rgb){
+    rgb[0] = rgb[1] = rgb[2] = p[0] ;
+  }
+  static inline void putRGB(unsigned char *p, const unsigned char *rgb){
+    p[0] = toGrey(rgb[0], rgb[1], rgb[2]) ;
+  }
+  static inline unsigned char getGrey(const unsigned char *p){
+    return p[0] ;
+  }
+  static inline uint16_t get565(const unsigned char *p){
+    return to565(p[0], p[0], p[0]) ;
+  }
+};
+
+// 16 bit pixels are stored as RGB 565 with the high byte first
+struct PixelFormat16{
+  enum{ bits = 16, bytes = 2 } ;
+  static inline void put(unsigned char *row, unsigned int x, const unsigned char *pattern){
+    memcpy(row + x*2, pattern, 2) ;
+  }
+  static inline void getRGB(const unsigned char *p, unsigned char *rgb){
+    uint16_t n16bit = (p[0] << 8) | p[1] ;
+    rgb[0] = from565_r(n16bit) ;
+    rgb[1] = from565_g(n16bit) ;
+    rgb[2] = from565_b(n16bit) ;
+  }
+  static inline void putRGB(unsigned char *p, const unsigned char *rgb){
+    uint16_t n16bit = to565(rgb[0], rgb[1], rgb[2]) ;
+    p[0] = n16bit >> 8 ;
+    p[1] = 0x00FF & n16bit ;
+  }
+  static inline unsigned char getGrey(const unsigned char *p){
+    unsigned char rgb[3] ;
+    getRGB(p, rgb) ;
+    return toGrey(rgb[0], rgb[1], rgb[2]) ;
+  }
+  static inline uint16_t get565(const unsigned char *p){
+    return (p[0] << 8) | p[1] ;
+  }
+};
+
+struct PixelFormat24{
+  enum{ bits = 24, bytes = 3 } ;
+  static inline void put(unsigned char *row, unsigned int x, const unsigned char *pattern){
+    memcpy(row + x*3, pattern, 3) ;
+  }
+  static inline void getRGB(const unsigned char *p, unsigned char *rgb){
+    rgb[0] = p[0] ;
+    rgb[1] = p[1] ;
+    rgb[2] = p[2] ;
+  }
+  static inline void putRGB(unsigned char *p, const unsigned char *rgb){
+    p[0] = rgb[0] ;
+    p[1] = rgb[1] ;
+    p[2] = rgb[2] ;
+  }
+  static inline unsigned char getGrey(const unsigned char *p){
+    return toGrey(p[0], p[1], p[2]) ;
+  }
+  static inline uint16_t get565(const unsigned char *p){
+    return to565(p[0], p[1], p[2]) ;
+  }
+};
+
+// RGBA. Pixels converted from other depths are opaque.
+struct PixelFormat32{
+  enum{ bits = 32, bytes = 4 } ;
+  static inline void put(unsigned char *row, unsigned int x, const unsigned char *pattern){
+    memcpy(row + x*4, pattern, 4) ;
+  }
+  static inline void getRGB(const unsigned char *p, unsigned char *rgb){
+    rgb[0] = p[0] ;
+    rgb[1] = p[1] ;
+    rgb[2] = p[2] ;
+  }
+  static inline void putRGB(unsigned char *p, const unsigned char *rgb){
+    p[0] = rgb[0] ;
+    p[1] = rgb[1] ;
+    p[2] = rgb[2] ;
+    p[3] = 255 ;
+  }
+  static inline unsigned char getGrey(const unsigned char *p){
+    return toGrey(p[0], p[1], p[2]) ;
+  }
+  static inline uint16_t get565(const unsigned char *p){
+    return to565(p[0], p[1], p[2]) ;
+  }
+};
+
+#endif
@@ -2,20 +2,23 @@
 #include <ftbitmap.h>
 #include <stdio.h>
 #include <stdint.h>
+#include "displayformat.hpp"
 
 #include FT_FREETYPE_H
 //#include FT_OUTLINE_H
 #include FT_BITMAP_H
 
 #define INFOSWITCH "-info"
+#define COMPRESSSWITCH "-c"
 
 int initialiseparam(int argc, char **argv, bool *bSetInfo, char **pSource, FILE **fout)
 {
   FILE *fin = NULL ;
   
   if (argc <= 1 || argc > 3){
-    printf("Usage: psf2bin font.psf [-info] [output.bin]\n\tOptional output file, otherwise outputs to stdout\n");
+    printf("Usage: psf2bin [-c] font.psf [-info] [output.bin]\n\tOptional output file, otherwise outputs to stdout\n");
     printf("\t-info can be used with a font file to query the font to be converted\n") ;
+    printf("\t-c compresses the font image\n") ;
     return -1 ;
   }
 
@@ -117,24 +120,21 @@ unsigned int writeBitmap(FT_Bitmap bm, unsigned char *pbuff)
   return stride * bm.rows ;
 }
  
-bool outputFontBitmap(FILE *f, FT_Short width, FT_Short height, unsigned char *pFontImage)
+bool outputFontBitmap(FILE *f, FT_Short width, FT_Short height, unsigned char *pFontImage, bool bCompress)
 {
-  char sig[] = "FNT" ;
-  uint32_t chars = 256 ;
-  uint32_t nWidth = width ;
-  uint32_t nHeight = height ;
-  // Write header
-  if (fwrite(sig, 1,3,f) <= 0) return false ;
-  if (fwrite(&chars, sizeof(uint32_t),1,f) <= 0) return false ;
-  if (fwrite(&nWidth, sizeof(uint32_t),1,f) <= 0) return false ;
-  if (fwrite(&nHeight, sizeof(uint32_t),1,f) <= 0) return false ;
-
-  uint32_t image_buffer_size = (width/8 + (width%8?1:0)) * height * 256 ;
-
-  // Write body
-  if (fwrite(pFontImage, sizeof(unsigned char),image_buffer_size,f) <= 0) return false ;
-
-  return true ;
+  DisplayFormatHeader hdr ;
+
+  hdr.version = DISPLAYFORMAT_VERSION ;
+  hdr.type = DISPLAYFORMAT_FONT ;
+  hdr.width = width ;
+  hdr.height = height ;
+  hdr.bitdepth = 1 ;
+  hdr.chars = 256 ;
+  hdr.stride = width/8 + (width%8?1:0) ;
+  hdr.size = hdr.stride * height * hdr.chars ;
+
+  // Write header and body
+  return displayFormatWrite(f, hdr, pFontImage, bCompress) ;
 }
  
 int main(int argc , char **argv)
@@ -150,6 +150,14 @@ int main(int argc , char **argv)
   unsigned char *pFontImage = NULL ;
   FT_Short bitmap_width = 0, bitmap_height = 0 ;
   int byteswritten = 0 ;
+  bool bCompress = false ;
+
+  if (argc > 1 && strcmp(argv[1], COMPRESSSWITCH) == 0){
+    // Drop the switch from the parameters
+    bCompress = true ;
+    argc-- ;
+    argv++ ;
+  }
 
   ret = initialiseparam(argc, argv, &bInfo, &szSource, &fout) ;
   if (ret < 0) return ret;
@@ -234,7 +242,7 @@ int main(int argc , char **argv)
     FT_Bitmap_Done(library, &charbitmap);
   }
 
-  if (!outputFontBitmap(fout, bitmap_width, bitmap_height, pFontImage)){
+  if (!outputFontBitmap(fout, bitmap_width, bitmap_height, pFontImage, bCompress)){
     fprintf(stderr, "Failed to write image to output\n") ;
     return -1 ;
   }
@@ -0,0 +1,160 @@
+#include "../displaylist.hpp"
+#include "../displayswap.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+// DisplayList replay must draw exactly what the direct calls draw, and a
+// threaded replay exactly what a replay on one thread draws, including many
+// small damaged areas sharing tiles and the bytes of 1 bit images.
+
+// Draw a random scene on target, a DisplayList or a DisplayImage, so the same
+// seed gives the same calls on either. sprite has the depth of the scene and
+// rgba is 32 bit.
+template <class T>
+static void record(T &target, int width, int height, const DisplayImage &sprite, const DisplayImage &rgba)
+{
+  DisplayPoint points[5] ;
+
+  for (int i=0; i < 200; i++){
+    target.setFGCol(rand(), rand(), rand(), 255) ;
+    target.setBGCol(rand(), rand(), rand(), 255) ;
+    target.setFGGrey(rand()) ;
+    target.setBGGrey(rand()) ;
+    int x = rand()%width, y = rand()%height ;
+    switch(rand() % 14){
+    case 0:
+      target.drawRect(x - 64, y - 64, rand()%256, rand()%256, rand()%2) ;
+      break ;
+    case 1:
+      target.drawLine(x, y, rand()%width, rand()%height) ;
+      break ;
+    case 2:
+      target.drawCircle(x, y, rand()%60, rand()%2) ;
+      break ;
+    case 3:
+      target.drawLineAA(x, y, rand()%width, rand()%height) ;
+      break ;
+    case 4:
+      target.drawEllipse(x, y, rand()%80, rand()%40, rand()%2) ;
+      break ;
+    case 5:
+      target.drawArc(x, y, rand()%80, rand()%80, rand()%360, rand()%360) ;
+      break ;
+    case 6:
+      target.drawRoundRect(x - 32, y - 32, rand()%128, rand()%128, rand()%20, rand()%2) ;
+      break ;
+    case 7:
+      for (int p=0; p < 5; p++){
+	points[p].x = rand()%(width + 64) - 32 ;
+	points[p].y = rand()%(height + 64) - 32 ;
+      }
+      target.drawPolygon(points, 3 + rand()%3, rand()%2) ;
+      break ;
+    case 8:
+      target.drawCircleAA(x, y, rand()%60) ;
+      break ;
+    case 9:
+      target.drawEllipseAA(x, y, rand()%80, rand()%40) ;
+      break ;
+    case 10:
+      target.copy(sprite, rand()%3, x - 32, y - 32) ;
+      break ;
+    case 11:
+      target.composite(rgba, rand()%(DISPLAY_PD_PLUS + 1), x - 32, y - 32) ;
+      break ;
+    case 12:
+      if (rand()%8 == 0) target.eraseBackground() ;
+      break ;
+    default:
+      target.drawRect(x, y, rand()%32, rand()%32, true) ;
+      break ;
+    }
+  }
+}
+
+int main()
+{
+  const unsigned int depths[] = {1, 8, 16, 24, 32} ;
+  const int width = 256, height = 256 ;
+  DisplayRect damage[256], windows[DISPLAYSWAP_MAX_WINDOWS] ;
+  int fails = 0 ;
+
+  // Sources for copy and composite with a little of everything in them
+  DisplayImage sprites[5], rgba ;
+  rgba.createImage(64, 64, 32) ;
+  srand(2) ;
+  for (int i=0; i < 40; i++){
+    rgba.setFGCol(rand(), rand(), rand(), rand()) ;
+    rgba.drawRect(rand()%64, rand()%64, rand()%32, rand()%32, true) ;
+  }
+  for (int d=0; d < 5; d++){
+    sprites[d].createImage(64, 64, depths[d]) ;
+    for (int i=0; i < 40; i++){
+      sprites[d].setFGCol(rand(), rand(), rand(), 255) ;
+      sprites[d].setFGGrey(rand()) ;
+      sprites[d].drawCircle(rand()%64, rand()%64, rand()%20, rand()%2) ;
+    }
+  }
+
+  for (int run=0; run < 300; run++){
+    unsigned int bits = depths[run % 5] ;
+    DisplayImage direct, expected, one, many ;
+    DisplayList list ;
+
+    if (!direct.createImage(width, height, bits) || !expected.createImage(width, height, bits) ||
+	!one.createImage(width, height, bits) || !many.createImage(width, height, bits)){
+      fprintf(stderr, "Cannot create %u bit images\n", bits) ;
+      return 1 ;
+    }
+    srand(run) ;
+    record(list, width, height, sprites[run % 5], rgba) ;
+    srand(run) ;
+    record(direct, width, height, sprites[run % 5], rgba) ;
+
+    // One pixel wide strips so many areas fall in each tile. Only the
+    // strips of the direct drawing are expected.
+    for (int i=0; i < 256; i++){
+      damage[i].x0 = damage[i].x1 = i ;
+      damage[i].y0 = rand() % 16 ;
+      damage[i].y1 = height - 1 - rand() % 16 ;
+      expected.setClip(&damage[i]) ;
+      expected.copy(direct) ;
+    }
+    list.replay(one, damage, 256) ;
+    list.replay(many, damage, 256, 8) ;
+    if (DisplaySwapChain::diff(one, expected, windows) != 0){
+      fprintf(stderr, "Run %d: replay of %u bit image differs from drawing directly\n", run, bits) ;
+      fails++ ;
+    }
+    if (DisplaySwapChain::diff(many, expected, windows) != 0){
+      fprintf(stderr, "Run %d: threaded replay of %u bit image differs from drawing directly\n", run, bits) ;
+      fails++ ;
+    }
+  }
+
+  // Composite only draws on 32 bit images, so it cannot hide what is under
+  // it on other depths
+  for (int d=0; d < 5; d++){
+    DisplayImage direct, replayed ;
+    DisplayList list ;
+
+    direct.createImage(width, height, depths[d]) ;
+    replayed.createImage(width, height, depths[d]) ;
+    direct.setFGCol(200, 100, 50, 255) ;
+    direct.setFGGrey(200) ;
+    direct.drawRect(10, 10, 30, 30, true) ;
+    direct.composite(rgba, DISPLAY_PD_SRC, 0, 0) ;
+    list.setFGCol(200, 100, 50, 255) ;
+    list.setFGGrey(200) ;
+    list.drawRect(10, 10, 30, 30, true) ;
+    list.composite(rgba, DISPLAY_PD_SRC, 0, 0) ;
+    list.replay(replayed) ;
+    if (DisplaySwapChain::diff(replayed, direct, windows) != 0){
+      fprintf(stderr, "Replay under a composite of %u bit image differs\n", depths[d]) ;
+      fails++ ;
+    }
+  }
+
+  printf("%s\n", fails?"FAILED":"passed") ;
+  return fails?1:0 ;
+}
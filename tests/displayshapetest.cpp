@@ -0,0 +1,90 @@
+#include "../displayimage.hpp"
+#include "../displayswap.hpp"
+#include <stdio.h>
+#include <limits.h>
+
+// Shapes with radii far larger than the image only work out the rows they
+// draw and test pixels exactly, so they match spans drawn from an exact
+// test and finish quickly. Lines and polygons with ends across the whole int
+// range draw the same pixels as their parts inside the image.
+
+// Largest x from the centre of row y inside a circle of radius r, using
+// radii grown by half a pixel
+static int circleWidth(int64_t r, int64_t y)
+{
+  unsigned __int128 d = 2*r + 1, x = 0 ;
+
+  if (y > r) return -1 ;
+  while (x < (unsigned __int128)r && 4*(x+1)*(x+1) + 4*(unsigned __int128)(y*y) <= d*d) x++ ;
+  return (int)x ;
+}
+
+int main()
+{
+  const int size = 200 ;
+  DisplayRect windows[DISPLAYSWAP_MAX_WINDOWS] ;
+  int fails = 0 ;
+
+  // Fill of a circle with its edge crossing the image, centre off to the
+  // right
+  DisplayImage drawn, expected ;
+  drawn.createImage(size, size, 8) ;
+  expected.createImage(size, size, 8) ;
+  drawn.drawCircle(40100, 100, 40000, true) ;
+  for (int y=0; y < size; y++){
+    int w = circleWidth(40000, y < 100?100-y:y-100) ;
+    if (w >= 0) expected.drawLine(40100 - w, y, 40100 + w, y) ;
+  }
+  if (DisplaySwapChain::diff(drawn, expected, windows) != 0){
+    fprintf(stderr, "Filled circle of radius 40000 differs\n") ;
+    fails++ ;
+  }
+
+  // The largest radius covers the whole image when filled and misses it as
+  // an outline or arc
+  DisplayImage all, none ;
+  all.createImage(size, size, 8) ;
+  none.createImage(size, size, 8) ;
+  expected.createImage(size, size, 8) ;
+  all.drawCircle(100, 100, UINT_MAX, true) ;
+  for (int y=0; y < size; y++) expected.drawLine(0, y, size-1, y) ;
+  if (DisplaySwapChain::diff(all, expected, windows) != 0){
+    fprintf(stderr, "Filled circle of the largest radius does not cover the image\n") ;
+    fails++ ;
+  }
+  if (none.drawCircle(100, 100, UINT_MAX) || none.drawArc(100, 100, UINT_MAX, UINT_MAX, 0, 270)){
+    fprintf(stderr, "Outline of the largest radius drew inside the image\n") ;
+    fails++ ;
+  }
+
+  // The diagonal from corner to corner of the int range
+  DisplayImage line ;
+  line.createImage(size, size, 8) ;
+  expected.createImage(size, size, 8) ;
+  line.drawLine(INT_MIN, INT_MIN, INT_MAX, INT_MAX) ;
+  expected.drawLine(0, 0, size-1, size-1) ;
+  if (DisplaySwapChain::diff(line, expected, windows) != 0){
+    fprintf(stderr, "Line across the int range differs\n") ;
+    fails++ ;
+  }
+  if (!line.drawLineAA(INT_MIN, 0, INT_MAX, 150)){
+    fprintf(stderr, "Anti-aliased line across the int range drew nothing\n") ;
+    fails++ ;
+  }
+
+  // Triangles sharing the diagonal fill the same pixels of the image
+  const DisplayPoint huge[] = {{INT_MIN, INT_MIN}, {INT_MAX, INT_MIN}, {INT_MAX, INT_MAX}} ;
+  const DisplayPoint small[] = {{0, 0}, {size, 0}, {size, size}} ;
+  DisplayImage poly ;
+  poly.createImage(size, size, 8) ;
+  expected.createImage(size, size, 8) ;
+  poly.drawPolygon(huge, 3, true) ;
+  expected.drawPolygon(small, 3, true) ;
+  if (DisplaySwapChain::diff(poly, expected, windows) != 0){
+    fprintf(stderr, "Polygon across the int range differs\n") ;
+    fails++ ;
+  }
+
+  printf("%s\n", fails?"FAILED":"passed") ;
+  return fails?1:0 ;
+}
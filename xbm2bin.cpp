@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include "displayformat.hpp"
 
 #define MAX_NUM_BUF 20
+#define COMPRESSSWITCH "-c"
 
 class Token{
 public:
@@ -51,8 +54,17 @@ unsigned char hexToByte(char *szHex)
 
 int main (int argc, char **argv)
 {
+  bool bCompress = false ;
+  if (argc > 1 && strcmp(argv[1], COMPRESSSWITCH) == 0){
+    // Drop the switch from the parameters
+    bCompress = true ;
+    argc-- ;
+    argv++ ;
+  }
+
   if (argc < 2 || argc > 3){
-    printf ("Usage: xbm2bin input.xbm [out.bin]\n\tstdout will be written to if out.bin is omitted\n") ;
+    printf ("Usage: xbm2bin [-c] input.xbm [out.bin]\n\tstdout will be written to if out.bin is omitted\n") ;
+    printf ("\t-c compresses the image, best for images with large plain areas\n") ;
     return 0;
   }
 
@@ -186,10 +198,26 @@ int main (int argc, char **argv)
     
   }
 
-  // Stick out to stdout for now
-  fwrite(&nWidth, sizeof(uint32_t), 1, fout) ;
-  fwrite(&nHeight, sizeof(uint32_t), 1, fout) ;
-  fwrite(imgBuf, buff_size, 1, fout) ;
+  if (!imgBuf){
+    fprintf(stderr, "No image found in %s\n", argv[1]) ;
+    return 1 ;
+  }
+
+  // Write a 1 bit bitmap in the display format
+  DisplayFormatHeader hdr ;
+  hdr.version = DISPLAYFORMAT_VERSION ;
+  hdr.type = DISPLAYFORMAT_BITMAP ;
+  hdr.width = nWidth ;
+  hdr.height = nHeight ;
+  hdr.bitdepth = 1 ;
+  hdr.chars = 1 ;
+  hdr.stride = nWidth/8 + (nWidth%8?1:0) ;
+  hdr.size = buff_size ;
+
+  if (!displayFormatWrite(fout, hdr, imgBuf, bCompress)){
+    fprintf(stderr, "Failed to write image to output\n") ;
+    return 1 ;
+  }
 
   fclose(f) ;
   fclose(fout) ;